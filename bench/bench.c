@@ -0,0 +1,290 @@
+#define _DEFAULT_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "../jblisp.h"
+#include "../prelude.h"
+
+// Benchmark harness: runs every bench/*.jbl script, or those named on the
+// command line, in a fresh process a number of times, and reports the
+// median time, allocations and peak RSS. Results can be saved as a JSON
+// baseline and compared with it. Run it from the root of the repository.
+//
+// Time is measured from the creation of the interpreter, with the prelude
+// image loaded, to the end of the script. Allocations are calls to malloc,
+// calloc and realloc from the interpreter, counted by wrapping them at link
+// time (-Wl,--wrap=malloc,...).
+
+#define BENCH_DIR "bench"
+#define BENCH_MAX 64
+#define BENCH_RUNS_MAX 1000
+// Changes of peak RSS smaller than this are noise from the harness
+#define BENCH_RSS_SLACK_KB 1024
+
+typedef struct {
+    char name[64];
+    double ms;
+    long allocs;
+    long rss_kb;
+    int failed;
+} bench_result;
+
+// What a run sends back to the harness
+typedef struct {
+    long long ns;
+    long allocs;
+    int rc;
+} bench_run;
+
+static atomic_long BENCH_ALLOCS;
+
+void *__real_malloc(size_t);
+void *__real_calloc(size_t, size_t);
+void *__real_realloc(void*, size_t);
+
+void *__wrap_malloc(size_t n) {
+    atomic_fetch_add_explicit(&BENCH_ALLOCS, 1, memory_order_relaxed);
+    return __real_malloc(n);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    atomic_fetch_add_explicit(&BENCH_ALLOCS, 1, memory_order_relaxed);
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t n) {
+    atomic_fetch_add_explicit(&BENCH_ALLOCS, 1, memory_order_relaxed);
+    return __real_realloc(p, n);
+}
+
+static int cmp_str(const void *a, const void *b) {
+    return strcmp(a, b);
+}
+
+static int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long*) a;
+    long long y = *(const long long*) b;
+    return (x > y) - (x < y);
+}
+
+static int cmp_long(const void *a, const void *b) {
+    long x = *(const long*) a;
+    long y = *(const long*) b;
+    return (x > y) - (x < y);
+}
+
+// Names of the scripts in BENCH_DIR, without extension, sorted
+static int bench_list(char names[][64], int max) {
+    DIR *dir = opendir(BENCH_DIR);
+    if (dir == NULL) { return 0; }
+    int n = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL && n < max) {
+        size_t len = strlen(ent->d_name);
+        if (len < 5 || len - 4 >= 64 || strcmp(ent->d_name + len - 4, ".jbl")) {
+            continue;
+        }
+        memcpy(names[n], ent->d_name, len - 4);
+        names[n++][len - 4] = '\0';
+    }
+    closedir(dir);
+    qsort(names, n, 64, cmp_str);
+    return n;
+}
+
+// Run a script once in a child process; its peak RSS is in rss_kb
+static int bench_once(char *path, bench_run *run, long *rss_kb) {
+    int fds[2];
+    if (pipe(fds)) { return -1; }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, 1);
+        atomic_store(&BENCH_ALLOCS, 0);
+        long long start = lclock_ns();
+        linterp *it = linterp_new();
+        lenv_load(linterp_env(it), PRELUDE_IMAGE, PRELUDE_IMAGE_LEN);
+        int rc = exec_file(it, path);
+        bench_run r = {lclock_ns() - start, atomic_load(&BENCH_ALLOCS), rc};
+        _exit(write(fds[1], &r, sizeof(r)) != sizeof(r));
+    }
+    close(fds[1]);
+    if (pid < 0) {
+        close(fds[0]);
+        return -1;
+    }
+    ssize_t n = read(fds[0], run, sizeof(*run));
+    close(fds[0]);
+    int status;
+    struct rusage ru;
+    wait4(pid, &status, 0, &ru);
+    *rss_kb = ru.ru_maxrss;
+    if (n != sizeof(*run) || !WIFEXITED(status) || WEXITSTATUS(status)) {
+        return -1;
+    }
+    return run->rc;
+}
+
+// Run a script runs times after a warmup run, and keep the medians and
+// the highest peak RSS
+static void bench_script(bench_result *res, int runs) {
+    char path[128];
+    snprintf(path, sizeof(path), "%s/%s.jbl", BENCH_DIR, res->name);
+    long long ns[BENCH_RUNS_MAX];
+    long allocs[BENCH_RUNS_MAX];
+    bench_run run;
+    long rss_kb;
+    res->rss_kb = 0;
+    res->failed = bench_once(path, &run, &rss_kb) != 0;
+    for (int i=0; i < runs && !res->failed; i++) {
+        res->failed = bench_once(path, &run, &rss_kb) != 0;
+        ns[i] = run.ns;
+        allocs[i] = run.allocs;
+        if (rss_kb > res->rss_kb) { res->rss_kb = rss_kb; }
+    }
+    if (res->failed) { return; }
+    qsort(ns, runs, sizeof(long long), cmp_ll);
+    qsort(allocs, runs, sizeof(long), cmp_long);
+    res->ms = ns[runs / 2] / 1e6;
+    res->allocs = allocs[runs / 2];
+}
+
+// Read a baseline written by bench_save. Returns the number of results.
+static int bench_load(const char *filename, bench_result *base, int max) {
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) { return -1; }
+    int n = 0;
+    char name[64];
+    while (n < max && fscanf(f, " { ") >= 0 &&
+           fscanf(f, " \"%63[^\"]\" : { \"ms\" : %lf , \"allocs\" : %li , "
+                  "\"rss_kb\" : %li } ,", name, &base[n].ms,
+                  &base[n].allocs, &base[n].rss_kb) == 4) {
+        strcpy(base[n].name, name);
+        base[n++].failed = 0;
+    }
+    fclose(f);
+    return n;
+}
+
+static int bench_save(const char *filename, bench_result *res, int n) {
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) { return -1; }
+    fputs("{\n", f);
+    int first = 1;
+    for (int i=0; i < n; i++) {
+        if (res[i].failed) { continue; }
+        fprintf(f, "%s  \"%s\": {\"ms\": %.3f, \"allocs\": %li, \"rss_kb\": %li}",
+                first ? "" : ",\n", res[i].name, res[i].ms, res[i].allocs,
+                res[i].rss_kb);
+        first = 0;
+    }
+    fputs("\n}\n", f);
+    return fclose(f);
+}
+
+// Relative change from base to x, in percent
+static double bench_change(double x, double base) {
+    return base > 0 ? 100.0 * (x - base) / base : 0;
+}
+
+static void usage() {
+    puts("Usage: bin/bench [--runs N] [--baseline FILE] [--save FILE]\n"
+         "                 [--threshold PERCENT] [BENCHMARK...]\n\n"
+         "Runs the scripts in " BENCH_DIR "/ and reports the median time and\n"
+         "allocations and the peak RSS of each. With a baseline, which is\n"
+         BENCH_DIR "/baseline.json by default, results more than PERCENT\n"
+         "(default 15) above it are flagged and the exit status is 1.");
+}
+
+int main(int argc, char **argv) {
+    int runs = 5;
+    double threshold = 15;
+    char *baseline = BENCH_DIR "/baseline.json";
+    char *save = NULL;
+    char names[BENCH_MAX][64];
+    int count = 0;
+    for (int i=1; i < argc; i++) {
+        if (strcmp(argv[i], "--runs") == 0 && i+1 < argc) {
+            runs = atoi(argv[++i]);
+            if (runs < 1 || runs > BENCH_RUNS_MAX) {
+                printf("--runs expects a number from 1 to %d.\n", BENCH_RUNS_MAX);
+                return 2;
+            }
+        } else if (strcmp(argv[i], "--baseline") == 0 && i+1 < argc) {
+            baseline = argv[++i];
+        } else if (strcmp(argv[i], "--save") == 0 && i+1 < argc) {
+            save = argv[++i];
+        } else if (strcmp(argv[i], "--threshold") == 0 && i+1 < argc) {
+            threshold = atof(argv[++i]);
+        } else if (argv[i][0] == '-') {
+            usage();
+            return 2;
+        } else if (count < BENCH_MAX) {
+            snprintf(names[count++], 64, "%s", argv[i]);
+        }
+    }
+    if (count == 0) {
+        count = bench_list(names, BENCH_MAX);
+    }
+
+    bench_result base[BENCH_MAX];
+    int base_count = bench_load(baseline, base, BENCH_MAX);
+    if (base_count < 0 && strcmp(baseline, BENCH_DIR "/baseline.json")) {
+        printf("Could not read baseline '%s'.\n", baseline);
+        return 2;
+    }
+
+    bench_result res[BENCH_MAX];
+    int regressions = 0;
+    int failures = 0;
+    printf("%-12s %10s %10s %9s", "benchmark", "median ms", "allocs", "peak KB");
+    if (base_count > 0) {
+        printf("   %7s %7s %7s", "time", "allocs", "rss");
+    }
+    printf("\n");
+    for (int i=0; i < count; i++) {
+        strcpy(res[i].name, names[i]);
+        bench_script(&res[i], runs);
+        if (res[i].failed) {
+            printf("%-12s failed\n", res[i].name);
+            failures++;
+            continue;
+        }
+        printf("%-12s %10.3f %10li %9li", res[i].name, res[i].ms,
+               res[i].allocs, res[i].rss_kb);
+        for (int j=0; j < base_count; j++) {
+            if (strcmp(base[j].name, res[i].name)) { continue; }
+            double ms = bench_change(res[i].ms, base[j].ms);
+            double allocs = bench_change(res[i].allocs, base[j].allocs);
+            double rss = bench_change(res[i].rss_kb, base[j].rss_kb);
+            int regressed = ms > threshold || allocs > threshold ||
+                (rss > threshold &&
+                 res[i].rss_kb - base[j].rss_kb > BENCH_RSS_SLACK_KB);
+            printf("   %+6.1f%% %+6.1f%% %+6.1f%%%s",
+                   ms, allocs, rss, regressed ? "  REGRESSION" : "");
+            regressions += regressed;
+        }
+        printf("\n");
+    }
+
+    if (save != NULL && bench_save(save, res, count)) {
+        printf("Could not write baseline '%s'.\n", save);
+        return 2;
+    }
+    if (failures) {
+        printf("%d benchmarks failed.\n", failures);
+    }
+    if (regressions) {
+        printf("%d benchmarks regressed by more than %.1f%%.\n",
+               regressions, threshold);
+    }
+    return failures || regressions;
+}
@@ -0,0 +1,321 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../jblisp.h"
+
+// Microbenchmarks of the core primitives, in ns per operation. Cases run in
+// batches: the inputs of a batch are made, the operation is timed on each
+// of them, then its results are freed, so that only the operation itself
+// is measured. Every case runs MB_ROUNDS times and the fastest round is
+// kept. Run it from the root of the repository.
+
+#define MB_BATCH 256
+#define MB_ROUNDS 3
+#define MB_ITERATIONS 100000
+
+typedef struct mb_case mb_case;
+struct mb_case {
+    const char *bench;
+    const char *name;
+    // Iterations are divided by this for the inputs that take longer
+    long scale;
+    // Make the state of the case; returns -1 to skip it
+    int (*setup)(mb_case*);
+    // Make a fresh input for one operation, untimed; NULL for none
+    lval *(*input)(mb_case*);
+    // The operation timed; its result is freed untimed
+    lval *(*op)(mb_case*, lval*);
+    long size;
+    char *src;
+    lval *value;
+    lenv *env;
+    lenv *root;
+    char sym[32];
+};
+
+static linterp *MB_INTERP;
+
+// A list of the integers from 1 to n
+static lval *mb_list(long n) {
+    lval *v = lval_qexpr();
+    for (long i=1; i <= n; i++) {
+        lval_add(v, lval_lng(i));
+    }
+    return v;
+}
+
+// A tree of lists of the given depth, with fanout children per node
+static lval *mb_tree(int depth, int fanout) {
+    if (depth == 0) { return lval_lng(0); }
+    lval *v = lval_qexpr();
+    for (int i=0; i < fanout; i++) {
+        lval_add(v, mb_tree(depth - 1, fanout));
+    }
+    return v;
+}
+
+static lval *mb_string(long n) {
+    char *s = malloc(n + 1);
+    for (long i=0; i < n; i++) {
+        s[i] = i % 16 == 15 ? '"' : 'a' + i % 26;
+    }
+    lval *v = lval_str(s, n);
+    free(s);
+    return v;
+}
+
+// Values of various sizes, by name
+static int mb_setup_value(mb_case *c) {
+    if (strcmp(c->name, "integer") == 0) {
+        c->value = lval_lng(42);
+    } else if (strcmp(c->name, "float") == 0) {
+        c->value = lval_dbl(3.25);
+    } else if (strncmp(c->name, "string-", 7) == 0) {
+        c->value = mb_string(c->size);
+    } else if (strncmp(c->name, "list-", 5) == 0) {
+        c->value = mb_list(c->size);
+    } else if (strncmp(c->name, "frozen-list-", 12) == 0) {
+        c->value = mb_list(c->size);
+        lval_freeze(c->value);
+    } else if (strncmp(c->name, "tree-", 5) == 0) {
+        c->value = mb_tree(c->size, 4);
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+// An env of size bindings, or a chain of size envs of 10 bindings each; the
+// symbol looked up is the last one bound in the outermost env.
+static int mb_setup_env(mb_case *c) {
+    int chain = strncmp(c->name, "chain-", 6) == 0;
+    int envs = chain ? c->size : 1;
+    int bindings = chain ? 10 : c->size;
+    lenv *e = NULL;
+    for (int i=0; i < envs; i++) {
+        e = lenv_new(e);
+        if (i == 0) { c->root = e; }
+        for (int j=0; j < bindings; j++) {
+            char sym[32];
+            snprintf(sym, sizeof(sym), "sym-%d-%d", i, j);
+            lval *v = lval_lng(j);
+            lenv_put(e, sym, v);
+            lval_del(v);
+        }
+    }
+    c->env = e;
+    snprintf(c->sym, sizeof(c->sym), "sym-0-%d", bindings - 1);
+    return 0;
+}
+
+// The source of c->name, evaluated in the global env of the interpreter,
+// which has the builtins and sq
+static int mb_setup_expr(mb_case *c) {
+    lval *line = read_line(MB_INTERP, (char*) c->name, NULL);
+    if (lval_type(line) == LVAL_ERR || lval_type(line) != LVAL_SEXPR) {
+        lval_del(line);
+        return -1;
+    }
+    c->value = lval_take(line, 0);
+    c->env = linterp_env(MB_INTERP);
+    return 0;
+}
+
+// Source code to parse: a call, a definition, or the prelude
+static int mb_setup_source(mb_case *c) {
+    if (strcmp(c->name, "lang/base.jbl") != 0) {
+        c->src = strdup(c->name);
+        return 0;
+    }
+    FILE *f = fopen(c->name, "r");
+    if (f == NULL) { return -1; }
+    fseek(f, 0, SEEK_END);
+    long n = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    c->src = malloc(n + 1);
+    c->src[fread(c->src, 1, n, f)] = '\0';
+    fclose(f);
+    return 0;
+}
+
+static lval *mb_input_copy(mb_case *c) {
+    return lval_copy(c->value);
+}
+
+static lval *mb_op_copy(mb_case *c, lval *in) {
+    return lval_copy(c->value);
+}
+
+static lval *mb_op_get(mb_case *c, lval *in) {
+    return lenv_get(c->env, c->sym);
+}
+
+static lval *mb_op_eval(mb_case *c, lval *in) {
+    return lval_eval_sexpr(c->env, in);
+}
+
+static lval *mb_op_repr(mb_case *c, lval *in) {
+    return lval_repr(in);
+}
+
+static lval *mb_op_parse(mb_case *c, lval *in) {
+    return read_line(MB_INTERP, c->src, NULL);
+}
+
+#define MB_COPY(name, size, scale) \
+    {"lval_copy", name, scale, mb_setup_value, NULL, mb_op_copy, size}
+#define MB_GET(name, size) \
+    {"lenv_get", name, 1, mb_setup_env, NULL, mb_op_get, size}
+#define MB_EVAL(src, scale) \
+    {"lval_eval_sexpr", src, scale, mb_setup_expr, mb_input_copy, mb_op_eval, 0}
+#define MB_REPR(name, size, scale) \
+    {"lval_repr", name, scale, mb_setup_value, mb_input_copy, mb_op_repr, size}
+#define MB_PARSE(src, scale) \
+    {"parse", src, scale, mb_setup_source, NULL, mb_op_parse, 0}
+
+static mb_case CASES[] = {
+    MB_COPY("integer", 0, 1),
+    MB_COPY("string-64", 64, 1),
+    MB_COPY("list-10", 10, 1),
+    MB_COPY("list-1000", 1000, 100),
+    MB_COPY("frozen-list-1000", 1000, 1),
+    MB_COPY("tree-5", 5, 100),
+    MB_GET("bindings-1", 1),
+    MB_GET("bindings-10", 10),
+    MB_GET("bindings-100", 100),
+    MB_GET("bindings-1000", 1000),
+    MB_GET("chain-1", 1),
+    MB_GET("chain-4", 4),
+    MB_GET("chain-16", 16),
+    MB_EVAL("(+ 1 2)", 1),
+    MB_EVAL("(head {1 2 3})", 1),
+    MB_EVAL("(if #t {1} {2})", 1),
+    MB_EVAL("(sq 3)", 1),
+    MB_EVAL("(sq (+ 1 (* 2 3)))", 1),
+    MB_REPR("integer", 0, 1),
+    MB_REPR("float", 0, 1),
+    MB_REPR("string-64", 64, 1),
+    MB_REPR("list-1000", 1000, 100),
+    MB_REPR("tree-5", 5, 100),
+    MB_PARSE("(+ 1 2)", 10),
+    MB_PARSE("(fun {fib n} {(if (< n 2) {n} {(+ (fib (- n 1)) (fib (- n 2)))})})", 100),
+    MB_PARSE("lang/base.jbl", 1000),
+    {NULL}
+};
+
+// Time iterations operations of c, in batches; returns the nanoseconds
+static long long mb_round(mb_case *c, long iterations) {
+    lval *in[MB_BATCH];
+    lval *out[MB_BATCH];
+    long long ns = 0;
+    for (long done=0; done < iterations; done += MB_BATCH) {
+        for (int i=0; i < MB_BATCH; i++) {
+            in[i] = c->input != NULL ? c->input(c) : NULL;
+        }
+        long long start = lclock_ns();
+        for (int i=0; i < MB_BATCH; i++) {
+            out[i] = c->op(c, in[i]);
+        }
+        ns += lclock_ns() - start;
+        for (int i=0; i < MB_BATCH; i++) {
+            lval_del(out[i]);
+        }
+    }
+    return ns;
+}
+
+static void mb_cleanup(mb_case *c) {
+    if (c->value != NULL) { lval_del(c->value); }
+    // Envs made by mb_setup_env, from the innermost to root
+    for (lenv *e = c->root != NULL ? c->env : NULL; e != NULL; ) {
+        lenv *parent = e != c->root ? lenv_parent(e) : NULL;
+        lenv_del(e);
+        e = parent;
+    }
+    free(c->src);
+}
+
+// Whether the case is selected by one of the names, which are benchmarks
+// such as lenv_get or cases such as lenv_get/chain-4
+static int mb_selected(mb_case *c, char **names, int count) {
+    if (count == 0) { return 1; }
+    size_t len = strlen(c->bench);
+    for (int i=0; i < count; i++) {
+        if (strcmp(names[i], c->bench) == 0 ||
+            (strncmp(names[i], c->bench, len) == 0 && names[i][len] == '/' &&
+             strcmp(names[i] + len + 1, c->name) == 0)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void usage() {
+    puts("Usage: bin/microbench [--iterations N] [--csv] [BENCHMARK[/CASE]...]\n\n"
+         "Times the core primitives of the interpreter and reports ns per\n"
+         "operation, the fastest of 3 rounds of N iterations (default\n"
+         "100000, fewer for the larger inputs). --csv prints\n"
+         "benchmark,case,iterations,ns_per_op lines instead of a table.");
+}
+
+int main(int argc, char **argv) {
+    long iterations = MB_ITERATIONS;
+    int csv = 0;
+    char **names = argv + argc;
+    int count = 0;
+    for (int i=1; i < argc; i++) {
+        if (strcmp(argv[i], "--iterations") == 0 && i+1 < argc) {
+            iterations = atol(argv[++i]);
+            if (iterations < 1) {
+                puts("--iterations expects a positive number.");
+                return 2;
+            }
+        } else if (strcmp(argv[i], "--csv") == 0) {
+            csv = 1;
+        } else if (argv[i][0] == '-') {
+            usage();
+            return 2;
+        } else {
+            names = argv + i;
+            count = argc - i;
+            break;
+        }
+    }
+
+    MB_INTERP = linterp_new();
+    lval_del(eval_line(MB_INTERP, "(fun {sq x} {(* x x)})"));
+    if (csv) {
+        puts("benchmark,case,iterations,ns_per_op");
+    } else {
+        printf("%-16s %-18s %10s %10s\n", "benchmark", "case", "iterations",
+               "ns/op");
+    }
+    int failures = 0;
+    for (mb_case *c = CASES; c->bench != NULL; c++) {
+        if (!mb_selected(c, names, count)) { continue; }
+        if (c->setup(c)) {
+            fprintf(stderr, "Could not set up %s/%s.\n", c->bench, c->name);
+            failures++;
+            continue;
+        }
+        long n = iterations / c->scale;
+        n = n < MB_BATCH ? MB_BATCH : (n + MB_BATCH - 1) / MB_BATCH * MB_BATCH;
+        long long best = 0;
+        for (int r=0; r < MB_ROUNDS; r++) {
+            long long ns = mb_round(c, n);
+            if (r == 0 || ns < best) { best = ns; }
+        }
+        if (csv) {
+            printf("%s,\"%s\",%li,%.1f\n", c->bench, c->name, n,
+                   (double) best / n);
+        } else {
+            printf("%-16s %-18.18s %10li %10.1f\n", c->bench, c->name, n,
+                   (double) best / n);
+        }
+        fflush(stdout);
+        mb_cleanup(c);
+    }
+    linterp_del(MB_INTERP);
+    return failures != 0;
+}
@@ -1,6 +1,12 @@
 #!/bin/bash
 set -eux
 mkdir -p build bin
-gcc -Wall -std=c11 -c -g mpc.c -g jblisp.c -g repl.c -g tests/test.c
-gcc -o bin/jblisp mpc.o jblisp.o repl.o -lm -lreadline
-gcc -o bin/test mpc.o jblisp.o test.o -lm
+gcc -Wall -std=c11 -c -g mpc.c -g pool.c -g jblisp.c -g server.c -g repl.c -g tests/test.c -g bench/bench.c -g bench/microbench.c -g tools/mkprelude.c -g tools/heapsum.c
+gcc -o bin/mkprelude mpc.o pool.o jblisp.o mkprelude.o -lm -pthread
+gcc -o bin/heapsum heapsum.o
+./bin/mkprelude lang/base.jbl build/prelude.c
+gcc -Wall -std=c11 -c -g build/prelude.c -o build/prelude.o
+gcc -o bin/jblisp mpc.o pool.o jblisp.o server.o repl.o build/prelude.o -lm -lreadline -pthread
+gcc -o bin/test mpc.o pool.o jblisp.o server.o test.o -lm -pthread
+gcc -o bin/bench -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc mpc.o pool.o jblisp.o bench.o build/prelude.o -lm -pthread
+gcc -o bin/microbench mpc.o pool.o jblisp.o microbench.o -lm -pthread
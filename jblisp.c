@@ -1,7 +1,25 @@
+#define _GNU_SOURCE
+#include <limits.h>
+#include <malloc.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
 
 #include "mpc.h"
 #include "jblisp.h"
+#include "pool.h"
 
 #define LASSERT(args, cond, err) \
     if (!(cond)) { lval_del(args); return lval_err(err); }
@@ -25,32 +43,29 @@
         return err;                                                        \
     }
 
+#define LASSERT_LAZY(fname, args, idx)                                     \
+    if (!lval_is_lazy(args->val.cell[idx])) {                              \
+        lval *err = lval_err(                                              \
+            "Procedure '%s' expected argument %i to be a lazy sequence.",  \
+            fname, idx+1);                                                 \
+        lval_del(args);                                                    \
+        return err;                                                        \
+    }
 
-#ifdef JBLISPC_DEBUG_MEM
-long COUNT_LENVNEW;
-long COUNT_LENVCPY;
-long COUNT_LENVDEL;
-long COUNT_LPROCNEW;
-long COUNT_LPROCCPY;
-long COUNT_LPROCDEL;
-long COUNT_LVALNEW;
-long COUNT_LVALCPY;
-long COUNT_LVALDEL;
-lenv *LENVS[1000];
-#endif
 
-// JBLisp builtin types
-enum { LVAL_BOOL, LVAL_LNG, LVAL_DBL, LVAL_ERR, LVAL_SYM, LVAL_STR,
-       LVAL_BUILTIN, LVAL_PROC, LVAL_SEXPR, LVAL_QEXPR };
 char *TYPE_NAMES[] = {
     "boolean", "integer", "float", "error", "symbol", "string",
-    "builtin", "procedure", "list", "quoted list"
+    "builtin", "procedure", "list", "quoted list", "future", "channel",
+    "actor", "promise", "port"
 };
 
 struct _lval {
     int type;
     int count;
     int size;
+    // Zero for a value with a single owner. A frozen value is immutable,
+    // deeply, and shared by refs owners; see lval_freeze.
+    atomic_int refs;
     union {
         enum {LFALSE=0, LTRUE=!LFALSE} bool;
         double dbl;
@@ -59,40 +74,483 @@ struct _lval {
         lval **cell;
         lbuiltin builtin;
         lproc *proc;
+        lfuture *future;
+        lchan *chan;
+        lmailbox *mailbox;
+        lpromise *promise;
+        lport *port;
     } val;
 };
 
+// Where a procedure was made: the procedure that made it, or else the
+// top-level expression that was being evaluated, since values carry no
+// positions of their own. Sites are interned and never freed, so that a
+// call frame is one pointer which outlives the procedure, see lsite_intern.
+typedef struct _lsite lsite;
+struct _lsite {
+    const char *name; // interned, NULL for an anonymous procedure
+    const char *file; // interned, NULL if unknown
+    int line;
+    const lsite *anon; // the site without a name at the same place
+    lsite *next;
+};
+
+// The site of procedures made where no interpreter is evaluating a file
+static lsite LSITE_NONE = {NULL, NULL, 0, &LSITE_NONE, NULL};
+
 struct _lproc {
     lval *params;
     lval *body;
     lenv *closure;
+    const lsite *site;
+};
+
+// A future is shared by all copies of its lval and by the task computing
+// it, and freed with the last of them.
+struct _lfuture {
+    atomic_int refs;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done;
+    lval *body;
+    lenv *env;
+    lval *result;
+    lsnapshot *shared; // the global env env reads through, NULL if copied
+};
+
+// A delayed evaluation, shared by all copies of its lval. A native promise
+// calls thunk with the arguments held in body instead of evaluating it.
+struct _lpromise {
+    atomic_int refs;
+    lval *body;
+    lenv *env;
+    lbuiltin thunk;
+    lval *value;
+    int forcing;
 };
 
 struct _lenv {
     int count;
     int size;
     lenv *encl; // enclosing environment
+    lenv *base; // env a fork reads through, see lenv_fork
     char **syms;
     lval **vals;
+    // Set once a procedure, promise or coroutine refers to the env, or to
+    // one it encloses; see lenv_capture. Shared envs are captured from
+    // worker threads too.
+    atomic_int captured;
+    // Set while the interpreter keeps a copy of the env for futures
+    int shared;
+};
+
+// A copy of the global env of an interpreter, shared read-only by the
+// futures made until the env next changes, see lenv_snapshot.
+struct _lsnapshot {
+    atomic_int refs;
+    lenv *env;
+};
+
+// Sites of the procedures being called, outermost first, for the profiler
+// and backtraces. Calls deeper than LPROF_DEPTH are counted but not kept.
+#define LPROF_DEPTH 64
+typedef struct {
+    const lsite *sites[LPROF_DEPTH];
+    int depth;
+} lprof_stack;
+
+// The last LCALLS_RECENT procedures called on a thread, for post-mortem: a
+// call stores its site at count % LCALLS_RECENT, then counts itself.
+#define LCALLS_RECENT 64
+typedef struct {
+    const lsite *sites[LCALLS_RECENT];
+    unsigned long count;
+} lcalls;
+
+// A coroutine of an interpreter, see spawn. The main coroutine is the
+// thread the interpreter runs on and has no stack of its own.
+typedef struct _lco lco;
+struct _lco {
+    ucontext_t ctx;
+    char *stack;
+    lprof_stack prof;
+    // The env def* defines in, a fork that stands for the global env, see
+    // lenv_globals; NULL outside of one
+    lenv *globals;
+    lval *body;
+    lenv *env;
+    int deadlock;
+    // Procedures called, and the limits of the evaluation the coroutine
+    // runs: the step count and heap bytes of the thread past which calls
+    // fail, 0 for none, and the depth of Lisp calls it may reach. Each
+    // coroutine has its own, so that with-limits bodies that yield do not
+    // limit the others; see linterp_start_limits and spawn.
+    long long steps;
+    long long step_limit;
+    long heap_limit;
+    long depth_limit;
+    // Set when a call failed on a limit, see with-limits
+    int limit_hit;
+    struct _lcoqueue *waiting; // queue the coroutine is blocked on
+    lco *next;                 // next in the ready or a wait queue
+    lco *live_prev;
+    lco *live_next;
+};
+
+typedef struct _lcoqueue {
+    lco *head;
+    lco *tail;
+} lcoqueue;
+
+// One direction of a port, see lio_wait
+typedef struct {
+    int fd;
+    int registered;
+    lcoqueue waiters;
+} lportfd;
+
+// A file, or the stdin and stdout of a process, read and written without
+// blocking the other coroutines of the interpreter
+struct _lport {
+    atomic_int refs;
+    lportfd in;  // fd -1 unless readable
+    lportfd out; // fd -1 unless writable
+    pid_t pid;   // of the process, 0 for a file
+    char *buf;   // input read but not yet consumed is [start, len)
+    int start;
+    int len;
+    int size;
+    int eof;
+};
+
+// The queue of messages of an interpreter, shared by its actor values
+struct _lmailbox {
+    atomic_int refs;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    lval **msgs;
+    int head;
+    int count;
+    int size;
+    // Counts the messages put once a receiver waits for I/O as well, -1
+    // before; see builtin_receive
+    int efd;
+};
+
+// A bounded channel between coroutines of an interpreter
+struct _lchan {
+    atomic_int refs;
+    int size;
+    int count;
+    int head;
+    lval **buf;
+    lcoqueue senders;
+    lcoqueue receivers;
+};
+
+#define LCO_STACK_SIZE (8 * 1024 * 1024)
+// C stack kept free by evaluation, for builtins and errors, see lstack_limit
+#define LSTACK_MARGIN (256 * 1024)
+#define LCO_STACKS_CACHED 64
+// Calls a coroutine makes before letting the others run
+#define LCO_REDUCTIONS 1000
+// Calls made between two reads of the clock under a timeout
+#define LDEADLINE_TICKS 1024
+
+// An interpreter owns everything that used to be process-wide: its parser,
+// its global env and, in debug builds, its allocation counters. Distinct
+// interpreters share nothing, so each may run on its own thread.
+struct _linterp {
+    lenv *env;
+    lsnapshot *snapshot; // of env, made by the first future to need it
+    int indent;
+    mpc_parser_t *Comment;
+    mpc_parser_t *Boolean;
+    mpc_parser_t *Number;
+    mpc_parser_t *Symbol;
+    mpc_parser_t *String;
+    mpc_parser_t *Sexpr;
+    mpc_parser_t *Qexpr;
+    mpc_parser_t *Expr;
+    mpc_parser_t *JBLisp;
+    // Coroutines
+    lco main;
+    lco *current;
+    lco *live;
+    lco *zombie;
+    lcoqueue ready;
+    int reductions;
+    char *stacks[LCO_STACKS_CACHED];
+    int stacks_count;
+    // Event loop, created on first use
+    int epfd;
+    int io_waiting;
+    lmailbox *mailbox;
+    lportfd mail; // the eventfd of mailbox, see builtin_receive
+    // Monotonic time in ns past which evaluation fails, 0 for none, -1
+    // once it has passed
+    long long deadline;
+    int ticks;
+    // Procedures called on the thread of the interpreter, see time
+    long long steps;
+    // Limits of every evaluation, see linterp_set_limits; those of the
+    // current one are kept by the coroutines
+    llimits limits;
+    // Site of the procedures made by the top-level expression being
+    // evaluated, see linterp_locate
+    const lsite *site;
+#ifdef JBLISPC_DEBUG_MEM
+    long count_lenvnew;
+    long count_lenvcpy;
+    long count_lenvdel;
+    long count_lprocnew;
+    long count_lproccpy;
+    long count_lprocdel;
+    long count_lvalnew;
+    long count_lvalcpy;
+    long count_lvaldel;
+    lenv **lenvs;
+    long lenvs_size;
+#endif
+};
+
+// The interpreter running on this thread, set for the duration of
+// load_file and exec_line so that builtins can reach it.
+static _Thread_local linterp *LINTERP;
+// Nonzero while this thread evaluates a parallel procedure
+static _Thread_local int LPARALLEL;
+// Procedure calls of a thread without an interpreter, see lprof_stack
+static _Thread_local lprof_stack LPROF_THREAD;
+// Procedure calls of this thread, see lcalls
+static _Thread_local lcalls LCALLS;
+// The env def* defines in on a thread without an interpreter, see
+// lenv_globals
+static _Thread_local lenv *LGLOBALS_THREAD;
+// Lowest address the C stack of this thread may reach, see lstack_limit
+static _Thread_local char *LSTACK_THREAD;
+
+// Allocation counters. Every thread counts in its own block, which only it
+// writes, so that counting takes a load and a store; readers sum the blocks
+// of all threads. The block of a thread that exits is reused by the next
+// one to start, counts included.
+struct _lstats {
+    atomic_long lval_new[LVAL_TYPES];
+    atomic_long lval_del[LVAL_TYPES];
+    atomic_long lproc_new;
+    atomic_long lproc_del;
+    atomic_long lenv_new;
+    atomic_long lenv_del;
+    // Heap bytes allocated less those freed, and the part of them added to
+    // LHEAP_LIVE, see lheap_add
+    atomic_long heap_bytes;
+    long heap_flushed;
+    lstats *next;
+    lstats *next_free;
 };
 
+static lstats *LSTATS_ALL;
+static lstats *LSTATS_FREE;
+static pthread_mutex_t LSTATS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t LSTATS_KEY;
+static pthread_once_t LSTATS_ONCE = PTHREAD_ONCE_INIT;
+static _Thread_local lstats *LSTATS;
+
+#define LSTAT_ADD(counter, n) do {                                        \
+        lstats *s_ = LSTATS != NULL ? LSTATS : lstats_thread();          \
+        atomic_store_explicit(&s_->counter,                               \
+            atomic_load_explicit(&s_->counter, memory_order_relaxed) + (n), \
+            memory_order_relaxed);                                        \
+    } while (0)
+#define LSTAT_INC(counter) LSTAT_ADD(counter, 1)
+
+void lstats_release(void *arg) {
+    lstats *s = arg;
+    pthread_mutex_lock(&LSTATS_LOCK);
+    s->next_free = LSTATS_FREE;
+    LSTATS_FREE = s;
+    pthread_mutex_unlock(&LSTATS_LOCK);
+}
+
+void lstats_init() {
+    pthread_key_create(&LSTATS_KEY, lstats_release);
+}
+
+// The block of the calling thread, taken on its first allocation
+lstats *lstats_thread() {
+    pthread_once(&LSTATS_ONCE, lstats_init);
+    pthread_mutex_lock(&LSTATS_LOCK);
+    lstats *s = LSTATS_FREE;
+    if (s != NULL) {
+        LSTATS_FREE = s->next_free;
+    } else {
+        s = calloc(1, sizeof(lstats));
+        s->next = LSTATS_ALL;
+        LSTATS_ALL = s;
+    }
+    pthread_mutex_unlock(&LSTATS_LOCK);
+    pthread_setspecific(LSTATS_KEY, s);
+    LSTATS = s;
+    return s;
+}
+
+// Heap accounting. lvals, lenvs and lprocs, with the strings, lists and
+// bindings they own, are allocated with lheap_malloc and friends, and freed
+// with lheap_free; other memory is not counted. Every thread adds the bytes
+// it allocates and frees to its stats block, and to LHEAP_LIVE only once
+// they differ from what it added last by LHEAP_BATCH, so that the shared
+// counters are written now and then rather than on every allocation.
+// LHEAP_LIVE, and LHEAP_PEAK, its high-water mark, are thus off by up to
+// LHEAP_BATCH bytes per thread.
+#define LHEAP_BATCH 4096
+
+static atomic_long LHEAP_LIVE;
+static atomic_long LHEAP_PEAK;
+
+static void lheap_flush(lstats *s) {
+    long bytes = atomic_load_explicit(&s->heap_bytes, memory_order_relaxed);
+    long n = bytes - s->heap_flushed;
+    s->heap_flushed = bytes;
+    long live = atomic_fetch_add_explicit(&LHEAP_LIVE, n, memory_order_relaxed) + n;
+    long peak = atomic_load_explicit(&LHEAP_PEAK, memory_order_relaxed);
+    while (live > peak &&
+           !atomic_compare_exchange_weak_explicit(&LHEAP_PEAK, &peak, live,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed)) {}
+}
+
+static void lheap_add(long n) {
+    lstats *s = LSTATS != NULL ? LSTATS : lstats_thread();
+    long bytes = atomic_load_explicit(&s->heap_bytes, memory_order_relaxed) + n;
+    atomic_store_explicit(&s->heap_bytes, bytes, memory_order_relaxed);
+    if (bytes - s->heap_flushed > LHEAP_BATCH ||
+        s->heap_flushed - bytes > LHEAP_BATCH) {
+        lheap_flush(s);
+    }
+}
+
+// Heap bytes the calling thread allocated less those it freed, exactly;
+// this is what the heap limits of its interpreter count, see
+// linterp_start_limits
+long lheap_thread() {
+    lstats *s = LSTATS != NULL ? LSTATS : lstats_thread();
+    return atomic_load_explicit(&s->heap_bytes, memory_order_relaxed);
+}
+
+void *lheap_malloc(size_t n) {
+    void *p = malloc(n);
+    if (p != NULL) { lheap_add(malloc_usable_size(p)); }
+    return p;
+}
+
+void *lheap_calloc(size_t n, size_t size) {
+    void *p = calloc(n, size);
+    if (p != NULL) { lheap_add(malloc_usable_size(p)); }
+    return p;
+}
+
+void *lheap_realloc(void *p, size_t n) {
+    long old = p != NULL ? (long) malloc_usable_size(p) : 0;
+    void *q = realloc(p, n);
+    if (q != NULL || n == 0) {
+        lheap_add((q != NULL ? (long) malloc_usable_size(q) : 0) - old);
+    }
+    return q;
+}
+
+void lheap_free(void *p) {
+    if (p == NULL) { return; }
+    lheap_add(-(long) malloc_usable_size(p));
+    free(p);
+}
+
+void lmemstats_read(lmemstats *out) {
+    memset(out, 0, sizeof(*out));
+    pthread_mutex_lock(&LSTATS_LOCK);
+    for (lstats *s = LSTATS_ALL; s != NULL; s = s->next) {
+        for (int t=0; t < LVAL_TYPES; t++) {
+            out->lval_allocs[t] += atomic_load_explicit(&s->lval_new[t], memory_order_relaxed);
+            out->lval_frees[t] += atomic_load_explicit(&s->lval_del[t], memory_order_relaxed);
+        }
+        out->lproc_allocs += atomic_load_explicit(&s->lproc_new, memory_order_relaxed);
+        out->lproc_frees += atomic_load_explicit(&s->lproc_del, memory_order_relaxed);
+        out->lenv_allocs += atomic_load_explicit(&s->lenv_new, memory_order_relaxed);
+        out->lenv_frees += atomic_load_explicit(&s->lenv_del, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&LSTATS_LOCK);
+}
+
+// Objects of all kinds allocated so far
+long lmemstats_allocs(lmemstats *st) {
+    long n = st->lproc_allocs + st->lenv_allocs;
+    for (int t=0; t < LVAL_TYPES; t++) {
+        n += st->lval_allocs[t];
+    }
+    return n;
+}
+
+// Bytes are those of the live objects themselves, without the strings,
+// lists and bindings they point to.
+void lmemstats_print_count(FILE *f, char *name, long allocs, long frees,
+                           size_t size) {
+    fprintf(f, "\"%s\": {\"allocs\": %li, \"frees\": %li, \"live\": %li, "
+            "\"bytes\": %li}", name, allocs, frees, allocs - frees,
+            (allocs - frees) * (long) size);
+}
+
+void lmemstats_print_json(FILE *f) {
+    lmemstats st;
+    lmemstats_read(&st);
+    fputs("{\n  \"lval\": {\n", f);
+    for (int t=0; t < LVAL_TYPES; t++) {
+        fputs("    ", f);
+        lmemstats_print_count(f, TYPE_NAMES[t], st.lval_allocs[t],
+                              st.lval_frees[t], sizeof(lval));
+        fputs(t < LVAL_TYPES - 1 ? ",\n" : "\n  },\n  ", f);
+    }
+    lmemstats_print_count(f, "lproc", st.lproc_allocs, st.lproc_frees,
+                          sizeof(lproc));
+    fputs(",\n  ", f);
+    lmemstats_print_count(f, "lenv", st.lenv_allocs, st.lenv_frees,
+                          sizeof(lenv));
+    fputs("\n}\n", f);
+}
+
+#ifdef JBLISPC_DEBUG_MEM
+#define LCOUNT(counter) if (LINTERP != NULL) { LINTERP->count_##counter++; }
+
+void linterp_track_lenv(lenv *e) {
+    linterp *it = LINTERP;
+    if (it == NULL) { return; }
+    long n = it->count_lenvnew + it->count_lenvcpy;
+    if (n >= it->lenvs_size) {
+        it->lenvs_size = it->lenvs_size ? it->lenvs_size * 2 : 64;
+        it->lenvs = realloc(it->lenvs, it->lenvs_size * sizeof(lenv*));
+    }
+    it->lenvs[n] = e;
+}
+#endif
+
 lproc *lproc_new() {
 #ifdef JBLISPC_DEBUG_MEM
-    COUNT_LPROCNEW++;
+    LCOUNT(lprocnew);
 #endif
-    lproc *p = malloc(sizeof(lproc));
+    LSTAT_INC(lproc_new);
+    lproc *p = lheap_malloc(sizeof(lproc));
     p->params = NULL;
     p->body = NULL;
     p->closure = NULL;
+    p->site = &LSITE_NONE;
     return p;
 }
 
 lproc *lproc_copy(lproc *p) {
 #ifdef JBLISPC_DEBUG_MEM
-    COUNT_LPROCCPY++;
+    LCOUNT(lproccpy);
 #endif
-    lproc *v = malloc(sizeof(lproc));
+    LSTAT_INC(lproc_new);
+    lproc *v = lheap_malloc(sizeof(lproc));
     v->closure = p->closure;
+    v->site = p->site;
     v->params = lval_copy(p->params);
     v->body = lval_copy(p->body);
     return v;
@@ -100,44 +558,336 @@ lproc *lproc_copy(lproc *p) {
 
 void lproc_del(lproc *p) {
 #ifdef JBLISPC_DEBUG_MEM
-    COUNT_LPROCDEL++;
+    LCOUNT(lprocdel);
 #endif
+    LSTAT_INC(lproc_del);
     if (p->params != NULL) {
         lval_del(p->params);
     }
     if (p->body != NULL) {
         lval_del(p->body);
     }
+    lheap_free(p);
+}
+
+// Names of procedures are interned, and never freed, so that profiles can
+// refer to them after the procedures are gone.
+typedef struct _lintern {
+    struct _lintern *next;
+    char name[];
+} lintern;
+
+#define LINTERN_BUCKETS 1024
+static lintern *LINTERN[LINTERN_BUCKETS];
+static pthread_mutex_t LINTERN_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+const char *lintern_name(const char *name) {
+    unsigned long h = 5381;
+    for (const char *c = name; *c; c++) {
+        h = h * 33 + (unsigned char) *c;
+    }
+    pthread_mutex_lock(&LINTERN_LOCK);
+    lintern **bucket = &LINTERN[h % LINTERN_BUCKETS];
+    lintern *n = *bucket;
+    while (n != NULL && strcmp(n->name, name) != 0) {
+        n = n->next;
+    }
+    if (n == NULL) {
+        n = malloc(sizeof(lintern) + strlen(name) + 1);
+        strcpy(n->name, name);
+        n->next = *bucket;
+        *bucket = n;
+    }
+    pthread_mutex_unlock(&LINTERN_LOCK);
+    return n->name;
+}
+
+#define LSITE_BUCKETS 1024
+static lsite *LSITE[LSITE_BUCKETS];
+
+// Called with LINTERN_LOCK held
+static lsite *lsite_find(const char *name, const char *file, int line) {
+    if (name == NULL && file == NULL) { return &LSITE_NONE; }
+    unsigned long h = ((unsigned long) name * 31 + (unsigned long) file) * 31
+        + line;
+    lsite **bucket = &LSITE[(h >> 4) % LSITE_BUCKETS];
+    lsite *n = *bucket;
+    while (n != NULL &&
+           (n->name != name || n->file != file || n->line != line)) {
+        n = n->next;
+    }
+    if (n == NULL) {
+        n = malloc(sizeof(lsite));
+        *n = (lsite) {name, file, line, NULL, *bucket};
+        n->anon = name != NULL ? lsite_find(NULL, file, line) : n;
+        *bucket = n;
+    }
+    return n;
+}
+
+// The site of procedures named name, made at line of file. The name and
+// file must be interned; a NULL file is an unknown site.
+static const lsite *lsite_intern(const char *name, const char *file,
+                                 int line) {
+    pthread_mutex_lock(&LINTERN_LOCK);
+    const lsite *n = lsite_find(name, file, line);
+    pthread_mutex_unlock(&LINTERN_LOCK);
+    return n;
+}
+
+// Name an anonymous procedure after the symbol it is defined as
+void lval_name_proc(lval *v, const char *sym) {
+    if (v->type == LVAL_PROC && v->val.proc->site->name == NULL) {
+        const lsite *s = v->val.proc->site;
+        v->val.proc->site = lsite_intern(lintern_name(sym), s->file, s->line);
+    }
+}
+
+lfuture *lfuture_new(lval *body, lenv *env) {
+    lfuture *f = malloc(sizeof(lfuture));
+    atomic_init(&f->refs, 1);
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->cond, NULL);
+    f->done = 0;
+    f->body = body;
+    f->env = env;
+    f->result = NULL;
+    f->shared = NULL;
+    return f;
+}
+
+void lfuture_release(lfuture *f) {
+    if (atomic_fetch_sub(&f->refs, 1) != 1) { return; }
+    if (f->body != NULL) { lval_del(f->body); }
+    if (f->result != NULL) { lval_del(f->result); }
+    pthread_mutex_destroy(&f->lock);
+    pthread_cond_destroy(&f->cond);
+    free(f);
+}
+
+lchan *lchan_new(int size) {
+    lchan *c = calloc(1, sizeof(lchan));
+    atomic_init(&c->refs, 1);
+    c->size = size;
+    c->buf = malloc(size * sizeof(lval*));
+    return c;
+}
+
+// Coroutines blocked on a channel hold a reference to it, so none is left
+// when it is freed.
+void lchan_release(lchan *c) {
+    if (atomic_fetch_sub(&c->refs, 1) != 1) { return; }
+    for (int i=0; i < c->count; i++) {
+        lval_del(c->buf[(c->head + i) % c->size]);
+    }
+    free(c->buf);
+    free(c);
+}
+
+lpromise *lpromise_new(lval *body, lenv *env, lbuiltin thunk) {
+    lpromise *p = malloc(sizeof(lpromise));
+    atomic_init(&p->refs, 1);
+    p->body = body;
+    p->env = env;
+    p->thunk = thunk;
+    p->value = NULL;
+    p->forcing = 0;
+    return p;
+}
+
+// A forced lazy sequence is a chain of promises, each holding the next in
+// its value; release it in a loop rather than recursively.
+void lpromise_release(lpromise *p) {
+    while (p != NULL && atomic_fetch_sub(&p->refs, 1) == 1) {
+        lpromise *next = NULL;
+        lval *v = p->value;
+        if (v != NULL && v->type == LVAL_SEXPR && v->count == 2 &&
+            v->val.cell[1]->type == LVAL_PROMISE) {
+            // Take over the reference of the tail
+            next = v->val.cell[1]->val.promise;
+            lval_retype(v->val.cell[1], LVAL_BOOL);
+        }
+        if (v != NULL) { lval_del(v); }
+        if (p->body != NULL) { lval_del(p->body); }
+        free(p);
+        p = next;
+    }
+}
+
+lport *lport_new(int in, int out, pid_t pid) {
+    lport *p = calloc(1, sizeof(lport));
+    atomic_init(&p->refs, 1);
+    p->in.fd = in;
+    p->out.fd = out;
+    p->pid = pid;
+    return p;
+}
+
+// Coroutines blocked on a port hold a reference to it, so none is left
+// when it is freed.
+void lport_release(lport *p) {
+    if (atomic_fetch_sub(&p->refs, 1) != 1) { return; }
+    lport_close(NULL, p);
+    free(p->buf);
     free(p);
 }
 
+lmailbox *lmailbox_new() {
+    lmailbox *m = calloc(1, sizeof(lmailbox));
+    atomic_init(&m->refs, 1);
+    pthread_mutex_init(&m->lock, NULL);
+    pthread_cond_init(&m->cond, NULL);
+    m->efd = -1;
+    return m;
+}
+
+void lmailbox_release(lmailbox *m) {
+    if (atomic_fetch_sub(&m->refs, 1) != 1) { return; }
+    for (int i=0; i < m->count; i++) {
+        lval_del(m->msgs[(m->head + i) % m->size]);
+    }
+    free(m->msgs);
+    if (m->efd >= 0) { close(m->efd); }
+    pthread_mutex_destroy(&m->lock);
+    pthread_cond_destroy(&m->cond);
+    free(m);
+}
+
+// Messages are frozen values, handed over without copying.
+void lmailbox_put(lmailbox *m, lval *v) {
+    pthread_mutex_lock(&m->lock);
+    if (m->count == m->size) {
+        int size = m->size ? m->size * 2 : 16;
+        lval **msgs = malloc(size * sizeof(lval*));
+        for (int i=0; i < m->count; i++) {
+            msgs[i] = m->msgs[(m->head + i) % m->size];
+        }
+        free(m->msgs);
+        m->msgs = msgs;
+        m->head = 0;
+        m->size = size;
+    }
+    m->msgs[(m->head + m->count++) % m->size] = v;
+    pthread_cond_signal(&m->cond);
+    if (m->efd >= 0) {
+        uint64_t one = 1;
+        ssize_t n = write(m->efd, &one, sizeof(one));
+        (void) n;
+    }
+    pthread_mutex_unlock(&m->lock);
+}
+
+// The eventfd of m, made on first use, or -1 if it cannot be
+int lmailbox_efd(lmailbox *m) {
+    pthread_mutex_lock(&m->lock);
+    if (m->efd < 0) { m->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC); }
+    int efd = m->efd;
+    pthread_mutex_unlock(&m->lock);
+    return efd;
+}
+
+int lmailbox_empty(lmailbox *m) {
+    pthread_mutex_lock(&m->lock);
+    int empty = m->count == 0;
+    pthread_mutex_unlock(&m->lock);
+    return empty;
+}
+
+lval *lmailbox_get(lmailbox *m) {
+    pthread_mutex_lock(&m->lock);
+    while (m->count == 0) {
+        pthread_cond_wait(&m->cond, &m->lock);
+    }
+    lval *v = m->msgs[m->head];
+    m->head = (m->head + 1) % m->size;
+    m->count--;
+    pthread_mutex_unlock(&m->lock);
+    return v;
+}
+
 lenv *lenv_new(lenv *enc) {
-    lenv *e = malloc(sizeof(lenv));
+    lenv *e = lheap_malloc(sizeof(lenv));
 #ifdef JBLISPC_DEBUG_MEM
-    LENVS[COUNT_LENVNEW+COUNT_LENVCPY] = e;
-    COUNT_LENVNEW++;
+    linterp_track_lenv(e);
+    LCOUNT(lenvnew);
 #endif
+    LSTAT_INC(lenv_new);
     e->count = 0;
     e->size = 0;
     e->encl = enc;
+    e->base = NULL;
     e->syms = NULL;
     e->vals = NULL;
+    atomic_init(&e->captured, 0);
+    e->shared = 0;
     return e;
 }
 
+// Mark e and its enclosing envs as referred to by a value that may outlive
+// the call that made e, so that it is not freed with the call.
+void lenv_capture(lenv *e) {
+    for (; e != NULL; e = lenv_parent(e)) {
+        if (atomic_load_explicit(&e->captured, memory_order_relaxed)) {
+            break;
+        }
+        atomic_store_explicit(&e->captured, 1, memory_order_relaxed);
+    }
+}
+
+// The env lookups continue in after e
+lenv *lenv_parent(lenv *e) {
+    return e->encl != NULL ? e->encl : e->base;
+}
+
+// A copy-on-write view of e, made in O(1): lookups fall through to e, but
+// definitions go to the fork, shadowing those of e. Definitions made in e
+// later are seen by the fork. To keep e from being written to, def* must
+// be pointed at the fork while it is used, see lenv_globals.
+lenv *lenv_fork(lenv *e) {
+    lenv *f = lenv_new(NULL);
+    f->base = e;
+    return f;
+}
+
+// Where the coroutine or thread running keeps the env def* defines in.
+// Procedures closed over the global env reach it through their call envs,
+// so def* goes to this env instead, when set, rather than to the root of
+// the env it is called from.
+lenv **lenv_globals() {
+    linterp *it = LINTERP;
+    return it != NULL ? &it->current->globals : &LGLOBALS_THREAD;
+}
+
+// Free a fork once done with it, unless something may still refer to it:
+// a live coroutine, or a procedure or promise in v, the value leaving it,
+// which may be NULL.
+void lenv_fork_del(linterp *it, lenv *f, lval *v) {
+#ifndef JBLISPC_DEBUG_MEM
+    long long start = ltrace_begin();
+    if ((it == NULL || it->live == NULL) && (v == NULL || !lval_has_proc(v))) {
+        lenv_del(f);
+    }
+    ltrace_end("cleanup", "env fork", start);
+#endif
+}
+
 lenv *lenv_copy(lenv *e) {
-    lenv *n = malloc(sizeof(lenv));
+    lenv *n = lheap_malloc(sizeof(lenv));
 #ifdef JBLISPC_DEBUG_MEM
-    LENVS[COUNT_LENVNEW+COUNT_LENVCPY] = n;
-    COUNT_LENVCPY++;
+    linterp_track_lenv(n);
+    LCOUNT(lenvcpy);
 #endif
+    LSTAT_INC(lenv_new);
     n->encl = e->encl;
+    n->base = e->base;
+    atomic_init(&n->captured, 0);
+    n->shared = 0;
     n->count = e->count;
     n->size = e->count;
-    n->syms = malloc(n->size * sizeof(char*));
-    n->vals = malloc(n->size * sizeof(lval*));
+    n->syms = lheap_malloc(n->size * sizeof(char*));
+    n->vals = lheap_malloc(n->size * sizeof(lval*));
     for (int i=0; i < n->count; i++) {
-        n->syms[i] = malloc(strlen(e->syms[i])+1);
+        n->syms[i] = lheap_malloc(strlen(e->syms[i])+1);
         strcpy(n->syms[i], e->syms[i]);
         n->vals[i] = lval_copy(e->vals[i]);
     }
@@ -146,18 +896,103 @@ lenv *lenv_copy(lenv *e) {
 
 void lenv_del(lenv *e) {
 #ifdef JBLISPC_DEBUG_MEM
-    COUNT_LENVDEL++;
+    LCOUNT(lenvdel);
 #endif
+    LSTAT_INC(lenv_del);
     for (int i=0; i < e->count; i++) {
-        free(e->syms[i]);
+        lheap_free(e->syms[i]);
         lval_del(e->vals[i]);
     }
-    free(e->syms);
-    free(e->vals);
-    free(e);
+    lheap_free(e->syms);
+    lheap_free(e->vals);
+    lheap_free(e);
+}
+
+void lval_rebind(lval *v, lenv **from, lenv **to, int n) {
+    if (v->type == LVAL_PROC) {
+        for (int i=0; i < n; i++) {
+            if (v->val.proc->closure == from[i]) {
+                v->val.proc->closure = to[i];
+                break;
+            }
+        }
+    } else if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+        for (int i=0; i < v->count; i++) {
+            lval_rebind(v->val.cell[i], from, to, n);
+        }
+    }
+}
+
+void lsnapshot_release(lsnapshot *s) {
+    if (atomic_fetch_sub(&s->refs, 1) != 1) { return; }
+#ifndef JBLISPC_DEBUG_MEM
+    lenv_del(s->env);
+#endif
+    free(s);
+}
+
+// The copy of the global env of it, made once and kept until the env
+// changes; the caller gets a reference.
+lsnapshot *linterp_snapshot(linterp *it) {
+    if (it->snapshot == NULL) {
+        lsnapshot *s = malloc(sizeof(lsnapshot));
+        atomic_init(&s->refs, 1);
+        s->env = lenv_copy(it->env);
+        for (int j=0; j < s->env->count; j++) {
+            lval_rebind(s->env->vals[j], &it->env, &s->env, 1);
+        }
+        it->snapshot = s;
+        it->env->shared = 1;
+    }
+    atomic_fetch_add(&it->snapshot->refs, 1);
+    return it->snapshot;
+}
+
+// Copy e and all its enclosing envs, and the envs forks read through.
+// Procedures closed over one of them are rebound to its copy; other
+// closures are still shared. The global env of the running interpreter is
+// not copied each time: the copy of e ends in a fork of its shared copy,
+// which *shared is set to, so that definitions stay private. *shared is
+// NULL if e is not reached from that env.
+lenv *lenv_snapshot(lenv *e, lsnapshot **shared) {
+    int n = 0;
+    lenv *root = e;
+    for (lenv *x = e; x != NULL; x = lenv_parent(x)) { n++; root = x; }
+    linterp *it = LINTERP;
+    *shared = it != NULL && root == it->env ? linterp_snapshot(it) : NULL;
+    lenv **from = malloc(n * sizeof(lenv*));
+    lenv **to = malloc(n * sizeof(lenv*));
+    n = 0;
+    for (lenv *x = e; x != NULL; x = lenv_parent(x)) {
+        from[n] = x;
+        to[n++] = x == root && *shared != NULL ?
+            lenv_fork((*shared)->env) : lenv_copy(x);
+    }
+    // The fork, if any, is last and stays as made
+    int copied = *shared != NULL ? n-1 : n;
+    for (int i=0; i < copied; i++) {
+        to[i]->encl = i+1 < n ? to[i+1] : NULL;
+        to[i]->base = NULL;
+        for (int j=0; j < to[i]->count; j++) {
+            lval_rebind(to[i]->vals[j], from, to, n);
+        }
+    }
+    lenv *s = to[0];
+    free(from);
+    free(to);
+    return s;
 }
 
 void lenv_put(lenv *e, char *sym, lval *v) {
+    if (e->shared) {
+        // Futures made from now on must see the change
+        linterp *it = LINTERP;
+        if (it != NULL && it->env == e) {
+            lsnapshot_release(it->snapshot);
+            it->snapshot = NULL;
+            e->shared = 0;
+        }
+    }
     for (int i=0; i < e->count; i++) {
         if (strcmp(e->syms[i], sym) == 0) {
             lval_del(e->vals[i]);
@@ -169,10 +1004,10 @@ void lenv_put(lenv *e, char *sym, lval *v) {
     e->count++;
     if (e->count > e->size) {
         e->size = e->size ? e->size * 2 : e->count;
-        e->syms = realloc(e->syms, sizeof(char*) * e->size);
-        e->vals = realloc(e->vals, sizeof(lval*) * e->size);
+        e->syms = lheap_realloc(e->syms, sizeof(char*) * e->size);
+        e->vals = lheap_realloc(e->vals, sizeof(lval*) * e->size);
     }
-    e->syms[e->count-1] = malloc(strlen(sym) + 1);
+    e->syms[e->count-1] = lheap_malloc(strlen(sym) + 1);
     strcpy(e->syms[e->count-1], sym);
     e->vals[e->count-1] = lval_copy(v);
 }
@@ -186,107 +1021,170 @@ lval *lenv_get(lenv *e, char *sym) {
             return lval_copy(e->vals[i]);
         }
     }
-    if (e->encl != NULL) {
-        return lenv_get(e->encl, sym);
+    if (lenv_parent(e) != NULL) {
+        return lenv_get(lenv_parent(e), sym);
     }
     return lval_err("Unbound symbol '%s'.", sym);
 }
 
-lval *lval_new() {
+lval *lval_new(int type) {
 #ifdef JBLISPC_DEBUG_MEM
-    COUNT_LVALNEW++;
+    LCOUNT(lvalnew);
 #endif
-    lval *v = malloc(sizeof(lval));
+    LSTAT_INC(lval_new[type]);
+    lval *v = lheap_malloc(sizeof(lval));
     v->count = 0;
     v->size = 0;
-    v->type = 0;
+    v->type = type;
+    atomic_init(&v->refs, 0);
     v->val.cell = NULL;
     return v;
 }
 
+// Change the type of v in place; it is counted as allocated with it.
+void lval_retype(lval *v, int type) {
+    LSTAT_ADD(lval_new[v->type], -1);
+    LSTAT_INC(lval_new[type]);
+    v->type = type;
+}
+
 lval *lval_bool(int b) {
-    lval *v = lval_new();
-    v->type = LVAL_BOOL;
+    lval *v = lval_new(LVAL_BOOL);
     v->val.bool = b ? LTRUE : LFALSE;
     return v;
 }
 
 lval *lval_dbl(double x) {
-    lval *v = lval_new();
-    v->type = LVAL_DBL;
+    lval *v = lval_new(LVAL_DBL);
     v->val.dbl = x;
     return v;
 }
 
 lval *lval_lng(long x) {
-    lval *v = lval_new();
-    v->type = LVAL_LNG;
+    lval *v = lval_new(LVAL_LNG);
     v->val.lng = x;
     return v;
 }
 
+// Write a site like "fib (fib.jbl:3)" to buf, which is truncated to n
+static int lsite_print(const lsite *s, char *buf, size_t n) {
+    const char *name = s->name != NULL ? s->name : "lambda";
+    if (s->file == NULL) { return snprintf(buf, n, "%s", name); }
+    return snprintf(buf, n, "%s (%s:%d)", name, s->file, s->line);
+}
+
+// Append a line to the text of len bytes in *buf of *size bytes
+static size_t lval_err_append(char **buf, size_t *size, size_t len,
+                              const char *fmt, const char *arg) {
+    char line[512];
+    size_t n = snprintf(line, sizeof(line), fmt, arg);
+    if (n >= sizeof(line)) { n = sizeof(line) - 1; }
+    if (len + n + 1 > *size) {
+        *size = (len + n + 1) * 2;
+        *buf = lheap_realloc(*buf, *size);
+    }
+    memcpy(*buf + len, line, n + 1);
+    return len + n;
+}
+
 lval *lval_err(char *fmt, ...) {
     va_list va;
     va_start(va, fmt);
 
-    lval *v = lval_new();
-    v->type = LVAL_ERR;
-    v->val.str = malloc(512);
-    vsnprintf(v->val.str, 511, fmt, va);
-    v->val.str = realloc(v->val.str, strlen(v->val.str)+1);
+    lval *v = lval_new(LVAL_ERR);
+    size_t size = 512;
+    char *s = lheap_malloc(size);
+    vsnprintf(s, 511, fmt, va);
+    size_t len = strlen(s) + 1;
+
+    // The calls being made on this thread follow the message, innermost
+    // first, with the top-level expression they were made from
+    linterp *it = LINTERP;
+    lprof_stack *prof = it != NULL ? &it->current->prof : &LPROF_THREAD;
+    if (prof->depth > 0) {
+        v->count = len;
+        char frame[256];
+        if (prof->depth > LPROF_DEPTH) {
+            snprintf(frame, sizeof(frame), "%d", prof->depth - LPROF_DEPTH);
+            len = lval_err_append(&s, &size, len, "  ... %s more calls\n",
+                                  frame);
+        }
+        for (int i=(prof->depth < LPROF_DEPTH ? prof->depth : LPROF_DEPTH) - 1;
+             i >= 0; i--) {
+            lsite_print(prof->sites[i], frame, sizeof(frame));
+            len = lval_err_append(&s, &size, len, "  at %s\n", frame);
+        }
+        if (it != NULL && it->site->file != NULL) {
+            snprintf(frame, sizeof(frame), "%s:%d", it->site->file,
+                     it->site->line);
+            len = lval_err_append(&s, &size, len, "  at (toplevel) (%s)\n",
+                                  frame);
+        }
+        len++;
+    }
+    v->val.str = lheap_realloc(s, len);
 
     va_end(va);
     return v;
 }
 
+// The backtrace of an error, see lval_err, or NULL if it has none
+const char *lval_err_backtrace(lval *v) {
+    return v->type == LVAL_ERR && v->count ? v->val.str + v->count : NULL;
+}
+
 lval *lval_sexpr(void) {
-    lval *v = lval_new();
-    v->type = LVAL_SEXPR;
+    lval *v = lval_new(LVAL_SEXPR);
     v->val.cell = NULL;
     return v;
 }
 
 lval *lval_qexpr(void) {
-    lval *v = lval_new();
-    v->type = LVAL_QEXPR;
+    lval *v = lval_new(LVAL_QEXPR);
     v->val.cell = NULL;
     return v;
 }
 
 lval *lval_sym(char *s) {
-    lval *v = lval_new();
+    lval *v = lval_new(LVAL_SYM);
     int l = strlen(s);
-    v->type = LVAL_SYM;
     v->count = l;
-    v->val.str = malloc(l + 1);
+    v->val.str = lheap_malloc(l + 1);
     strcpy(v->val.str, s);
     return v;
 }
 
+// A string of the count bytes at s, which may hold NULs, as port input does
 lval *lval_str(char *s, int count) {
-    lval *v = lval_new();
-    v->type = LVAL_STR;
-    v->val.str = malloc(count + 1);
+    lval *v = lval_new(LVAL_STR);
+    v->val.str = lheap_malloc(count + 1);
     v->count = count;
-    strncpy(v->val.str, s, count);
+    memcpy(v->val.str, s, count);
     v->val.str[count] = '\0';
     return v;
 }
 
 lval *lval_builtin(lbuiltin bltn) {
-    lval *v = lval_new();
-    v->type = LVAL_BUILTIN;
+    lval *v = lval_new(LVAL_BUILTIN);
     v->val.builtin = bltn;
     return v;
 }
 
 lval *lval_proc(void) {
-    lval *v = lval_new();
-    v->type = LVAL_PROC;
+    lval *v = lval_new(LVAL_PROC);
     v->val.proc = lproc_new();
     return v;
 }
 
+int lval_type(lval *v) {
+    return v->type;
+}
+
+// The text of a string, symbol or error
+char *lval_str_value(lval *v) {
+    return v->val.str;
+}
+
 int lval_is(lval *v, lval *w) {
     if (v->type == w->type) {
         return v == w;
@@ -323,6 +1221,21 @@ int lval_equal(lval *v, lval *w) {
         case LVAL_PROC:
             eq = v == w;
             break;
+        case LVAL_FUTURE:
+            eq = v->val.future == w->val.future;
+            break;
+        case LVAL_CHAN:
+            eq = v->val.chan == w->val.chan;
+            break;
+        case LVAL_ACTOR:
+            eq = v->val.mailbox == w->val.mailbox;
+            break;
+        case LVAL_PROMISE:
+            eq = v->val.promise == w->val.promise;
+            break;
+        case LVAL_PORT:
+            eq = v->val.port == w->val.port;
+            break;
         case LVAL_SEXPR:
         case LVAL_QEXPR:
             if (v->count == w->count) {
@@ -354,8 +1267,13 @@ int lval_is_true(lval *v) {
 
 void lval_del(lval *v) {
 #ifdef JBLISPC_DEBUG_MEM
-    COUNT_LVALDEL++;
+    LCOUNT(lvaldel);
 #endif
+    if (atomic_load_explicit(&v->refs, memory_order_relaxed) &&
+        atomic_fetch_sub(&v->refs, 1) != 1) {
+        return;
+    }
+    LSTAT_INC(lval_del[v->type]);
     switch(v->type) {
         case LVAL_BOOL:
         case LVAL_DBL:
@@ -365,26 +1283,44 @@ void lval_del(lval *v) {
         case LVAL_ERR:
         case LVAL_SYM:
         case LVAL_STR:
-            free(v->val.str);
+            lheap_free(v->val.str);
             break;
         case LVAL_PROC:
             lproc_del(v->val.proc);
             break;
+        case LVAL_FUTURE:
+            lfuture_release(v->val.future);
+            break;
+        case LVAL_CHAN:
+            lchan_release(v->val.chan);
+            break;
+        case LVAL_ACTOR:
+            lmailbox_release(v->val.mailbox);
+            break;
+        case LVAL_PROMISE:
+            lpromise_release(v->val.promise);
+            break;
+        case LVAL_PORT:
+            lport_release(v->val.port);
+            break;
         case LVAL_SEXPR:
         case LVAL_QEXPR:
             for (int i=0; i < v->count; i++)
                 lval_del(v->val.cell[i]);
-            free(v->val.cell);
+            lheap_free(v->val.cell);
             break;
     }
-    free(v);
+    lheap_free(v);
 }
 
-lval *lval_copy(lval *v) {
+// Copy the top level of v; the elements of a frozen list are shared.
+lval *lval_copy_top(lval *v) {
 #ifdef JBLISPC_DEBUG_MEM
-    COUNT_LVALCPY++;
+    LCOUNT(lvalcpy);
 #endif
-    lval *x = malloc(sizeof(lval));
+    LSTAT_INC(lval_new[v->type]);
+    lval *x = lheap_malloc(sizeof(lval));
+    atomic_init(&x->refs, 0);
     x->type = v->type;
     x->size = v->size;
     x->count = v->count;
@@ -399,14 +1335,18 @@ lval *lval_copy(lval *v) {
         case LVAL_LNG:
             x->val.lng = v->val.lng;
             break;
-        case LVAL_ERR:
-            x->val.str = malloc(strlen(v->val.str) + 1);
-            strcpy(x->val.str, v->val.str);
+        case LVAL_ERR: {
+            // The message, and the backtrace that follows it if any
+            size_t n = v->count + strlen(v->val.str + v->count) + 1;
+            x->count = v->count;
+            x->val.str = lheap_malloc(n);
+            memcpy(x->val.str, v->val.str, n);
             break;
+        }
         case LVAL_SYM:
         case LVAL_STR:
             x->count = v->count;
-            x->val.str = malloc(v->count+1);
+            x->val.str = lheap_malloc(v->count+1);
             memcpy((void*) x->val.str, (void*) v->val.str, v->count+1);
             x->val.str[x->count] = '\0';
             break;
@@ -416,9 +1356,29 @@ lval *lval_copy(lval *v) {
         case LVAL_PROC:
             x->val.proc = lproc_copy(v->val.proc);
             break;
+        case LVAL_FUTURE:
+            x->val.future = v->val.future;
+            atomic_fetch_add(&x->val.future->refs, 1);
+            break;
+        case LVAL_CHAN:
+            x->val.chan = v->val.chan;
+            atomic_fetch_add(&x->val.chan->refs, 1);
+            break;
+        case LVAL_ACTOR:
+            x->val.mailbox = v->val.mailbox;
+            atomic_fetch_add(&x->val.mailbox->refs, 1);
+            break;
+        case LVAL_PROMISE:
+            x->val.promise = v->val.promise;
+            atomic_fetch_add(&x->val.promise->refs, 1);
+            break;
+        case LVAL_PORT:
+            x->val.port = v->val.port;
+            atomic_fetch_add(&x->val.port->refs, 1);
+            break;
         case LVAL_SEXPR:
         case LVAL_QEXPR:
-            x->val.cell = malloc(sizeof(lval*) * x->count);
+            x->val.cell = lheap_malloc(sizeof(lval*) * x->count);
             x->size = x->count;
             for (int i=0; i < v->count; i++) {
                 x->val.cell[i] = lval_copy(v->val.cell[i]);
@@ -428,13 +1388,77 @@ lval *lval_copy(lval *v) {
     return x;
 }
 
+lval *lval_copy(lval *v) {
+    if (atomic_load_explicit(&v->refs, memory_order_relaxed)) {
+        atomic_fetch_add(&v->refs, 1);
+        return v;
+    }
+    return lval_copy_top(v);
+}
+
+// Frozen values
+//
+// Freezing a value makes it, and everything it holds, immutable and
+// shared: copying it takes a reference instead of copying, which makes it
+// cheap to bind, pass around and hand to other threads. Code that takes
+// ownership of a value to modify it thaws it first, which copies the top
+// level only, its elements staying frozen and shared.
+
+int lval_freezable(lval *v) {
+    if (atomic_load(&v->refs)) { return 1; }
+    switch (v->type) {
+        case LVAL_PROC:
+        case LVAL_CHAN:
+        case LVAL_PROMISE:
+        case LVAL_PORT:
+            return 0;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for (int i=0; i < v->count; i++) {
+                if (!lval_freezable(v->val.cell[i])) { return 0; }
+            }
+            break;
+    }
+    return 1;
+}
+
+void lval_freeze_rec(lval *v) {
+    if (atomic_load(&v->refs)) { return; }
+    if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+        for (int i=0; i < v->count; i++) {
+            lval_freeze_rec(v->val.cell[i]);
+        }
+    }
+    atomic_store(&v->refs, 1);
+}
+
+// Freeze v in place. Returns -1, leaving v as is, if it holds procedures,
+// channels, promises or ports, which belong to their interpreter.
+int lval_freeze(lval *v) {
+    if (!lval_freezable(v)) { return -1; }
+    lval_freeze_rec(v);
+    return 0;
+}
+
+int lval_is_frozen(lval *v) {
+    return atomic_load(&v->refs) != 0;
+}
+
+// Returns a value with a single owner equal to v, which is consumed.
+lval *lval_thaw(lval *v) {
+    if (!atomic_load_explicit(&v->refs, memory_order_relaxed)) { return v; }
+    lval *x = lval_copy_top(v);
+    lval_del(v);
+    return x;
+}
+
 lval *lval_insert(lval *x, lval *v, int n) {
     LASSERT(x, n <= x->count,
         "Array bounds error in INSERT.");
     x->count++;
     if (x->count >= x->size) {
         x->size = x->size == 0 ? x->count : x->size  *2;
-        x->val.cell = realloc(x->val.cell, sizeof(lval*) * x->size);
+        x->val.cell = lheap_realloc(x->val.cell, sizeof(lval*) * x->size);
     }
     memmove(x->val.cell+n+1, x->val.cell+n, (x->count-n-1) * sizeof(lval*));
     x->val.cell[n] = v;
@@ -449,7 +1473,7 @@ lval *lval_pop(lval *v, int n) {
     lval *res = v->val.cell[n];
     memmove(v->val.cell+n, v->val.cell+n+1, (v->count-n-1)  *sizeof(lval*));
     v->count--;
-    return res;
+    return lval_thaw(res);
 }
 
 // Take content of a cell, deleting the parent lval
@@ -490,6 +1514,21 @@ lval *lval_read_str(char *s) {
     return v;
 }
 
+// Whether a child of an expression in the AST is a bracket or a comment
+int lval_read_skip(mpc_ast_t *child) {
+    if (strcmp(child->contents, "(") == 0)
+        return 1;
+    if (strcmp(child->contents, ")") == 0)
+        return 1;
+    if (strcmp(child->contents, "{") == 0)
+        return 1;
+    if (strcmp(child->contents, "}") == 0)
+        return 1;
+    if (strcmp(child->tag, "regex") == 0)
+        return 1;
+    return strstr(child->tag, "comment") != NULL;
+}
+
 lval *lval_read(mpc_ast_t *ast) {
     if (strstr(ast->tag, "number"))
         return lval_read_num(ast);
@@ -513,23 +1552,26 @@ lval *lval_read(mpc_ast_t *ast) {
             ast->tag);
 
     for (int i=0; i < ast->children_num; i++) {
-        if (strcmp(ast->children[i]->contents, "(") == 0)
-            continue;
-        if (strcmp(ast->children[i]->contents, ")") == 0)
-            continue;
-        if (strcmp(ast->children[i]->contents, "{") == 0)
-            continue;
-        if (strcmp(ast->children[i]->contents, "}") == 0)
-            continue;
-        if (strcmp(ast->children[i]->tag, "regex") == 0)
-            continue;
-        if (strstr(ast->children[i]->tag, "comment"))
+        if (lval_read_skip(ast->children[i]))
             continue;
         x = lval_add(x, lval_read(ast->children[i]));
     }
     return x;
 }
 
+// The line of each expression at the top level of ast, from 1, in the
+// order lval_read reads them
+int *lval_read_lines(mpc_ast_t *ast) {
+    int *lines = malloc((ast->children_num + 1) * sizeof(int));
+    int n = 0;
+    for (int i=0; i < ast->children_num; i++) {
+        if (!lval_read_skip(ast->children[i])) {
+            lines[n++] = ast->children[i]->state.row + 1;
+        }
+    }
+    return lines;
+}
+
 char *strencl(char *s, size_t n, char open, char close) {
     char *r = malloc(n+3);
     memcpy((void*) (r+1), (void*) s, n);
@@ -562,9 +1604,18 @@ lval *lval_repr_expr(lval *v, char open, char close) {
     return res;
 }
 
+// "<kind at p>" for values that only refer to a shared object
+static char *lval_repr_ref(const char *kind, void *p, size_t *len) {
+    *len = snprintf(NULL, 0, "<%s at %p>", kind, p);
+    char *repr = malloc(*len + 1);
+    snprintf(repr, *len + 1, "<%s at %p>", kind, p);
+    return repr;
+}
+
 lval *lval_repr(lval *v) {
     char *repr;
     size_t len;
+    v = lval_thaw(v);
     switch (v->type) {
         case LVAL_BOOL:
             repr = malloc(3);
@@ -611,8 +1662,23 @@ lval *lval_repr(lval *v) {
             repr = realloc(repr, len+1);
             len = snprintf(repr, len+1, "<procedure at %p>", v->val.proc);
             break;
-        case LVAL_ERR:
-            repr = malloc(1);
+        case LVAL_FUTURE:
+            repr = lval_repr_ref("future", v->val.future, &len);
+            break;
+        case LVAL_CHAN:
+            repr = lval_repr_ref("channel", v->val.chan, &len);
+            break;
+        case LVAL_ACTOR:
+            repr = lval_repr_ref("actor", v->val.mailbox, &len);
+            break;
+        case LVAL_PROMISE:
+            repr = lval_repr_ref("promise", v->val.promise, &len);
+            break;
+        case LVAL_PORT:
+            repr = lval_repr_ref("port", v->val.port, &len);
+            break;
+        case LVAL_ERR:
+            repr = malloc(1);
             len = snprintf(repr, 1, "<error: %s>", v->val.str);
             repr = realloc(repr, len+1);
             len = snprintf(repr, len+1, "<error: %s>", v->val.str);
@@ -627,10 +1693,21 @@ lval *lval_repr(lval *v) {
     return res;
 }
 
+// Print v; an error is followed by its backtrace
 void lval_print(lval *v) {
+    const char *trace = lval_err_backtrace(v);
+    char *s = NULL;
+    if (trace != NULL) {
+        s = malloc(strlen(trace) + 1);
+        strcpy(s, trace);
+    }
     lval* repr = lval_repr(v);
     puts(repr->val.str);
     lval_del(repr);
+    if (s != NULL) {
+        fputs(s, stdout);
+        free(s);
+    }
 }
 
 void lval_println(lval *v) {
@@ -639,7 +1716,7 @@ void lval_println(lval *v) {
 }
 
 lval *lval_lng_to_dbl(lval *v) {
-    v->type = LVAL_DBL;
+    lval_retype(v, LVAL_DBL);
     v->val.dbl = (double) v->val.lng;
     return v;
 }
@@ -888,281 +1965,1712 @@ lval *builtin_set_head(lenv *e, lval *a) {
     return lst;
 }
 
-lval *builtin_list(lenv *e, lval *a) {
-    return a;
+// Parallel list procedures
+//
+// The list is cut into at most LPAR_CHUNKS chunks whose bounds depend only
+// on its length, and the chunks are evaluated on the thread pool. Results
+// are assembled in list order and the first error in list order wins, so
+// the outcome does not depend on scheduling. The procedure must not change
+// shared state: it runs concurrently with itself, in a private env whose
+// parent is the calling env, and cannot use def* or load.
+
+#define LPAR_CHUNKS 256
+
+typedef struct {
+    lenv *env;
+    lval *op;
+    lval *init;
+    lval *lst;
+    lval **out;
+    int chunks;
+} lpar;
+
+int lpar_lo(lpar *p, int c) {
+    return (int) ((long) p->lst->count * c / p->chunks);
 }
 
-lval *builtin_eval(lenv *e, lval *a) {
-    LASSERT_ARGC("eval", a, 1);
-
-    lval *x = lval_take(a, 0);
-    return lval_eval(e, x);
+lval *lpar_call(lenv *e, lval *op, lval *x, lval *y) {
+    lval *args = lval_sexpr();
+    if (x != NULL) { lval_add(args, x); }
+    lval_add(args, y);
+    return lval_call(e, lval_copy(op), args);
 }
 
-lval *builtin_load(lenv *e, lval *a) {
-    LASSERT_ARGC("load", a, 1);
-    LASSERT_ARGT("load", a, 0, LVAL_STR);
-
-    lval *v = load_file(e, a->val.cell[0]->val.str);
-    lval_del(a);
-    return v;
+void lpar_enter(lenv **e, lpar *p, linterp **prev) {
+    *prev = LINTERP;
+    LINTERP = NULL;
+    LPARALLEL++;
+    *e = lenv_new(p->env);
 }
 
-lval *builtin_join(lenv *e, lval *a) {
-    LASSERT(a, a->count != 0,
-        "Procedure 'join' takes at least 1 argument.");
-    for (int i=0; i < a->count; i++) {
-        LASSERT(a, a->val.cell[i]->type == LVAL_SEXPR,
-            "Procedure 'join' takes only lists as arguments.");
+// Free the env of the chunk unless a procedure made in it escaped, as
+// lval_call does
+void lpar_leave(lenv *e, linterp *prev) {
+#ifndef JBLISPC_DEBUG_MEM
+    if (!atomic_load_explicit(&e->captured, memory_order_relaxed)) {
+        lenv_del(e);
     }
+#endif
+    LPARALLEL--;
+    LINTERP = prev;
+}
 
-    lval *x = lval_pop(a, 0);
-    while (a->count) {
-        lval *y = lval_pop(a, 0);
-        while (y->count)
-            x = lval_add(x, lval_pop(y, 0));
-        lval_del(y);
+void lpar_map_chunk(void *arg, int c) {
+    lpar *p = arg;
+    lenv *e;
+    linterp *prev;
+    lpar_enter(&e, p, &prev);
+    for (int i=lpar_lo(p, c); i < lpar_lo(p, c+1); i++) {
+        p->out[i] = lpar_call(e, p->op, NULL, lval_copy(p->lst->val.cell[i]));
     }
-    lval_del(a);
-    return x;
+    lpar_leave(e, prev);
 }
 
-lval *builtin_cons(lenv *e, lval *a) {
-    LASSERT_ARGC("cons", a, 2);
-    LASSERT(a, a->val.cell[1]->type == LVAL_SEXPR,
-        "Second argument to 'cons' must be a list.");
-    lval *x = lval_pop(a, 0);
-    lval *q = lval_take(a, 0);
-    q = lval_insert(q, x, 0);
-    return q;
+void lpar_reduce_chunk(void *arg, int c) {
+    lpar *p = arg;
+    lenv *e;
+    linterp *prev;
+    lpar_enter(&e, p, &prev);
+    int i = lpar_lo(p, c);
+    lval *acc = c == 0 ? lval_copy(p->init) : lval_copy(p->lst->val.cell[i++]);
+    for (; i < lpar_lo(p, c+1) && acc->type != LVAL_ERR; i++) {
+        acc = lpar_call(e, p->op, acc, lval_copy(p->lst->val.cell[i]));
+    }
+    p->out[c] = acc;
+    lpar_leave(e, prev);
 }
 
-lval *builtin_len(lenv *e, lval *a) {
-    LASSERT_ARGC("len", a, 1);
-    LASSERT(a, a->val.cell[0]->type == LVAL_SEXPR,
-        "Procedure 'len' only applies to lists.");
-    lval *x = lval_lng(a->val.cell[0]->count);
-    lval_del(a);
-    return x;
+// Run fn over the chunks of a and leave one result per element (or per
+// chunk) in p->out. Returns an error if the arguments are invalid.
+lval *lpar_run(lenv *e, lval *a, char *fname, lpool_fn fn, lpar *p) {
+    lval *op = a->val.cell[0];
+    lval *lst = a->val.cell[a->count-1];
+    if (op->type != LVAL_PROC && op->type != LVAL_BUILTIN) {
+        return lval_err("Procedure '%s' expected argument 1 of type '%s', got '%s'.",
+                        fname, TYPE_NAMES[LVAL_PROC], TYPE_NAMES[op->type]);
+    }
+    if (lst->type != LVAL_SEXPR) {
+        return lval_err("Procedure '%s' expected argument %i of type '%s', got '%s'.",
+                        fname, a->count, TYPE_NAMES[LVAL_SEXPR], TYPE_NAMES[lst->type]);
+    }
+    p->env = e;
+    p->op = op;
+    p->init = a->count == 3 ? a->val.cell[1] : NULL;
+    p->lst = lst;
+    p->chunks = lst->count < LPAR_CHUNKS ? lst->count : LPAR_CHUNKS;
+    p->out = calloc(fn == lpar_reduce_chunk ? p->chunks : lst->count, sizeof(lval*));
+    lpool_for(p->chunks, fn, p);
+    return NULL;
 }
 
-lval *builtin_init(lenv *e, lval *a) {
-    LASSERT_ARGC("init", a, 1);
-    LASSERT(a, a->val.cell[0]->type == LVAL_SEXPR,
-        "Procedure 'init' only applies to lists.");
-
-    // Keep all but first cell
-    lval *x = lval_take(a, 0);
-    lval_del(lval_pop(x, x->count-1));
-    return x;
+// Returns the first error of out, freeing the other results, or NULL.
+lval *lpar_error(lval **out, int n) {
+    for (int i=0; i < n; i++) {
+        if (out[i]->type != LVAL_ERR) { continue; }
+        lval *err = out[i];
+        for (int j=0; j < n; j++) {
+            if (j != i) { lval_del(out[j]); }
+        }
+        free(out);
+        return err;
+    }
+    return NULL;
 }
 
-lval *builtin_last(lenv *e, lval *a) {
-    LASSERT_ARGC("last", a, 1);
-    LASSERT(a, a->val.cell[0]->type == LVAL_SEXPR,
-        "Procedure 'last' only applies to lists.");
+lval *builtin_pmap(lenv *e, lval *a) {
+    LASSERT_ARGC("pmap", a, 2);
+    lpar p;
+    lval *err = lpar_run(e, a, "pmap", lpar_map_chunk, &p);
+    if (err != NULL) { lval_del(a); return err; }
+    int n = p.lst->count;
+    lval_del(a);
+    if ((err = lpar_error(p.out, n)) != NULL) { return err; }
 
-    lval *x = lval_take(a, 0);
-    return lval_take(x, x->count-1);
+    lval *v = lval_sexpr();
+    for (int i=0; i < n; i++) {
+        lval_add(v, p.out[i]);
+    }
+    free(p.out);
+    return v;
 }
 
-lval *builtin_equal(lenv *e, lval *a) {
-    LASSERT_ARGC("equal?", a, 2);
+lval *builtin_pfilter(lenv *e, lval *a) {
+    LASSERT_ARGC("pfilter", a, 2);
+    lpar p;
+    lval *err = lpar_run(e, a, "pfilter", lpar_map_chunk, &p);
+    if (err != NULL) { lval_del(a); return err; }
+    int n = p.lst->count;
+    if ((err = lpar_error(p.out, n)) != NULL) { lval_del(a); return err; }
+
+    lval *lst = lval_take(a, 1);
+    lval *v = lval_sexpr();
+    for (int i=0; i < n; i++) {
+        if (lval_is_true(p.out[i])) {
+            lval_add(v, lst->val.cell[i]);
+            lst->val.cell[i] = NULL;
+        }
+        lval_del(p.out[i]);
+    }
+    // Only free the cells that were not moved to v
+    for (int i=0; i < n; i++) {
+        if (lst->val.cell[i] != NULL) { lval_del(lst->val.cell[i]); }
+    }
+    lst->count = 0;
+    lval_del(lst);
+    free(p.out);
+    return v;
+}
 
-    int eq = lval_equal(a->val.cell[0], a->val.cell[1]);
+// (preduce op init lst) is (foldl op init lst) for an associative op,
+// each chunk being folded on its own before the results are combined.
+lval *builtin_preduce(lenv *e, lval *a) {
+    LASSERT_ARGC("preduce", a, 3);
+    if (a->val.cell[2]->type == LVAL_SEXPR && a->val.cell[2]->count == 0) {
+        return lval_take(a, 1);
+    }
+    lpar p;
+    lval *err = lpar_run(e, a, "preduce", lpar_reduce_chunk, &p);
+    if (err != NULL) { lval_del(a); return err; }
+    int n = p.chunks;
+    if ((err = lpar_error(p.out, n)) != NULL) { lval_del(a); return err; }
+
+    lval *acc = p.out[0];
+    for (int c=1; c < n; c++) {
+        if (acc->type == LVAL_ERR) {
+            lval_del(p.out[c]);
+            continue;
+        }
+        acc = lpar_call(e, p.op, acc, p.out[c]);
+    }
     lval_del(a);
-    return lval_bool(eq);
+    free(p.out);
+    return acc;
 }
 
-lval *builtin_is(lenv *e, lval *a) {
-    LASSERT_ARGC("is?", a, 2);
+// Futures
+//
+// (future {body}) evaluates body on the thread pool against a snapshot of
+// the calling env, so that later definitions do not race with it, and
+// (touch f) waits for its value. An error is returned by touch like any
+// other value.
+
+int lval_has_proc(lval *v) {
+    if (v->type == LVAL_PROC || v->type == LVAL_PROMISE) { return 1; }
+    if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+        for (int i=0; i < v->count; i++) {
+            if (lval_has_proc(v->val.cell[i])) { return 1; }
+        }
+    }
+    return 0;
+}
 
-    lval *v = a->val.cell[1];
-    lval *w = lval_take(a, 0);
-    return lval_lng(lval_is(v, w));
+void lfuture_run(void *arg, int i) {
+    lfuture *f = arg;
+    linterp *prev = LINTERP;
+    int parallel = LPARALLEL;
+    lenv *globals = LGLOBALS_THREAD;
+    LINTERP = NULL;
+    LPARALLEL = 0;
+    // def* defines in the root of the snapshot, never in the shared env
+    LGLOBALS_THREAD = f->env;
+    while (LGLOBALS_THREAD->encl != NULL) {
+        LGLOBALS_THREAD = LGLOBALS_THREAD->encl;
+    }
+    lval *result = lval_do(f->env, f->body);
+    f->body = NULL;
+    // Unless a procedure escapes with the result, nothing refers to the
+    // snapshot anymore
+    if (!lval_has_proc(result)) {
+        while (f->env != NULL) {
+            lenv *encl = f->env->encl;
+            lenv_del(f->env);
+            f->env = encl;
+        }
+        if (f->shared != NULL) { lsnapshot_release(f->shared); }
+    }
+    LINTERP = prev;
+    LPARALLEL = parallel;
+    LGLOBALS_THREAD = globals;
+
+    pthread_mutex_lock(&f->lock);
+    f->result = result;
+    f->done = 1;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+    lfuture_release(f);
 }
 
-lval *builtin_is_str(lenv *e, lval *a) {
-    LASSERT_ARGC("string?", a, 1);
+lval *builtin_future(lenv *e, lval *a) {
+    LASSERT_ARGC("future", a, 1);
+    LASSERT_ARGT("future", a, 0, LVAL_SEXPR);
+
+    lsnapshot *shared;
+    lfuture *f = lfuture_new(lval_take(a, 0), lenv_snapshot(e, &shared));
+    f->shared = shared;
+    lval *v = lval_new(LVAL_FUTURE);
+    v->val.future = f;
+    // The task holds its own reference until it is done
+    atomic_fetch_add(&f->refs, 1);
+    lpool_spawn(lfuture_run, f);
+    return v;
+}
 
-    lval *v = lval_bool(a->val.cell[0]->type == LVAL_STR);
+lval *builtin_touch(lenv *e, lval *a) {
+    LASSERT_ARGC("touch", a, 1);
+    LASSERT_ARGT("touch", a, 0, LVAL_FUTURE);
+
+    lfuture *f = a->val.cell[0]->val.future;
+    pthread_mutex_lock(&f->lock);
+    while (!f->done) {
+        // Help the pool, which may well run f here, rather than block
+        pthread_mutex_unlock(&f->lock);
+        int helped = lpool_help();
+        pthread_mutex_lock(&f->lock);
+        if (!helped && !f->done) {
+            pthread_cond_wait(&f->cond, &f->lock);
+        }
+    }
+    pthread_mutex_unlock(&f->lock);
+    lval *v = lval_copy(f->result);
     lval_del(a);
     return v;
 }
 
-lval *builtin_is_lng(lenv *e, lval *a) {
-    LASSERT_ARGC("integer?", a, 1);
+lval *builtin_is_future(lenv *e, lval *a) {
+    LASSERT_ARGC("future?", a, 1);
 
-    lval *v = lval_bool(a->val.cell[0]->type == LVAL_LNG);
+    lval *v = lval_bool(a->val.cell[0]->type == LVAL_FUTURE);
     lval_del(a);
     return v;
 }
 
-lval *builtin_is_dbl(lenv *e, lval *a) {
-    LASSERT_ARGC("float?", a, 1);
-
-    lval *v = lval_bool(a->val.cell[0]->type == LVAL_DBL);
-    lval_del(a);
+// Promises and lazy sequences
+//
+// (delay {body}) returns a promise to evaluate body in the calling env the
+// first time it is forced; its value, or error, is kept for later forces.
+// A lazy sequence is either {} or a list of its head and a promise of the
+// rest of the sequence, so that elements are only computed when needed.
+// Procedures that walk a sequence loop rather than recurse, and drop each
+// element once done with it: unless the head of a sequence is kept
+// somewhere, it runs in bounded memory whatever its length.
+
+lval *lval_promise(lval *body, lenv *env, lbuiltin thunk) {
+    lval *v = lval_new(LVAL_PROMISE);
+    v->val.promise = lpromise_new(body, env, thunk);
+    lenv_capture(env);
     return v;
 }
 
-lval *builtin_is_bool(lenv *e, lval *a) {
-    LASSERT_ARGC("boolean?", a, 1);
+lval *lpromise_force(lpromise *p) {
+    if (p->value == NULL) {
+        if (p->forcing) {
+            return lval_err("Promise forced again while being forced.");
+        }
+        p->forcing = 1;
+        lval *body = p->body;
+        p->body = NULL;
+        lval *v;
+        if (p->thunk != NULL) {
+            v = p->thunk(p->env, body);
+        } else {
+            v = lval_do(p->env, body);
+        }
+        p->forcing = 0;
+        p->value = v;
+    }
+    return lval_copy(p->value);
+}
 
-    lval *v = lval_bool(a->val.cell[0]->type == LVAL_BOOL);
-    lval_del(a);
-    return v;
+int lval_is_lazy(lval *v) {
+    return v->type == LVAL_SEXPR && (v->count == 0 ||
+        (v->count == 2 && v->val.cell[1]->type == LVAL_PROMISE));
 }
 
-lval *builtin_is_qexpr(lenv *e, lval *a) {
-    LASSERT_ARGC("quoted-list?", a, 1);
+// A sequence of head h and of the rest made by thunk from args
+lval *lazy_cell(lval *h, lenv *e, lbuiltin thunk, lval *args) {
+    lval *s = lval_sexpr();
+    lval_add(s, h);
+    lval_add(s, lval_promise(args, e, thunk));
+    return s;
+}
 
-    lval *v = lval_bool(a->val.cell[0]->type == LVAL_QEXPR);
-    lval_del(a);
-    return v;
+// Force the promise p of the rest of a sequence; p is consumed.
+lval *lazy_force(lval *p) {
+    lval *t = lpromise_force(p->val.promise);
+    lval_del(p);
+    if (t->type != LVAL_ERR && !lval_is_lazy(t)) {
+        lval_del(t);
+        return lval_err("The rest of a lazy sequence is not a lazy sequence.");
+    }
+    return t;
 }
 
-lval *builtin_is_sexpr(lenv *e, lval *a) {
-    LASSERT_ARGC("list?", a, 1);
+// The rest of the non-empty lazy sequence s, which is consumed
+lval *lazy_rest(lval *s) {
+    return lazy_force(lval_take(s, 1));
+}
 
-    lval *v = lval_bool(a->val.cell[0]->type == LVAL_SEXPR);
-    lval_del(a);
-    return v;
+// Replace the last of args, the promise of the rest of a sequence, by
+// that rest. Returns the error instead if forcing it failed.
+lval *lazy_force_last(lval *a) {
+    lval *t = lazy_force(lval_pop(a, a->count - 1));
+    if (t->type == LVAL_ERR) {
+        lval_del(a);
+        return t;
+    }
+    return lval_add(a, t);
 }
 
-lval *builtin_is_err(lenv *e, lval *a) {
-    LASSERT_ARGC("error?", a, 1);
+lval *lazy_args2(lval *x, lval *y) {
+    lval *a = lval_sexpr();
+    lval_add(a, x);
+    return lval_add(a, y);
+}
 
-    lval *v = lval_bool(a->val.cell[0]->type == LVAL_ERR);
-    lval_del(a);
-    return v;
+lval *lazy_call(lenv *e, lval *op, lval *x, lval *y) {
+    lval *args = lval_sexpr();
+    if (x != NULL) { lval_add(args, x); }
+    lval_add(args, y);
+    return lval_call(e, lval_copy(op), args);
 }
 
-lval *builtin_is_proc(lenv *e, lval *a) {
-    LASSERT_ARGC("procedure?", a, 1);
+lval *builtin_delay(lenv *e, lval *a) {
+    LASSERT_ARGC("delay", a, 1);
+    LASSERT_ARGT("delay", a, 0, LVAL_SEXPR);
+    return lval_promise(lval_take(a, 0), e, NULL);
+}
 
-    lval *v = lval_bool(a->val.cell[0]->type == LVAL_PROC);
+lval *builtin_force(lenv *e, lval *a) {
+    LASSERT_ARGC("force", a, 1);
+    if (a->val.cell[0]->type != LVAL_PROMISE) { return lval_take(a, 0); }
+    lval *v = lpromise_force(a->val.cell[0]->val.promise);
     lval_del(a);
     return v;
 }
 
-lval *builtin_is_builtin(lenv *e, lval *a) {
-    LASSERT_ARGC("builtin?", a, 1);
-
-    lval *v = lval_bool(a->val.cell[0]->type == LVAL_BUILTIN);
+lval *builtin_is_promise(lenv *e, lval *a) {
+    LASSERT_ARGC("promise?", a, 1);
+    lval *v = lval_bool(a->val.cell[0]->type == LVAL_PROMISE);
     lval_del(a);
     return v;
 }
 
-lval *builtin_and(lenv *e, lval *a) {
-    int i;
-    for (i=0; i < a->count; i++) {
-        if (!lval_is_true(a->val.cell[i])) {
-            return lval_take(a, i);
-        }
+lval *builtin_lazy_cons(lenv *e, lval *a) {
+    LASSERT_ARGC("lazy-cons", a, 2);
+    LASSERT_ARGT("lazy-cons", a, 1, LVAL_SEXPR);
+    lval *h = lval_pop(a, 0);
+    lval *s = lval_sexpr();
+    lval_add(s, h);
+    lval_add(s, lval_promise(lval_take(a, 0), e, NULL));
+    return s;
+}
+
+lval *builtin_lazy_rest(lenv *e, lval *a) {
+    LASSERT_ARGC("lazy-rest", a, 1);
+    LASSERT_LAZY("lazy-rest", a, 0);
+    LASSERT(a, a->val.cell[0]->count != 0,
+        "Procedure 'lazy-rest' undefined on the empty sequence '{}'.");
+    return lazy_rest(lval_take(a, 0));
+}
+
+lval *builtin_lazy_seq(lenv *e, lval *a) {
+    LASSERT_ARGC("lazy-seq", a, 1);
+    LASSERT_ARGT("lazy-seq", a, 0, LVAL_SEXPR);
+    if (a->val.cell[0]->count == 0) { return lval_take(a, 0); }
+    lval *lst = lval_pop(a, 0);
+    lval *h = lval_pop(lst, 0);
+    return lazy_cell(h, e, builtin_lazy_seq, lval_add(a, lst));
+}
+
+lval *builtin_lazy_range(lenv *e, lval *a) {
+    LASSERT(a, a->count == 1 || a->count == 2,
+        "Procedure 'lazy-range' takes 1 or 2 arguments.");
+    for (int i=0; i < a->count; i++) {
+        LASSERT_ARGT("lazy-range", a, i, LVAL_LNG);
     }
-    if (a->count == 0) {
+    lval *n = lval_pop(a, 0);
+    if (a->count && n->val.lng >= a->val.cell[0]->val.lng) {
+        lval_del(n);
         lval_del(a);
-        return lval_bool(LTRUE);
-    } else {
-        return lval_take(a, --i);
+        return lval_sexpr();
     }
+    lval *h = lval_lng(n->val.lng++);
+    return lazy_cell(h, e, builtin_lazy_range, lval_insert(a, n, 0));
 }
 
-lval *builtin_or(lenv *e, lval *a) {
-    int i;
-    for (i=0; i < a->count; i++) {
-        if (lval_is_true(a->val.cell[i])) {
-            return lval_take(a, i);
-        }
-    }
-    if (a->count == 0) {
+lval *lazy_iterate_next(lenv *e, lval *a) {
+    lval *x = lazy_call(e, a->val.cell[0], NULL, lval_pop(a, 1));
+    if (x->type == LVAL_ERR) {
         lval_del(a);
-        return lval_bool(LFALSE);
-    } else {
-        return lval_take(a, --i);
+        return x;
     }
+    return builtin_lazy_iterate(e, lval_add(a, x));
 }
 
-lval *builtin_not(lenv *e, lval *a) {
-    LASSERT_ARGC("not", a, 1);
-    lval *v = lval_take(a, 0);
-    lval *b = lval_bool(lval_is_true(v) ? LFALSE : LTRUE);
-    lval_del(v);
-    return b;
+lval *builtin_lazy_iterate(lenv *e, lval *a) {
+    LASSERT_ARGC("lazy-iterate", a, 2);
+    lval *h = lval_copy(a->val.cell[1]);
+    return lazy_cell(h, e, lazy_iterate_next, a);
 }
 
-lval *builtin_def(lenv *e, lval *a) {
-    LASSERT(a, a->count > 1,
-            "Builtin 'def' expected at least 2 arguments.");
-    LASSERT_ARGT("def", a, 0, LVAL_SEXPR);
-
-    lval *ks = lval_pop(a, 0);
+lval *lazy_map_next(lenv *e, lval *a) {
+    if ((a = lazy_force_last(a))->type == LVAL_ERR) { return a; }
+    return builtin_lazy_map(e, a);
+}
 
-    if (ks->count != a->count) {
+lval *builtin_lazy_map(lenv *e, lval *a) {
+    LASSERT_ARGC("lazy-map", a, 2);
+    LASSERT_LAZY("lazy-map", a, 1);
+    lval *s = lval_pop(a, 1);
+    if (s->count == 0) {
         lval_del(a);
-        lval_del(ks);
-        return lval_err("Builtin 'def': wrong number of symbols.");
-    }
-    for (int i=0; i < ks->count; i++) {
-        if (ks->val.cell[i]->type != LVAL_SYM) {
-            lval_del(a);
-            lval_del(ks);
-            return lval_err("Builtin 'def': only symbols can be defined.");
-        }
+        return s;
     }
-    for (int i=0; i < ks->count; i++) {
-        lenv_put(e, ks->val.cell[i]->val.str, a->val.cell[i]);
+    lval *h = lazy_call(e, a->val.cell[0], NULL, lval_pop(s, 0));
+    if (h->type == LVAL_ERR) {
+        lval_del(a);
+        lval_del(s);
+        return h;
     }
-    lval_del(ks);
-    return a;
+    return lazy_cell(h, e, lazy_map_next, lval_add(a, lval_take(s, 0)));
 }
 
-lval *builtin_def_global(lenv *e, lval *a) {
-    lenv *global = e;
-    while(global->encl != NULL) {
-        global = global->encl;
-    }
-    return builtin_def(global, a);
+lval *lazy_filter_next(lenv *e, lval *a) {
+    if ((a = lazy_force_last(a))->type == LVAL_ERR) { return a; }
+    return builtin_lazy_filter(e, a);
 }
 
-// Define a procedure like (fun {f x y} {(+ x y)})
-// which is equivalent to (def {f} (\ {x y} {(+ x y)}))
-// but cannot be implemented correctly in jblisp given
-// how lexical scoping is currenctly implemented
-lval *builtin_fun(lenv *e, lval *a) {
-    LASSERT_ARGC("fun", a, 2);
-    LASSERT_ARGT("fun", a, 0, LVAL_SEXPR);
-    LASSERT_ARGT("fun", a, 1, LVAL_SEXPR);
-
-    lval *syms = lval_pop(a, 0);
-    for (int i=0; i < syms->count; i++) {
-        if (syms->val.cell[i]->type != LVAL_SYM) {
-            lval_del(syms);
+lval *builtin_lazy_filter(lenv *e, lval *a) {
+    LASSERT_ARGC("lazy-filter", a, 2);
+    LASSERT_LAZY("lazy-filter", a, 1);
+    lval *s = lval_pop(a, 1);
+    // Skip to the first element to keep
+    while (s->count) {
+        lval *h = lval_pop(s, 0);
+        lval *keep = lazy_call(e, a->val.cell[0], NULL, lval_copy(h));
+        if (keep->type == LVAL_ERR) {
+            lval_del(h);
+            lval_del(s);
             lval_del(a);
-            return lval_err("'fun' expected a list of symbols as first arg");
+            return keep;
         }
+        int t = lval_is_true(keep);
+        lval_del(keep);
+        if (t) {
+            return lazy_cell(h, e, lazy_filter_next,
+                             lval_add(a, lval_take(s, 0)));
+        }
+        lval_del(h);
+        s = lazy_force(lval_take(s, 0));
+        if (s->type == LVAL_ERR) { break; }
     }
-    lval *adef = lval_sexpr();
-    lval *defsym = lval_sexpr();
-    lval_add(defsym, lval_pop(syms, 0));
-    lval_add(adef, defsym);
+    lval_del(a);
+    return s;
+}
 
-    lval *alambda = lval_sexpr();
-    lval_add(alambda, syms);
-    lval_add(alambda, lval_take(a, 0));  // procedure body
+// Unlike the others, does not force the rest once n elements are taken.
+lval *lazy_take_next(lenv *e, lval *a) {
+    if (a->val.cell[0]->val.lng <= 0) {
+        lval_del(a);
+        return lval_sexpr();
+    }
+    if ((a = lazy_force_last(a))->type == LVAL_ERR) { return a; }
+    return builtin_lazy_take(e, a);
+}
 
-    lval* lambda = builtin_lambda(e, alambda);
-    if (lambda->type == LVAL_ERR) {
-        lval_del(adef);
-        return lambda;
+lval *builtin_lazy_take(lenv *e, lval *a) {
+    LASSERT_ARGC("lazy-take", a, 2);
+    LASSERT_ARGT("lazy-take", a, 0, LVAL_LNG);
+    LASSERT_LAZY("lazy-take", a, 1);
+    long n = a->val.cell[0]->val.lng;
+    lval *s = lval_pop(a, 1);
+    lval_del(a);
+    if (n <= 0 || s->count == 0) {
+        lval_del(s);
+        return lval_sexpr();
     }
+    lval *h = lval_pop(s, 0);
+    a = lazy_args2(lval_lng(n - 1), lval_take(s, 0));
+    return lazy_cell(h, e, lazy_take_next, a);
+}
 
-    lval_add(adef, lambda);
-    return builtin_def(e, adef);
+// The first n elements of a lazy sequence, as a list
+lval *builtin_take(lenv *e, lval *a) {
+    LASSERT_ARGC("take", a, 2);
+    LASSERT_ARGT("take", a, 0, LVAL_LNG);
+    LASSERT_LAZY("take", a, 1);
+    long n = a->val.cell[0]->val.lng;
+    lval *s = lval_take(a, 1);
+    lval *out = lval_sexpr();
+    while (n > 0 && s->count) {
+        lval_add(out, lval_pop(s, 0));
+        if (--n == 0) { break; }
+        s = lazy_force(lval_take(s, 0));
+        if (s->type == LVAL_ERR) {
+            lval_del(out);
+            return s;
+        }
+    }
+    lval_del(s);
+    return out;
 }
 
-lval *builtin_lambda(lenv *e, lval *a) {
+lval *builtin_lazy_fold(lenv *e, lval *a) {
+    LASSERT_ARGC("lazy-fold", a, 3);
+    LASSERT_LAZY("lazy-fold", a, 2);
+    lval *s = lval_pop(a, 2);
+    lval *acc = lval_pop(a, 1);
+    while (s->count && acc->type != LVAL_ERR) {
+        acc = lazy_call(e, a->val.cell[0], acc, lval_pop(s, 0));
+        s = lazy_force(lval_take(s, 0));
+        if (s->type == LVAL_ERR) {
+            lval_del(acc);
+            acc = s;
+            s = lval_sexpr();
+        }
+    }
+    lval_del(s);
+    lval_del(a);
+    return acc;
+}
+
+lval *builtin_lazy_each(lenv *e, lval *a) {
+    LASSERT_ARGC("lazy-each", a, 2);
+    LASSERT_LAZY("lazy-each", a, 1);
+    lval *s = lval_pop(a, 1);
+    while (s->count) {
+        lval *x = lazy_call(e, a->val.cell[0], NULL, lval_pop(s, 0));
+        if (x->type == LVAL_ERR) {
+            lval_del(s);
+            lval_del(a);
+            return x;
+        }
+        lval_del(x);
+        s = lazy_force(lval_take(s, 0));
+        if (s->type == LVAL_ERR) { break; }
+    }
+    lval_del(a);
+    return s;
+}
+
+// Coroutines and channels
+//
+// (spawn {body}) evaluates body in a coroutine sharing the calling env.
+// Coroutines of an interpreter run on its thread, one at a time: a
+// coroutine gives way to the others when it blocks on a channel, calls
+// (yield), or has made LCO_REDUCTIONS procedure calls. Spawned coroutines
+// get to run when the main one blocks or at the end of each top-level
+// expression. Each coroutine has its own C stack, reserved but only
+// committed as it is used.
+
+void lco_push(lcoqueue *q, lco *co) {
+    co->next = NULL;
+    if (q->tail != NULL) { q->tail->next = co; } else { q->head = co; }
+    q->tail = co;
+}
+
+lco *lco_pop(lcoqueue *q) {
+    lco *co = q->head;
+    if (co != NULL) {
+        q->head = co->next;
+        if (q->head == NULL) { q->tail = NULL; }
+    }
+    return co;
+}
+
+void lco_remove(lcoqueue *q, lco *co) {
+    lco **p = &q->head;
+    lco *prev = NULL;
+    while (*p != NULL && *p != co) {
+        prev = *p;
+        p = &(*p)->next;
+    }
+    if (*p == NULL) { return; }
+    *p = co->next;
+    if (q->tail == co) { q->tail = prev; }
+}
+
+char *lco_stack_new(linterp *it) {
+    if (it->stacks_count) { return it->stacks[--it->stacks_count]; }
+    char *stack = mmap(NULL, LCO_STACK_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (stack == MAP_FAILED) { return NULL; }
+    // Guard page, so that an overflow faults instead of corrupting memory
+    mprotect(stack, sysconf(_SC_PAGESIZE), PROT_NONE);
+    return stack;
+}
+
+void lco_stack_del(linterp *it, char *stack) {
+    if (it->stacks_count < LCO_STACKS_CACHED) {
+        it->stacks[it->stacks_count++] = stack;
+    } else {
+        munmap(stack, LCO_STACK_SIZE);
+    }
+}
+
+void lco_del(linterp *it, lco *co) {
+    if (co->live_prev != NULL) { co->live_prev->live_next = co->live_next; }
+    else { it->live = co->live_next; }
+    if (co->live_next != NULL) { co->live_next->live_prev = co->live_prev; }
+    if (co->body != NULL) { lval_del(co->body); }
+    lco_stack_del(it, co->stack);
+    free(co);
+}
+
+// A finished coroutine cannot free the stack it runs on, the next one
+// to run does.
+void lco_reap(linterp *it) {
+    if (it->zombie != NULL) {
+        lco_del(it, it->zombie);
+        it->zombie = NULL;
+    }
+}
+
+// Pop the next ready coroutine, first waiting for I/O if none is ready
+// but some are waiting for it.
+lco *lco_next(linterp *it) {
+    while (it->ready.head == NULL && it->io_waiting > 0) {
+        lio_poll(it, -1);
+    }
+    return lco_pop(&it->ready);
+}
+
+// Switch to the next ready coroutine. Returns -1 if there is none.
+int lco_switch(linterp *it) {
+    lco *co = it->current;
+    lco *next = lco_next(it);
+    if (next == NULL) { return -1; }
+    it->reductions = 0;
+    // Blocked on I/O, and first to be woken up
+    if (next == co) { return 0; }
+    it->current = next;
+    swapcontext(&co->ctx, &next->ctx);
+    lco_reap(it);
+    return 0;
+}
+
+void lco_yield(linterp *it) {
+    lco_push(&it->ready, it->current);
+    lco_switch(it);
+}
+
+// Block the current coroutine on q until another wakes it up.
+// Returns -1 if every coroutine would then be blocked.
+int lco_block(linterp *it, lcoqueue *q) {
+    lco *co = it->current;
+    lco_push(q, co);
+    co->waiting = q;
+    if (lco_switch(it) || co->deadlock) {
+        lco_remove(q, co);
+        co->waiting = NULL;
+        co->deadlock = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void lco_wake(linterp *it, lcoqueue *q) {
+    lco *co = lco_pop(q);
+    if (co != NULL) {
+        co->waiting = NULL;
+        lco_push(&it->ready, co);
+    }
+}
+
+void lco_entry() {
+    linterp *it = LINTERP;
+    lco *co = it->current;
+    lco_reap(it);
+    lval *body = co->body;
+    co->body = NULL;
+    lval *x = lval_do(co->env, body);
+    if (x->type == LVAL_ERR) {
+        lval_println(x);
+    } else {
+        lval_del(x);
+    }
+
+    it->zombie = co;
+    lco *next = lco_next(it);
+    if (next == NULL) {
+        // The main coroutine is blocked, and nothing will ever wake it up
+        next = &it->main;
+        if (next->waiting != NULL) { lco_remove(next->waiting, next); }
+        next->waiting = NULL;
+        next->deadlock = 1;
+    }
+    it->current = next;
+    it->reductions = 0;
+    setcontext(&next->ctx);
+}
+
+// Let spawned coroutines run until they are all done or blocked, taking
+// in the I/O that is ready; with io, until none is waiting for I/O either.
+void lco_run(linterp *it, int io) {
+    if (it->current != &it->main) { return; }
+    for (;;) {
+        if (it->ready.head != NULL) {
+            lco_yield(it);
+        } else if (it->io_waiting > 0 &&
+                   (lio_poll(it, io ? -1 : 0) > 0 || io)) {
+            continue;
+        } else {
+            break;
+        }
+    }
+}
+
+void lco_cleanup(linterp *it) {
+    lco_reap(it);
+    while (it->live != NULL) {
+        lco_del(it, it->live);
+    }
+    for (int i=0; i < it->stacks_count; i++) {
+        munmap(it->stacks[i], LCO_STACK_SIZE);
+    }
+}
+
+lval *builtin_spawn(lenv *e, lval *a) {
+    LASSERT_ARGC("spawn", a, 1);
+    LASSERT_ARGT("spawn", a, 0, LVAL_SEXPR);
+    linterp *it = LINTERP;
+    LASSERT(a, it != NULL,
+        "Procedure 'spawn' can only be used on the thread of an interpreter.");
+
+    lco *co = calloc(1, sizeof(lco));
+    co->stack = lco_stack_new(it);
+    if (co->stack == NULL) {
+        free(co);
+        lval_del(a);
+        return lval_err("Procedure 'spawn' could not allocate a stack.");
+    }
+    co->body = lval_take(a, 0);
+    co->env = e;
+    co->globals = it->current->globals;
+    // The limits of the spawning evaluation, less what it used; 0 would
+    // be none
+    lco *cur = it->current;
+    if (cur->step_limit) {
+        co->step_limit = cur->step_limit > cur->steps ?
+            cur->step_limit - cur->steps : 1;
+    }
+    co->heap_limit = cur->heap_limit;
+    if (cur->depth_limit) {
+        co->depth_limit = cur->depth_limit > cur->prof.depth ?
+            cur->depth_limit - cur->prof.depth : 1;
+    }
+    lenv_capture(e);
+    getcontext(&co->ctx);
+    co->ctx.uc_stack.ss_sp = co->stack;
+    co->ctx.uc_stack.ss_size = LCO_STACK_SIZE;
+    co->ctx.uc_link = NULL;
+    makecontext(&co->ctx, (void (*)(void)) lco_entry, 0);
+    co->live_next = it->live;
+    if (it->live != NULL) { it->live->live_prev = co; }
+    it->live = co;
+    lco_push(&it->ready, co);
+    return lval_sexpr();
+}
+
+lval *builtin_yield(lenv *e, lval *a) {
+    LASSERT_ARGC("yield", a, 0);
+    if (LINTERP != NULL && LINTERP->ready.head != NULL) {
+        lco_yield(LINTERP);
+    }
+    return a;
+}
+
+lval *builtin_chan(lenv *e, lval *a) {
+    LASSERT(a, a->count <= 1, "Procedure 'chan' takes at most 1 argument.");
+    long size = 1;
+    if (a->count == 1) {
+        LASSERT_ARGT("chan", a, 0, LVAL_LNG);
+        size = a->val.cell[0]->val.lng;
+    }
+    LASSERT(a, size >= 1 && size <= INT_MAX,
+        "Procedure 'chan' expected a positive capacity.");
+    lval_del(a);
+    lval *v = lval_new(LVAL_CHAN);
+    v->val.chan = lchan_new((int) size);
+    return v;
+}
+
+lval *builtin_send(lenv *e, lval *a) {
+    LASSERT_ARGC("send", a, 2);
+    LASSERT_ARGT("send", a, 0, LVAL_CHAN);
+    linterp *it = LINTERP;
+    LASSERT(a, it != NULL,
+        "Procedure 'send' can only be used on the thread of an interpreter.");
+
+    lchan *c = a->val.cell[0]->val.chan;
+    while (c->count == c->size) {
+        LASSERT(a, lco_block(it, &c->senders) == 0,
+            "Deadlock: 'send' on a full channel no coroutine will receive from.");
+    }
+    c->buf[(c->head + c->count++) % c->size] = lval_pop(a, 1);
+    lco_wake(it, &c->receivers);
+    lval_del(a);
+    return lval_sexpr();
+}
+
+lval *builtin_recv(lenv *e, lval *a) {
+    LASSERT_ARGC("recv", a, 1);
+    LASSERT_ARGT("recv", a, 0, LVAL_CHAN);
+    linterp *it = LINTERP;
+    LASSERT(a, it != NULL,
+        "Procedure 'recv' can only be used on the thread of an interpreter.");
+
+    lchan *c = a->val.cell[0]->val.chan;
+    while (c->count == 0) {
+        LASSERT(a, lco_block(it, &c->receivers) == 0,
+            "Deadlock: 'recv' on an empty channel no coroutine will send to.");
+    }
+    lval *v = c->buf[c->head];
+    c->head = (c->head + 1) % c->size;
+    c->count--;
+    lco_wake(it, &c->senders);
+    lval_del(a);
+    return v;
+}
+
+// Actors
+//
+// An actor is an interpreter of its own, with its own env, running on its
+// own thread. Actors share nothing but their mailboxes: messages are frozen
+// values, passed by reference without copying. Procedures and channels
+// belong to their interpreter and cannot be posted.
+
+static const unsigned char *LPRELUDE;
+static size_t LPRELUDE_LEN;
+
+// Set the image loaded into the env of every new actor.
+void linterp_set_prelude(const unsigned char *buf, size_t len) {
+    LPRELUDE = buf;
+    LPRELUDE_LEN = len;
+}
+
+// Load the registered prelude into the env of it. Returns -1 if there is
+// none or it is corrupt.
+int linterp_load_prelude(linterp *it) {
+    if (LPRELUDE == NULL) { return -1; }
+    return lenv_load(it->env, LPRELUDE, LPRELUDE_LEN);
+}
+
+typedef struct {
+    lval *body;
+    lmailbox *mailbox;
+} lactor;
+
+lmailbox *linterp_mailbox(linterp *it) {
+    if (it->mailbox == NULL) { it->mailbox = lmailbox_new(); }
+    return it->mailbox;
+}
+
+lval *lval_actor(lmailbox *m) {
+    lval *v = lval_new(LVAL_ACTOR);
+    v->val.mailbox = m;
+    atomic_fetch_add(&m->refs, 1);
+    return v;
+}
+
+void *lactor_main(void *arg) {
+    lactor *a = arg;
+    linterp *it = linterp_new();
+    it->mailbox = a->mailbox;
+    LINTERP = it;
+    if (LPRELUDE != NULL && linterp_load_prelude(it)) {
+        puts("Corrupt prelude image, actor started without it.");
+    }
+    lval *x = lval_do(it->env, a->body);
+    if (x->type == LVAL_ERR) {
+        lval_println(x);
+    } else {
+        lval_del(x);
+    }
+    lco_run(it, 1);
+    LINTERP = NULL;
+    linterp_del(it);
+    free(a);
+    return NULL;
+}
+
+// Take the last argument of a without thawing it.
+lval *lval_take_last(lval *a) {
+    lval *v = a->val.cell[--a->count];
+    lval_del(a);
+    return v;
+}
+
+lval *builtin_freeze(lenv *e, lval *a) {
+    LASSERT_ARGC("freeze", a, 1);
+    LASSERT(a, lval_freeze(a->val.cell[0]) == 0,
+        "Procedure 'freeze' cannot freeze procedures or channels.");
+    return lval_take_last(a);
+}
+
+lval *builtin_is_frozen(lenv *e, lval *a) {
+    LASSERT_ARGC("frozen?", a, 1);
+    lval *v = lval_bool(lval_is_frozen(a->val.cell[0]));
+    lval_del(a);
+    return v;
+}
+
+lval *builtin_actor(lenv *e, lval *a) {
+    LASSERT_ARGC("actor", a, 1);
+    LASSERT_ARGT("actor", a, 0, LVAL_SEXPR);
+    LASSERT(a, lval_freeze(a->val.cell[0]) == 0,
+        "Procedure 'actor' cannot share procedures or channels.");
+
+    lactor *act = malloc(sizeof(lactor));
+    act->mailbox = lmailbox_new();
+    lval *v = lval_actor(act->mailbox);
+    act->body = lval_take_last(a);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, lactor_main, act)) {
+        lval_del(act->body);
+        lmailbox_release(act->mailbox);
+        free(act);
+        lval_del(v);
+        return lval_err("Procedure 'actor' could not start a thread.");
+    }
+    pthread_detach(thread);
+    return v;
+}
+
+lval *builtin_self(lenv *e, lval *a) {
+    LASSERT_ARGC("self", a, 0);
+    linterp *it = LINTERP;
+    LASSERT(a, it != NULL,
+        "Procedure 'self' can only be used on the thread of an interpreter.");
+    lval_del(a);
+    return lval_actor(linterp_mailbox(it));
+}
+
+lval *builtin_post(lenv *e, lval *a) {
+    LASSERT_ARGC("post", a, 2);
+    LASSERT_ARGT("post", a, 0, LVAL_ACTOR);
+    LASSERT(a, lval_freeze(a->val.cell[1]) == 0,
+        "Procedure 'post' cannot send procedures or channels.");
+
+    lmailbox *m = a->val.cell[0]->val.mailbox;
+    lmailbox_put(m, a->val.cell[--a->count]);
+    lval_del(a);
+    return lval_sexpr();
+}
+
+// Ports and the event loop
+//
+// Ports are non-blocking. A coroutine that would block on one is parked
+// until epoll reports the port ready, while the other coroutines of the
+// interpreter run; when all of them are waiting for I/O, the thread waits
+// in epoll_wait. Regular files cannot be polled and are always ready.
+
+#define LIO_EVENTS 64
+#define LPORT_CHUNK 4096
+
+// Wait up to timeout ms, or forever if -1, for I/O and wake up the
+// coroutines it unblocks. Returns the number of events.
+int lio_poll(linterp *it, int timeout) {
+    struct epoll_event evs[LIO_EVENTS];
+    int n = epoll_wait(it->epfd, evs, LIO_EVENTS, timeout);
+    for (int i=0; i < n; i++) {
+        lportfd *pf = evs[i].data.ptr;
+        while (pf->waiters.head != NULL) {
+            lco_wake(it, &pf->waiters);
+            it->io_waiting--;
+        }
+    }
+    return n;
+}
+
+// Block the current coroutine until the fd of pf is ready for events.
+// Returns -1 with errno set if it cannot be polled.
+int lio_wait(linterp *it, lportfd *pf, int events) {
+    if (it->epfd < 0 && (it->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        return -1;
+    }
+    struct epoll_event ev;
+    ev.events = events | EPOLLONESHOT;
+    ev.data.ptr = pf;
+    int op = pf->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(it->epfd, op, pf->fd, &ev)) {
+        return errno == EPERM ? 0 : -1;
+    }
+    pf->registered = 1;
+    it->io_waiting++;
+    lco_block(it, &pf->waiters);
+    return 0;
+}
+
+// Let the other coroutines of the interpreter run before blocking its
+// thread on the mailbox. While some wait for I/O, the message may come from
+// one of them, so the mailbox is waited for in epoll with the ports.
+lval *builtin_receive(lenv *e, lval *a) {
+    LASSERT_ARGC("receive", a, 0);
+    linterp *it = LINTERP;
+    LASSERT(a, it != NULL,
+        "Procedure 'receive' can only be used on the thread of an interpreter.");
+
+    lmailbox *m = linterp_mailbox(it);
+    while (lmailbox_empty(m)) {
+        if (it->ready.head != NULL) {
+            lco_yield(it);
+            continue;
+        }
+        if (it->io_waiting == 0) { break; }
+        it->mail.fd = lmailbox_efd(m);
+        // A message put before the eventfd was made is not counted by it
+        if (it->mail.fd < 0) { break; }
+        if (!lmailbox_empty(m)) { continue; }
+        if (lio_wait(it, &it->mail, EPOLLIN)) { break; }
+        uint64_t n;
+        if (read(it->mail.fd, &n, sizeof(n)) < 0) { n = 0; }
+    }
+    lval_del(a);
+    return lmailbox_get(m);
+}
+
+// Close one direction of a port. The coroutines waiting for it are woken
+// up, to find it closed.
+void lportfd_close(linterp *it, lportfd *pf, lportfd *other) {
+    if (pf->fd < 0) { return; }
+    if (pf->registered && it != NULL && it->epfd >= 0) {
+        epoll_ctl(it->epfd, EPOLL_CTL_DEL, pf->fd, NULL);
+    }
+    pf->registered = 0;
+    while (it != NULL && pf->waiters.head != NULL) {
+        lco_wake(it, &pf->waiters);
+        it->io_waiting--;
+    }
+    if (pf->fd != other->fd) { close(pf->fd); }
+    pf->fd = -1;
+}
+
+void lport_close(linterp *it, lport *p) {
+    lportfd_close(it, &p->in, &p->out);
+    lportfd_close(it, &p->out, &p->in);
+    if (p->pid > 0) {
+        // Its stdout is gone, a process still running has no use
+        if (waitpid(p->pid, NULL, WNOHANG) == 0) {
+            kill(p->pid, SIGTERM);
+            waitpid(p->pid, NULL, 0);
+        }
+        p->pid = 0;
+    }
+}
+
+// Read more of the input of p into its buffer, waiting for it if need be.
+// Returns -1 with errno set on error, or if p was closed meanwhile.
+int lport_fill(linterp *it, lport *p) {
+    for (;;) {
+        if (p->in.fd < 0) {
+            errno = EBADF;
+            return -1;
+        }
+        if (p->start > 0) {
+            memmove(p->buf, p->buf + p->start, p->len - p->start);
+            p->len -= p->start;
+            p->start = 0;
+        }
+        if (p->size - p->len < LPORT_CHUNK) {
+            p->size = p->size ? p->size * 2 : LPORT_CHUNK;
+            p->buf = realloc(p->buf, p->size);
+        }
+        ssize_t n = read(p->in.fd, p->buf + p->len, p->size - p->len);
+        if (n > 0) {
+            p->len += n;
+            return 0;
+        }
+        if (n == 0) {
+            p->eof = 1;
+            return 0;
+        }
+        if (errno == EINTR) { continue; }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) { return -1; }
+        if (lio_wait(it, &p->in, EPOLLIN)) { return -1; }
+    }
+}
+
+// Take the n first bytes of the buffered input of p as a string
+lval *lport_take(lport *p, int n, int skip) {
+    lval *v = lval_str(p->buf + p->start, n);
+    p->start += n + skip;
+    if (p->start == p->len) { p->start = p->len = 0; }
+    return v;
+}
+
+lval *lval_port(lport *p) {
+    lval *v = lval_new(LVAL_PORT);
+    v->val.port = p;
+    return v;
+}
+
+int lio_nonblock(int fd) {
+    return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+lval *builtin_open_file(lenv *e, lval *a) {
+    LASSERT_ARGC("open-file", a, 2);
+    LASSERT_ARGT("open-file", a, 0, LVAL_STR);
+    LASSERT_ARGT("open-file", a, 1, LVAL_STR);
+
+    char *path = a->val.cell[0]->val.str;
+    char *mode = a->val.cell[1]->val.str;
+    int flags;
+    if (strcmp(mode, "r") == 0) {
+        flags = O_RDONLY;
+    } else if (strcmp(mode, "w") == 0) {
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+    } else if (strcmp(mode, "a") == 0) {
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+    } else {
+        lval_del(a);
+        return lval_err("Procedure 'open-file' expected mode \"r\", \"w\" or \"a\".");
+    }
+    int fd = open(path, flags | O_NONBLOCK | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        lval *err = lval_err("Could not open '%s': %s", path, strerror(errno));
+        lval_del(a);
+        return err;
+    }
+    lval_del(a);
+    if (flags == O_RDONLY) { return lval_port(lport_new(fd, -1, 0)); }
+    return lval_port(lport_new(-1, fd, 0));
+}
+
+// (process "cmd") runs cmd with sh; the port writes to its stdin and reads
+// from its stdout.
+lval *builtin_process(lenv *e, lval *a) {
+    LASSERT_ARGC("process", a, 1);
+    LASSERT_ARGT("process", a, 0, LVAL_STR);
+
+    int in[2], out[2];
+    if (pipe2(in, O_CLOEXEC)) {
+        lval_del(a);
+        return lval_err("Could not start process: %s", strerror(errno));
+    }
+    if (pipe2(out, O_CLOEXEC)) {
+        close(in[0]);
+        close(in[1]);
+        lval_del(a);
+        return lval_err("Could not start process: %s", strerror(errno));
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(in[0], 0);
+        dup2(out[1], 1);
+        execl("/bin/sh", "sh", "-c", a->val.cell[0]->val.str, (char*) NULL);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    if (pid < 0) {
+        close(in[1]);
+        close(out[0]);
+        lval_del(a);
+        return lval_err("Could not start process: %s", strerror(errno));
+    }
+    lio_nonblock(in[1]);
+    lio_nonblock(out[0]);
+    lval_del(a);
+    return lval_port(lport_new(out[0], in[1], pid));
+}
+
+#define LASSERT_PORT(fname, args, dir)                                     \
+    LASSERT_ARGT(fname, args, 0, LVAL_PORT);                               \
+    LASSERT(args, LINTERP != NULL,                                         \
+        "Procedure '" fname "' can only be used on the thread of an "      \
+        "interpreter.");                                                   \
+    LASSERT(args, args->val.cell[0]->val.port->dir.fd >= 0,                \
+        "Procedure '" fname "' expected an open port to " #dir "put.")
+
+// Returns the next line without its newline, or () at the end of input.
+lval *builtin_read_line(lenv *e, lval *a) {
+    LASSERT_ARGC("read-line", a, 1);
+    LASSERT_PORT("read-line", a, in);
+
+    lport *p = a->val.cell[0]->val.port;
+    int scanned = 0;
+    for (;;) {
+        if (scanned > p->len - p->start) { scanned = 0; }
+        char *start = p->buf + p->start;
+        char *nl = memchr(start + scanned, '\n', p->len - p->start - scanned);
+        lval *v = NULL;
+        if (nl != NULL) {
+            v = lport_take(p, nl - start, 1);
+        } else if (p->eof) {
+            v = p->len > p->start ? lport_take(p, p->len - p->start, 0)
+                                  : lval_sexpr();
+        } else {
+            scanned = p->len - p->start;
+            if (lport_fill(LINTERP, p)) {
+                v = lval_err("Could not read: %s",
+                    p->in.fd >= 0 ? strerror(errno) : "port closed");
+            }
+        }
+        if (v != NULL) {
+            lval_del(a);
+            return v;
+        }
+    }
+}
+
+// Returns at most n bytes of input, once some is available, or () at the
+// end of input.
+lval *builtin_read(lenv *e, lval *a) {
+    LASSERT_ARGC("read", a, 2);
+    LASSERT_PORT("read", a, in);
+    LASSERT_ARGT("read", a, 1, LVAL_LNG);
+    LASSERT(a, a->val.cell[1]->val.lng > 0,
+        "Procedure 'read' expected a positive count.");
+
+    lport *p = a->val.cell[0]->val.port;
+    long n = a->val.cell[1]->val.lng;
+    while (p->len == p->start && !p->eof) {
+        if (lport_fill(LINTERP, p)) {
+            lval *err = lval_err("Could not read: %s",
+                p->in.fd >= 0 ? strerror(errno) : "port closed");
+            lval_del(a);
+            return err;
+        }
+    }
+    lval *v;
+    if (p->len == p->start) {
+        v = lval_sexpr();
+    } else {
+        int avail = p->len - p->start;
+        v = lport_take(p, n < avail ? (int) n : avail, 0);
+    }
+    lval_del(a);
+    return v;
+}
+
+lval *builtin_write(lenv *e, lval *a) {
+    LASSERT_ARGC("write", a, 2);
+    LASSERT_PORT("write", a, out);
+    LASSERT_ARGT("write", a, 1, LVAL_STR);
+
+    lport *p = a->val.cell[0]->val.port;
+    char *str = a->val.cell[1]->val.str;
+    size_t len = a->val.cell[1]->count;
+    size_t off = 0;
+    while (off < len && p->out.fd >= 0) {
+        ssize_t n = write(p->out.fd, str + off, len - off);
+        if (n > 0) {
+            off += n;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            if (lio_wait(LINTERP, &p->out, EPOLLOUT)) { break; }
+        } else if (errno != EINTR) {
+            break;
+        }
+    }
+    if (off < len) {
+        lval *err = lval_err("Could not write: %s",
+            p->out.fd >= 0 ? strerror(errno) : "port closed");
+        lval_del(a);
+        return err;
+    }
+    lval_del(a);
+    return lval_sexpr();
+}
+
+lval *builtin_close(lenv *e, lval *a) {
+    LASSERT_ARGC("close", a, 1);
+    LASSERT_ARGT("close", a, 0, LVAL_PORT);
+    lport_close(LINTERP, a->val.cell[0]->val.port);
+    lval_del(a);
+    return lval_sexpr();
+}
+
+// Close the output of a port only, so that a process sees the end of its
+// input while its output can still be read.
+lval *builtin_close_output(lenv *e, lval *a) {
+    LASSERT_ARGC("close-output", a, 1);
+    LASSERT_ARGT("close-output", a, 0, LVAL_PORT);
+    lport *p = a->val.cell[0]->val.port;
+    lportfd_close(LINTERP, &p->out, &p->in);
+    lval_del(a);
+    return lval_sexpr();
+}
+
+lval *builtin_is_port(lenv *e, lval *a) {
+    LASSERT_ARGC("port?", a, 1);
+    lval *v = lval_bool(a->val.cell[0]->type == LVAL_PORT);
+    lval_del(a);
+    return v;
+}
+
+lval *builtin_list(lenv *e, lval *a) {
+    return a;
+}
+
+lval *builtin_eval(lenv *e, lval *a) {
+    LASSERT_ARGC("eval", a, 1);
+
+    lval *x = lval_take(a, 0);
+    return lval_eval(e, x);
+}
+
+lval *builtin_load(lenv *e, lval *a) {
+    LASSERT_ARGC("load", a, 1);
+    LASSERT_ARGT("load", a, 0, LVAL_STR);
+
+    linterp *it = linterp_current();
+    LASSERT(a, it != NULL, "Procedure 'load' needs a running interpreter.");
+    lval *v = load_file_env(it, e, a->val.cell[0]->val.str);
+    lval_del(a);
+    return v;
+}
+
+lval *builtin_join(lenv *e, lval *a) {
+    LASSERT(a, a->count != 0,
+        "Procedure 'join' takes at least 1 argument.");
+    for (int i=0; i < a->count; i++) {
+        LASSERT(a, a->val.cell[i]->type == LVAL_SEXPR,
+            "Procedure 'join' takes only lists as arguments.");
+    }
+
+    lval *x = lval_pop(a, 0);
+    while (a->count) {
+        lval *y = lval_pop(a, 0);
+        while (y->count)
+            x = lval_add(x, lval_pop(y, 0));
+        lval_del(y);
+    }
+    lval_del(a);
+    return x;
+}
+
+lval *builtin_cons(lenv *e, lval *a) {
+    LASSERT_ARGC("cons", a, 2);
+    LASSERT(a, a->val.cell[1]->type == LVAL_SEXPR,
+        "Second argument to 'cons' must be a list.");
+    lval *x = lval_pop(a, 0);
+    lval *q = lval_take(a, 0);
+    q = lval_insert(q, x, 0);
+    return q;
+}
+
+lval *builtin_len(lenv *e, lval *a) {
+    LASSERT_ARGC("len", a, 1);
+    LASSERT(a, a->val.cell[0]->type == LVAL_SEXPR,
+        "Procedure 'len' only applies to lists.");
+    lval *x = lval_lng(a->val.cell[0]->count);
+    lval_del(a);
+    return x;
+}
+
+lval *builtin_init(lenv *e, lval *a) {
+    LASSERT_ARGC("init", a, 1);
+    LASSERT(a, a->val.cell[0]->type == LVAL_SEXPR,
+        "Procedure 'init' only applies to lists.");
+
+    // Keep all but first cell
+    lval *x = lval_take(a, 0);
+    lval_del(lval_pop(x, x->count-1));
+    return x;
+}
+
+lval *builtin_last(lenv *e, lval *a) {
+    LASSERT_ARGC("last", a, 1);
+    LASSERT(a, a->val.cell[0]->type == LVAL_SEXPR,
+        "Procedure 'last' only applies to lists.");
+
+    lval *x = lval_take(a, 0);
+    return lval_take(x, x->count-1);
+}
+
+lval *builtin_equal(lenv *e, lval *a) {
+    LASSERT_ARGC("equal?", a, 2);
+
+    int eq = lval_equal(a->val.cell[0], a->val.cell[1]);
+    lval_del(a);
+    return lval_bool(eq);
+}
+
+lval *builtin_is(lenv *e, lval *a) {
+    LASSERT_ARGC("is?", a, 2);
+
+    lval *v = a->val.cell[1];
+    lval *w = lval_take(a, 0);
+    return lval_lng(lval_is(v, w));
+}
+
+lval *builtin_is_str(lenv *e, lval *a) {
+    LASSERT_ARGC("string?", a, 1);
+
+    lval *v = lval_bool(a->val.cell[0]->type == LVAL_STR);
+    lval_del(a);
+    return v;
+}
+
+lval *builtin_is_lng(lenv *e, lval *a) {
+    LASSERT_ARGC("integer?", a, 1);
+
+    lval *v = lval_bool(a->val.cell[0]->type == LVAL_LNG);
+    lval_del(a);
+    return v;
+}
+
+lval *builtin_is_dbl(lenv *e, lval *a) {
+    LASSERT_ARGC("float?", a, 1);
+
+    lval *v = lval_bool(a->val.cell[0]->type == LVAL_DBL);
+    lval_del(a);
+    return v;
+}
+
+lval *builtin_is_bool(lenv *e, lval *a) {
+    LASSERT_ARGC("boolean?", a, 1);
+
+    lval *v = lval_bool(a->val.cell[0]->type == LVAL_BOOL);
+    lval_del(a);
+    return v;
+}
+
+lval *builtin_is_qexpr(lenv *e, lval *a) {
+    LASSERT_ARGC("quoted-list?", a, 1);
+
+    lval *v = lval_bool(a->val.cell[0]->type == LVAL_QEXPR);
+    lval_del(a);
+    return v;
+}
+
+lval *builtin_is_sexpr(lenv *e, lval *a) {
+    LASSERT_ARGC("list?", a, 1);
+
+    lval *v = lval_bool(a->val.cell[0]->type == LVAL_SEXPR);
+    lval_del(a);
+    return v;
+}
+
+lval *builtin_is_err(lenv *e, lval *a) {
+    LASSERT_ARGC("error?", a, 1);
+
+    lval *v = lval_bool(a->val.cell[0]->type == LVAL_ERR);
+    lval_del(a);
+    return v;
+}
+
+lval *builtin_is_proc(lenv *e, lval *a) {
+    LASSERT_ARGC("procedure?", a, 1);
+
+    lval *v = lval_bool(a->val.cell[0]->type == LVAL_PROC);
+    lval_del(a);
+    return v;
+}
+
+lval *builtin_is_builtin(lenv *e, lval *a) {
+    LASSERT_ARGC("builtin?", a, 1);
+
+    lval *v = lval_bool(a->val.cell[0]->type == LVAL_BUILTIN);
+    lval_del(a);
+    return v;
+}
+
+lval *builtin_and(lenv *e, lval *a) {
+    int i;
+    for (i=0; i < a->count; i++) {
+        if (!lval_is_true(a->val.cell[i])) {
+            return lval_take(a, i);
+        }
+    }
+    if (a->count == 0) {
+        lval_del(a);
+        return lval_bool(LTRUE);
+    } else {
+        return lval_take(a, --i);
+    }
+}
+
+lval *builtin_or(lenv *e, lval *a) {
+    int i;
+    for (i=0; i < a->count; i++) {
+        if (lval_is_true(a->val.cell[i])) {
+            return lval_take(a, i);
+        }
+    }
+    if (a->count == 0) {
+        lval_del(a);
+        return lval_bool(LFALSE);
+    } else {
+        return lval_take(a, --i);
+    }
+}
+
+lval *builtin_not(lenv *e, lval *a) {
+    LASSERT_ARGC("not", a, 1);
+    lval *v = lval_take(a, 0);
+    lval *b = lval_bool(lval_is_true(v) ? LFALSE : LTRUE);
+    lval_del(v);
+    return b;
+}
+
+lval *builtin_def(lenv *e, lval *a) {
+    LASSERT(a, a->count > 1,
+            "Builtin 'def' expected at least 2 arguments.");
+    LASSERT_ARGT("def", a, 0, LVAL_SEXPR);
+
+    lval *ks = lval_pop(a, 0);
+
+    if (ks->count != a->count) {
+        lval_del(a);
+        lval_del(ks);
+        return lval_err("Builtin 'def': wrong number of symbols.");
+    }
+    for (int i=0; i < ks->count; i++) {
+        if (ks->val.cell[i]->type != LVAL_SYM) {
+            lval_del(a);
+            lval_del(ks);
+            return lval_err("Builtin 'def': only symbols can be defined.");
+        }
+    }
+    for (int i=0; i < ks->count; i++) {
+        lval_name_proc(a->val.cell[i], ks->val.cell[i]->val.str);
+        lenv_put(e, ks->val.cell[i]->val.str, a->val.cell[i]);
+    }
+    lval_del(ks);
+    return a;
+}
+
+lval *builtin_def_global(lenv *e, lval *a) {
+    LASSERT(a, !LPARALLEL,
+        "Procedure 'def*' cannot be used in a parallel procedure.");
+    lenv *global = *lenv_globals();
+    if (global == NULL) {
+        global = e;
+        while(global->encl != NULL) {
+            global = global->encl;
+        }
+    }
+    return builtin_def(global, a);
+}
+
+// Evaluate body in a fork of the calling env, so that none of its
+// definitions outlive it, those made with def* included.
+lval *builtin_with_fresh_env(lenv *e, lval *a) {
+    LASSERT_ARGC("with-fresh-env", a, 1);
+    LASSERT_ARGT("with-fresh-env", a, 0, LVAL_SEXPR);
+    lenv **globals = lenv_globals();
+    lenv *outer = *globals;
+    lenv *f = lenv_fork(e);
+    *globals = f;
+    lval *v = lval_do(f, lval_take(a, 0));
+    *globals = outer;
+    lenv_fork_del(LINTERP, f, v);
+    return v;
+}
+
+// Evaluate body like do, with limits given as names and numbers such as
+// {steps 100000 heap 1000000 depth 100}: the procedure calls it may make,
+// the bytes it may add to the live heap and the depth of Lisp calls it may
+// reach. Past a limit, calls fail with an error, which is the value of
+// with-limits, or it evaluates the optional on-limit body instead. The
+// limits in effect outside still apply. The heap is counted for the thread
+// of the interpreter only, see linterp_set_limits.
+lval *builtin_with_limits(lenv *e, lval *a) {
+    LASSERT(a, a->count == 2 || a->count == 3,
+        "Procedure 'with-limits' expected 2 or 3 arguments.");
+    for (int i=0; i < a->count; i++) {
+        LASSERT_ARGT("with-limits", a, i, LVAL_SEXPR);
+    }
+    linterp *it = LINTERP;
+    LASSERT(a, it != NULL,
+        "Procedure 'with-limits' can only be used on the thread of an interpreter.");
+    lval *spec = a->val.cell[0];
+    LASSERT(a, spec->count % 2 == 0,
+        "Procedure 'with-limits' expected limits as names and numbers.");
+    llimits l = {0, 0, 0};
+    for (int i=0; i < spec->count; i += 2) {
+        lval *k = spec->val.cell[i];
+        lval *n = spec->val.cell[i+1];
+        LASSERT(a, k->type == LVAL_SYM && n->type == LVAL_LNG && n->val.lng > 0,
+            "Procedure 'with-limits' expected limits as names and numbers.");
+        if (strcmp(k->val.str, "steps") == 0) {
+            l.steps = n->val.lng;
+        } else if (strcmp(k->val.str, "heap") == 0) {
+            l.heap_bytes = n->val.lng;
+        } else if (strcmp(k->val.str, "depth") == 0) {
+            l.depth = n->val.lng;
+        } else {
+            lval *err = lval_err("Unknown limit '%s'.", k->val.str);
+            lval_del(a);
+            return err;
+        }
+    }
+
+    // The body may yield, but the coroutine running it stays the same
+    lco *co = it->current;
+    long long step_limit = co->step_limit;
+    long heap_limit = co->heap_limit;
+    long depth_limit = co->depth_limit;
+    int limit_hit = co->limit_hit;
+    if (l.steps && (!step_limit || co->steps + l.steps < step_limit)) {
+        co->step_limit = co->steps + l.steps;
+    }
+    long live = lheap_thread();
+    if (l.heap_bytes && (!heap_limit || live + l.heap_bytes < heap_limit)) {
+        co->heap_limit = live + l.heap_bytes;
+    }
+    long depth = co->prof.depth;
+    if (l.depth && (!depth_limit || depth + l.depth < depth_limit)) {
+        co->depth_limit = depth + l.depth;
+    }
+    co->limit_hit = 0;
+    lval *on_limit = a->count == 3 ? lval_pop(a, 2) : NULL;
+    lval *v = lval_do(e, lval_take(a, 1));
+    int hit = co->limit_hit && v->type == LVAL_ERR;
+    co->step_limit = step_limit;
+    co->heap_limit = heap_limit;
+    co->depth_limit = depth_limit;
+    if (hit && on_limit != NULL) {
+        co->limit_hit = limit_hit;
+        lval_del(v);
+        return lval_do(e, on_limit);
+    }
+    // An error past a limit goes on to the enclosing with-limits
+    co->limit_hit = limit_hit || hit;
+    if (on_limit != NULL) { lval_del(on_limit); }
+    return v;
+}
+
+// Define a procedure like (fun {f x y} {(+ x y)})
+// which is equivalent to (def {f} (\ {x y} {(+ x y)}))
+// but cannot be implemented correctly in jblisp given
+// how lexical scoping is currenctly implemented
+lval *builtin_fun(lenv *e, lval *a) {
+    LASSERT_ARGC("fun", a, 2);
+    LASSERT_ARGT("fun", a, 0, LVAL_SEXPR);
+    LASSERT_ARGT("fun", a, 1, LVAL_SEXPR);
+
+    lval *syms = lval_pop(a, 0);
+    for (int i=0; i < syms->count; i++) {
+        if (syms->val.cell[i]->type != LVAL_SYM) {
+            lval_del(syms);
+            lval_del(a);
+            return lval_err("'fun' expected a list of symbols as first arg");
+        }
+    }
+    lval *adef = lval_sexpr();
+    lval *defsym = lval_sexpr();
+    lval_add(defsym, lval_pop(syms, 0));
+    lval_add(adef, defsym);
+
+    lval *alambda = lval_sexpr();
+    lval_add(alambda, syms);
+    lval_add(alambda, lval_take(a, 0));  // procedure body
+
+    lval* lambda = builtin_lambda(e, alambda);
+    if (lambda->type == LVAL_ERR) {
+        lval_del(adef);
+        return lambda;
+    }
+
+    lval_add(adef, lambda);
+    return builtin_def(e, adef);
+}
+
+lval *builtin_lambda(lenv *e, lval *a) {
     LASSERT_ARGC("lambda", a, 2);
     LASSERT_ARGT("lambda", a, 0, LVAL_SEXPR);
     LASSERT_ARGT("lambda", a, 1, LVAL_SEXPR);
@@ -1179,11 +3687,19 @@ lval *builtin_lambda(lenv *e, lval *a) {
     lval *q = lval_take(a, 0);
     lval *v = lval_proc();
     v->val.proc->closure = e;
+    lenv_capture(e);
 #ifdef JBLISPC_DEBUG_ENV
     printf("created lambda pointing to env at %p\n", (void*) e);
 #endif
     v->val.proc->params = syms;
     v->val.proc->body = q;
+    // Take the place of the procedure being called, if it is known
+    linterp *it = LINTERP;
+    lprof_stack *prof = it != NULL ? &it->current->prof : &LPROF_THREAD;
+    const lsite *site = prof->depth > 0 && prof->depth <= LPROF_DEPTH ?
+        prof->sites[prof->depth - 1]->anon : &LSITE_NONE;
+    if (site->file == NULL && it != NULL) { site = it->site; }
+    v->val.proc->site = site;
     return v;
 }
 
@@ -1212,40 +3728,455 @@ lval *builtin_assert(lenv *e, lval *a) {
         v = lval_pop(a, 0);
     }
     lval_del(a);
-    return v;
+    return v;
+}
+
+lval *builtin_concat(lenv *e, lval *a) {
+    for (int i=0; i < a->count; i++) {
+        LASSERT(a, a->val.cell[i]->type == LVAL_STR,
+                "Builtin 'concat' take string arguments only.");
+    }
+    int count = 0;
+    lval *res = lval_str("", 0);
+    for (int i=0; i < a->count; i++) {
+        lval *v = a->val.cell[i];
+        res->val.str = lheap_realloc(res->val.str, count + v->count + 1);
+        memcpy((void*) (res->val.str + count), v->val.str, v->count);
+        count += v->count;
+    }
+    res->count = count;
+    res->val.str[count] = '\0';
+    lval_del(a);
+    return res;
+}
+
+lval *builtin_if(lenv *e, lval *a) {
+    LASSERT_ARGC("if", a, 3);
+    LASSERT_ARGT("if", a, 1, LVAL_SEXPR);
+    LASSERT_ARGT("if", a, 2, LVAL_SEXPR);
+
+    lval *expr;
+    if (lval_is_true(a->val.cell[0])) {
+        expr = lval_take(a, 1);
+    } else {
+        expr = lval_take(a, 2);
+    }
+    return lval_do(e, expr);
+}
+
+// Allocation counts of the process: a list with, for every type of value
+// then for procedures and envs, {name allocs frees live bytes}.
+lval *builtin_mem_stats(lenv *e, lval *a) {
+    LASSERT_ARGC("mem-stats", a, 0);
+    lval_del(a);
+    lmemstats st;
+    lmemstats_read(&st);
+    lval *res = lval_sexpr();
+    for (int t=0; t <= LVAL_TYPES + 1; t++) {
+        char *name = t < LVAL_TYPES ? TYPE_NAMES[t] :
+                     t == LVAL_TYPES ? "lproc" : "lenv";
+        long allocs = t < LVAL_TYPES ? st.lval_allocs[t] :
+                      t == LVAL_TYPES ? st.lproc_allocs : st.lenv_allocs;
+        long frees = t < LVAL_TYPES ? st.lval_frees[t] :
+                     t == LVAL_TYPES ? st.lproc_frees : st.lenv_frees;
+        size_t size = t < LVAL_TYPES ? sizeof(lval) :
+                      t == LVAL_TYPES ? sizeof(lproc) : sizeof(lenv);
+        lval *row = lval_sexpr();
+        lval_add(row, lval_str(name, strlen(name)));
+        lval_add(row, lval_lng(allocs));
+        lval_add(row, lval_lng(frees));
+        lval_add(row, lval_lng(allocs - frees));
+        lval_add(row, lval_lng((allocs - frees) * (long) size));
+        lval_add(res, row);
+    }
+    return res;
+}
+
+// Heap bytes and memory of the process: a list of the live heap bytes,
+// their high-water mark, the resident set size and its high-water mark in
+// KB. Heap bytes are those of the values, envs and procedures of all
+// threads, within a few KB per thread, see lheap_add; RSS also covers the
+// parser, the coroutine stacks and libc.
+lval *builtin_heap_stats(lenv *e, lval *a) {
+    LASSERT_ARGC("heap-stats", a, 0);
+    lval_del(a);
+    lheapstats st;
+    lheap_read(&st);
+    lval *res = lval_sexpr();
+    lval_add(res, lval_lng(st.live_bytes));
+    lval_add(res, lval_lng(st.peak_bytes));
+    lval_add(res, lval_lng(st.rss_kb));
+    lval_add(res, lval_lng(st.peak_rss_kb));
+    return res;
+}
+
+// Heap dumps, see lheap_dump. Objects are numbered in the order they are
+// reached, breadth first from the roots, so that the parent of an object
+// is on a shortest path to it and comes before it in the dump.
+enum { LHEAP_LVAL, LHEAP_LPROC, LHEAP_LENV, LHEAP_LFUTURE, LHEAP_LPROMISE,
+       LHEAP_LCHAN, LHEAP_LMAILBOX, LHEAP_LPORT };
+char *LHEAP_KINDS[] = { NULL, "lproc", "lenv", "lfuture", "lpromise", "lchan",
+                        "lmailbox", "lport" };
+
+typedef struct {
+    const void *ptr;
+    int kind;
+    long parent;
+    // The field or binding the parent refers to it by; an element of a
+    // list is labelled by its index instead
+    const char *label;
+    int index;
+} lheap_obj;
+
+typedef struct {
+    lheap_obj *objs;
+    long count;
+    long size;
+    // Open addressing set of the objects reached
+    const void **seen;
+    long seen_size;
+} lheap_walk;
+
+int lheap_seen_add(lheap_walk *w, const void *ptr) {
+    if (w->count * 2 >= w->seen_size) {
+        long size = w->seen_size ? w->seen_size * 2 : 1024;
+        const void **seen = calloc(size, sizeof(void*));
+        for (long i=0; i < w->seen_size; i++) {
+            if (w->seen[i] == NULL) { continue; }
+            unsigned long h = (unsigned long) w->seen[i] >> 4;
+            while (seen[h % size] != NULL) { h++; }
+            seen[h % size] = w->seen[i];
+        }
+        free(w->seen);
+        w->seen = seen;
+        w->seen_size = size;
+    }
+    unsigned long h = (unsigned long) ptr >> 4;
+    for (;; h++) {
+        const void **slot = &w->seen[h % w->seen_size];
+        if (*slot == ptr) { return 0; }
+        if (*slot == NULL) {
+            *slot = ptr;
+            return 1;
+        }
+    }
+}
+
+void lheap_reach(lheap_walk *w, const void *ptr, int kind, long parent,
+                 const char *label, int index) {
+    if (ptr == NULL || !lheap_seen_add(w, ptr)) { return; }
+    if (w->count == w->size) {
+        w->size = w->size ? w->size * 2 : 1024;
+        w->objs = realloc(w->objs, w->size * sizeof(lheap_obj));
+    }
+    w->objs[w->count++] = (lheap_obj) {ptr, kind, parent, label, index};
+}
+
+#define lheap_size(p) ((p) != NULL ? (long) malloc_usable_size(p) : 0)
+
+long lheap_visit_lval(lheap_walk *w, const lval *v, long id) {
+    long bytes = lheap_size((void*) v);
+    switch (v->type) {
+        case LVAL_ERR:
+        case LVAL_SYM:
+        case LVAL_STR:
+            return bytes + lheap_size(v->val.str);
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for (int i=0; i < v->count; i++) {
+                lheap_reach(w, v->val.cell[i], LHEAP_LVAL, id, NULL, i);
+            }
+            return bytes + lheap_size(v->val.cell);
+        case LVAL_PROC:
+            lheap_reach(w, v->val.proc, LHEAP_LPROC, id, "proc", 0);
+            break;
+        case LVAL_FUTURE:
+            lheap_reach(w, v->val.future, LHEAP_LFUTURE, id, "future", 0);
+            break;
+        case LVAL_PROMISE:
+            lheap_reach(w, v->val.promise, LHEAP_LPROMISE, id, "promise", 0);
+            break;
+        case LVAL_CHAN:
+            lheap_reach(w, v->val.chan, LHEAP_LCHAN, id, "chan", 0);
+            break;
+        case LVAL_ACTOR:
+            lheap_reach(w, v->val.mailbox, LHEAP_LMAILBOX, id, "mailbox", 0);
+            break;
+        case LVAL_PORT:
+            lheap_reach(w, v->val.port, LHEAP_LPORT, id, "port", 0);
+            break;
+    }
+    return bytes;
+}
+
+// Reach the objects obj refers to, and return its own bytes
+long lheap_visit(lheap_walk *w, lheap_obj *obj, long id) {
+    switch (obj->kind) {
+        case LHEAP_LVAL:
+            return lheap_visit_lval(w, obj->ptr, id);
+        case LHEAP_LPROC: {
+            const lproc *p = obj->ptr;
+            lheap_reach(w, p->params, LHEAP_LVAL, id, "params", 0);
+            lheap_reach(w, p->body, LHEAP_LVAL, id, "body", 0);
+            lheap_reach(w, p->closure, LHEAP_LENV, id, "closure", 0);
+            return lheap_size((void*) p);
+        }
+        case LHEAP_LENV: {
+            const lenv *e = obj->ptr;
+            long bytes = lheap_size((void*) e) + lheap_size(e->syms) +
+                         lheap_size(e->vals);
+            for (int i=0; i < e->count; i++) {
+                bytes += lheap_size(e->syms[i]);
+                lheap_reach(w, e->vals[i], LHEAP_LVAL, id, e->syms[i], 0);
+            }
+            lheap_reach(w, e->encl, LHEAP_LENV, id, "parent", 0);
+            lheap_reach(w, e->base, LHEAP_LENV, id, "base", 0);
+            return bytes;
+        }
+        case LHEAP_LFUTURE: {
+            // The body and env of a running future belong to its task
+            lfuture *f = (lfuture*) obj->ptr;
+            pthread_mutex_lock(&f->lock);
+            if (f->done) {
+                lheap_reach(w, f->result, LHEAP_LVAL, id, "result", 0);
+            }
+            pthread_mutex_unlock(&f->lock);
+            return lheap_size(f);
+        }
+        case LHEAP_LPROMISE: {
+            const lpromise *p = obj->ptr;
+            lheap_reach(w, p->body, LHEAP_LVAL, id, "body", 0);
+            lheap_reach(w, p->env, LHEAP_LENV, id, "env", 0);
+            lheap_reach(w, p->value, LHEAP_LVAL, id, "value", 0);
+            return lheap_size((void*) p);
+        }
+        case LHEAP_LCHAN: {
+            const lchan *c = obj->ptr;
+            for (int i=0; i < c->count; i++) {
+                lheap_reach(w, c->buf[(c->head + i) % c->size], LHEAP_LVAL, id,
+                            NULL, i);
+            }
+            return lheap_size((void*) c) + lheap_size(c->buf);
+        }
+        case LHEAP_LMAILBOX: {
+            // Messages belong to the thread of the actor, which may take them
+            const lmailbox *m = obj->ptr;
+            return lheap_size((void*) m) + lheap_size(m->msgs);
+        }
+        case LHEAP_LPORT: {
+            const lport *p = obj->ptr;
+            return lheap_size((void*) p) + lheap_size(p->buf);
+        }
+    }
+    return 0;
+}
+
+// Write the objects reachable from e, its enclosing envs up to the global
+// env included, to filename: a line per object with its number, the number
+// of the object it was reached from or 0, its kind, its own bytes and the
+// field, binding or [index] it was reached by, separated by tabs. The
+// number of objects and their bytes are put in objects and bytes.
+// Returns -1 if the file cannot be written.
+int lheap_dump(lenv *e, const char *filename, long *objects, long *bytes) {
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) { return -1; }
+    fputs("# jblisp heap dump\n# id\tparent\tkind\tbytes\tlabel\n", f);
+    lheap_walk w = {NULL, 0, 0, NULL, 0};
+    lheap_reach(&w, e, LHEAP_LENV, 0, lenv_parent(e) ? "env" : "global", 0);
+    *bytes = 0;
+    for (long i=0; i < w.count; i++) {
+        lheap_obj *obj = &w.objs[i];
+        long n = lheap_visit(&w, obj, i + 1);
+        // w.objs may have moved
+        obj = &w.objs[i];
+        *bytes += n;
+        const char *kind = obj->kind == LHEAP_LVAL ?
+            TYPE_NAMES[((const lval*) obj->ptr)->type] : LHEAP_KINDS[obj->kind];
+        fprintf(f, "%li\t%li\t%s\t%li\t", i + 1, obj->parent, kind, n);
+        if (obj->label != NULL) {
+            fprintf(f, "%s\n", obj->label);
+        } else {
+            fprintf(f, "[%d]\n", obj->index);
+        }
+    }
+    *objects = w.count;
+    free(w.objs);
+    free(w.seen);
+    return fclose(f);
+}
+
+// Write the objects reachable from the calling env to a file, see
+// lheap_dump, and return the number of objects and their bytes.
+lval *builtin_heap_dump(lenv *e, lval *a) {
+    LASSERT_ARGC("heap-dump", a, 1);
+    LASSERT_ARGT("heap-dump", a, 0, LVAL_STR);
+    long objects, bytes;
+    if (lheap_dump(e, a->val.cell[0]->val.str, &objects, &bytes)) {
+        lval *err = lval_err("Could not write heap dump '%s'.",
+                             a->val.cell[0]->val.str);
+        lval_del(a);
+        return err;
+    }
+    lval_del(a);
+    lval *res = lval_sexpr();
+    lval_add(res, lval_lng(objects));
+    lval_add(res, lval_lng(bytes));
+    return res;
 }
 
-lval *builtin_concat(lenv *e, lval *a) {
-    for (int i=0; i < a->count; i++) {
-        LASSERT(a, a->val.cell[i]->type == LVAL_STR,
-                "Builtin 'concat' take string arguments only.");
-    }
-    int count = 0;
-    lval *res = lval_str("", 0);
-    for (int i=0; i < a->count; i++) {
-        lval *v = a->val.cell[i];
-        res->val.str = realloc(res->val.str, count + v->count + 1);
-        memcpy((void*) (res->val.str + count), v->val.str, v->count);
-        count += v->count;
+// The procedures being called on this thread, innermost first, as in the
+// backtrace of an error raised here
+lval *builtin_backtrace(lenv *e, lval *a) {
+    LASSERT_ARGC("backtrace", a, 0);
+    lval_del(a);
+    linterp *it = LINTERP;
+    lprof_stack *prof = it != NULL ? &it->current->prof : &LPROF_THREAD;
+    lval *res = lval_sexpr();
+    char frame[256];
+    for (int i=(prof->depth < LPROF_DEPTH ? prof->depth : LPROF_DEPTH) - 1;
+         i >= 0; i--) {
+        lsite_print(prof->sites[i], frame, sizeof(frame));
+        lval_add(res, lval_str(frame, strlen(frame)));
     }
-    res->count = count;
-    res->val.str[count] = '\0';
+    return res;
+}
+
+// The last procedures called on this thread, see lcalls, most recent first
+lval *builtin_recent_calls(lenv *e, lval *a) {
+    LASSERT_ARGC("recent-calls", a, 0);
     lval_del(a);
+    lval *res = lval_sexpr();
+    char frame[256];
+    unsigned long count = LCALLS.count;
+    for (unsigned long i=1; i <= count && i <= LCALLS_RECENT; i++) {
+        lsite_print(LCALLS.sites[(count - i) % LCALLS_RECENT], frame,
+                    sizeof(frame));
+        lval_add(res, lval_str(frame, strlen(frame)));
+    }
     return res;
 }
 
-lval *builtin_if(lenv *e, lval *a) {
-    LASSERT_ARGC("if", a, 3);
-    LASSERT_ARGT("if", a, 1, LVAL_SEXPR);
-    LASSERT_ARGT("if", a, 2, LVAL_SEXPR);
+// Write the calls in progress and the recent calls of this thread to fd.
+// It is used from signal handlers: snprintf does not allocate for these
+// formats, and sites are never freed.
+void lcalls_dump(int fd) {
+    linterp *it = LINTERP;
+    lprof_stack *prof = it != NULL ? &it->current->prof : &LPROF_THREAD;
+    char frame[256];
+    char line[300];
+    int n = snprintf(line, sizeof(line),
+                     "Calls in progress, innermost first:\n");
+    if (write(fd, line, n) < 0) { return; }
+    for (int i=(prof->depth < LPROF_DEPTH ? prof->depth : LPROF_DEPTH) - 1;
+         i >= 0; i--) {
+        lsite_print(prof->sites[i], frame, sizeof(frame));
+        n = snprintf(line, sizeof(line), "  at %s\n", frame);
+        if (write(fd, line, n) < 0) { return; }
+    }
+    n = snprintf(line, sizeof(line), "Recent calls, most recent first:\n");
+    if (write(fd, line, n) < 0) { return; }
+    unsigned long count = LCALLS.count;
+    for (unsigned long i=1; i <= count && i <= LCALLS_RECENT; i++) {
+        lsite_print(LCALLS.sites[(count - i) % LCALLS_RECENT], frame,
+                    sizeof(frame));
+        n = snprintf(line, sizeof(line), "  %s\n", frame);
+        if (write(fd, line, n) < 0) { return; }
+    }
+}
 
-    lval *expr;
-    if (lval_is_true(a->val.cell[0])) {
-        expr = lval_take(a, 1);
-    } else {
-        expr = lval_take(a, 2);
+static void lcalls_crash(int sig) {
+    char line[64];
+    int n = snprintf(line, sizeof(line), "Fatal signal %d.\n", sig);
+    if (write(2, line, n) >= 0) { lcalls_dump(2); }
+    // The handler was reset: the signal is raised again once it returns,
+    // and takes its default action
+    raise(sig);
+}
+
+// Dump the calls of the thread to stderr when the process crashes, see
+// lcalls_dump. The handler runs on a stack of its own, so that it works
+// after a stack overflow of this thread.
+void lcalls_on_crash() {
+    static char altstack[65536];
+    stack_t ss = {altstack, 0, sizeof(altstack)};
+    sigaltstack(&ss, NULL);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = lcalls_crash;
+    sa.sa_flags = SA_ONSTACK | SA_RESETHAND;
+    int sigs[] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT};
+    for (int i=0; i < 5; i++) {
+        sigaction(sigs[i], &sa, NULL);
     }
-    return lval_do(e, expr);
+}
+
+long long lclock_cpu_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Evaluate body like do, and print the wall and CPU time it took, the
+// procedure calls it made and the objects it allocated. CPU time and
+// allocations are those of the whole process, parallel procedures included.
+lval *builtin_time(lenv *e, lval *a) {
+    LASSERT_ARGC("time", a, 1);
+    LASSERT_ARGT("time", a, 0, LVAL_SEXPR);
+    linterp *it = LINTERP;
+    lmemstats st;
+    lmemstats_read(&st);
+    long allocs = lmemstats_allocs(&st);
+    long long steps = it != NULL ? it->steps : 0;
+    long long cpu = lclock_cpu_ns();
+    long long start = lclock_ns();
+    lval *v = lval_do(e, lval_take(a, 0));
+    long long wall = lclock_ns() - start;
+    cpu = lclock_cpu_ns() - cpu;
+    steps = it != NULL ? it->steps - steps : 0;
+    lmemstats_read(&st);
+    allocs = lmemstats_allocs(&st) - allocs;
+    printf("Time: %.3f ms wall, %.3f ms CPU, %lli steps, %li allocations\n",
+           wall / 1e6, cpu / 1e6, steps, allocs);
+    return v;
+}
+
+int lbench_cmp(const void *a, const void *b) {
+    long long x = *(const long long*) a;
+    long long y = *(const long long*) b;
+    return (x > y) - (x < y);
+}
+
+// Evaluate body n times, after n/10 runs to warm up, and return the
+// minimum, median and 99th percentile of the wall time, in ms.
+lval *builtin_bench(lenv *e, lval *a) {
+    LASSERT_ARGC("bench", a, 2);
+    LASSERT_ARGT("bench", a, 0, LVAL_SEXPR);
+    LASSERT_ARGT("bench", a, 1, LVAL_LNG);
+    long n = a->val.cell[1]->val.lng;
+    LASSERT(a, n > 0 && n <= 10000000,
+            "Procedure 'bench' expected 1 to 10000000 runs.");
+    lval *body = a->val.cell[0];
+    long long *ns = malloc(n * sizeof(long long));
+    long warmup = n / 10;
+    for (long i=-warmup; i < n; i++) {
+        long long start = lclock_ns();
+        lval *v = lval_do(e, lval_copy(body));
+        if (i >= 0) { ns[i] = lclock_ns() - start; }
+        if (v->type == LVAL_ERR) {
+            free(ns);
+            lval_del(a);
+            return v;
+        }
+        lval_del(v);
+    }
+    lval_del(a);
+    qsort(ns, n, sizeof(long long), lbench_cmp);
+    lval *res = lval_sexpr();
+    lval_add(res, lval_dbl(ns[0] / 1e6));
+    lval_add(res, lval_dbl(ns[n / 2] / 1e6));
+    lval_add(res, lval_dbl(ns[(n * 99 + 99) / 100 - 1] / 1e6));
+    free(ns);
+    return res;
 }
 
 lval *builtin_cond(lenv *e, lval *a) {
@@ -1270,80 +4201,176 @@ lval *builtin_cond(lenv *e, lval *a) {
     return lval_sexpr();
 }
 
-void add_builtin(lenv *e, char *sym, lbuiltin bltn) {
-    lval *v = lval_builtin(bltn);
-    lenv_put(e, sym, v);
-    lval_del(v);
-}
-
-void add_builtins(lenv *e) {
-    add_builtin(e, "load", builtin_load);
-    add_builtin(e, "def", builtin_def);
-    add_builtin(e, "def*", builtin_def_global);
-    add_builtin(e, "fun", builtin_fun);
-    add_builtin(e, "equal?", builtin_equal);
-    add_builtin(e, "is?", builtin_is);
-    add_builtin(e, "string?", builtin_is_str);
-    add_builtin(e, "integer?", builtin_is_lng);
-    add_builtin(e, "float?", builtin_is_dbl);
-    add_builtin(e, "boolean?", builtin_is_bool);
-    add_builtin(e, "quoted-list?", builtin_is_qexpr);
-    add_builtin(e, "list?", builtin_is_sexpr);
-    add_builtin(e, "error?", builtin_is_err);
-    add_builtin(e, "procedure?", builtin_is_proc);
-    add_builtin(e, "builtin?", builtin_is_builtin);
-    add_builtin(e, "\\", builtin_lambda);
-    add_builtin(e, "apply", builtin_apply);
-    add_builtin(e, "error", builtin_error);
-    add_builtin(e, "assert", builtin_assert);
-    add_builtin(e, "if", builtin_if);
-    add_builtin(e, "cond", builtin_cond);
+// Builtins by name. The table is used both to populate the global env
+// and to refer to builtins by index in environment images.
+struct { char *name; lbuiltin fn; } BUILTINS[] = {
+    {"load", builtin_load},
+    {"def", builtin_def},
+    {"def*", builtin_def_global},
+    {"with-fresh-env", builtin_with_fresh_env},
+    {"with-limits", builtin_with_limits},
+    {"fun", builtin_fun},
+    {"equal?", builtin_equal},
+    {"is?", builtin_is},
+    {"string?", builtin_is_str},
+    {"integer?", builtin_is_lng},
+    {"float?", builtin_is_dbl},
+    {"boolean?", builtin_is_bool},
+    {"quoted-list?", builtin_is_qexpr},
+    {"list?", builtin_is_sexpr},
+    {"error?", builtin_is_err},
+    {"procedure?", builtin_is_proc},
+    {"builtin?", builtin_is_builtin},
+    {"future?", builtin_is_future},
+    {"promise?", builtin_is_promise},
+    {"port?", builtin_is_port},
+    {"\\", builtin_lambda},
+    {"apply", builtin_apply},
+    {"error", builtin_error},
+    {"assert", builtin_assert},
+    {"if", builtin_if},
+    {"cond", builtin_cond},
 
     // List procedures
-    add_builtin(e, "list", builtin_list);
-    add_builtin(e, "eval", builtin_eval);
-    add_builtin(e, "join", builtin_join);
-    add_builtin(e, "cons", builtin_cons);
-    add_builtin(e, "len", builtin_len);
-    add_builtin(e, "head", builtin_head);
-    add_builtin(e, "tail", builtin_tail);
-    add_builtin(e, "set-head!", builtin_set_head);
-    add_builtin(e, "init", builtin_init);
-    add_builtin(e, "last", builtin_last);
-    add_builtin(e, "nth", builtin_nth);
+    {"list", builtin_list},
+    {"eval", builtin_eval},
+    {"join", builtin_join},
+    {"cons", builtin_cons},
+    {"len", builtin_len},
+    {"head", builtin_head},
+    {"tail", builtin_tail},
+    {"set-head!", builtin_set_head},
+    {"init", builtin_init},
+    {"last", builtin_last},
+    {"nth", builtin_nth},
+    {"pmap", builtin_pmap},
+    {"pfilter", builtin_pfilter},
+    {"preduce", builtin_preduce},
+    {"future", builtin_future},
+    {"touch", builtin_touch},
+    {"spawn", builtin_spawn},
+    {"yield", builtin_yield},
+    {"chan", builtin_chan},
+    {"send", builtin_send},
+    {"recv", builtin_recv},
+    {"delay", builtin_delay},
+    {"force", builtin_force},
+    {"lazy-cons", builtin_lazy_cons},
+    {"lazy-rest", builtin_lazy_rest},
+    {"lazy-seq", builtin_lazy_seq},
+    {"lazy-range", builtin_lazy_range},
+    {"lazy-iterate", builtin_lazy_iterate},
+    {"lazy-map", builtin_lazy_map},
+    {"lazy-filter", builtin_lazy_filter},
+    {"lazy-take", builtin_lazy_take},
+    {"take", builtin_take},
+    {"lazy-fold", builtin_lazy_fold},
+    {"lazy-each", builtin_lazy_each},
+    {"actor", builtin_actor},
+    {"self", builtin_self},
+    {"post", builtin_post},
+    {"receive", builtin_receive},
+    {"open-file", builtin_open_file},
+    {"process", builtin_process},
+    {"read-line", builtin_read_line},
+    {"read", builtin_read},
+    {"write", builtin_write},
+    {"close", builtin_close},
+    {"close-output", builtin_close_output},
+    {"freeze", builtin_freeze},
+    {"frozen?", builtin_is_frozen},
+    {"mem-stats", builtin_mem_stats},
+    {"heap-stats", builtin_heap_stats},
+    {"heap-dump", builtin_heap_dump},
+    {"backtrace", builtin_backtrace},
+    {"recent-calls", builtin_recent_calls},
+    {"time", builtin_time},
+    {"bench", builtin_bench},
 
     // Arithmetic
-    add_builtin(e, "+", builtin_add);
-    add_builtin(e, "-", builtin_sub);
-    add_builtin(e, "*", builtin_mul);
-    add_builtin(e, "/", builtin_div);
-    add_builtin(e, "%", builtin_mod);
-    add_builtin(e, "^", builtin_exp);
-    add_builtin(e, "<", builtin_lt);
-    add_builtin(e, "=", builtin_eq);
+    {"+", builtin_add},
+    {"-", builtin_sub},
+    {"*", builtin_mul},
+    {"/", builtin_div},
+    {"%", builtin_mod},
+    {"^", builtin_exp},
+    {"<", builtin_lt},
+    {"=", builtin_eq},
 
     // Logic functions
-    add_builtin(e, "and", builtin_and);
-    add_builtin(e, "or", builtin_or);
-    add_builtin(e, "not", builtin_not);
+    {"and", builtin_and},
+    {"or", builtin_or},
+    {"not", builtin_not},
 
     // String procedures
-    add_builtin(e, "concat", builtin_concat);
+    {"concat", builtin_concat},
+    {NULL, NULL}
+};
+
+void add_builtin(lenv *e, char *sym, lbuiltin bltn) {
+    lval *v = lval_builtin(bltn);
+    lenv_put(e, sym, v);
+    lval_del(v);
+}
+
+const char *lbuiltin_name(lbuiltin fn) {
+    for (int i=0; BUILTINS[i].name != NULL; i++) {
+        if (BUILTINS[i].fn == fn) { return BUILTINS[i].name; }
+    }
+    return "builtin";
+}
+
+void add_builtins(lenv *e) {
+    for (int i=0; BUILTINS[i].name != NULL; i++) {
+        add_builtin(e, BUILTINS[i].name, BUILTINS[i].fn);
+    }
+}
+
+// Lowest address the C stack may grow to before evaluation fails, that of
+// the running coroutine or else of the thread, with LSTACK_MARGIN to spare.
+// Builtins nest evaluations on the C stack without Lisp calls, so the
+// depth of these does not bound it.
+char *lstack_limit(linterp *it) {
+    if (it != NULL && it->current->stack != NULL) {
+        return it->current->stack + LSTACK_MARGIN;
+    }
+    if (LSTACK_THREAD == NULL) {
+        pthread_attr_t attr;
+        void *addr = NULL;
+        size_t size = 0;
+        if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+            pthread_attr_getstack(&attr, &addr, &size);
+            pthread_attr_destroy(&attr);
+        }
+        LSTACK_THREAD = (char*) addr +
+            (size > 2 * LSTACK_MARGIN ? LSTACK_MARGIN : size / 2);
+    }
+    return LSTACK_THREAD;
 }
 
 lval *lval_eval(lenv *e, lval *v) {
     lval *x;
+    v = lval_thaw(v);
     switch (v->type) {
         case LVAL_SYM:
             x = lenv_get(e, v->val.str);
             lval_del(v);
             break;
-        case LVAL_SEXPR:
+        case LVAL_SEXPR: {
+            char here;
+            if (&here < lstack_limit(LINTERP)) {
+                linterp *it = LINTERP;
+                if (it != NULL) { it->current->limit_hit = 1; }
+                lval_del(v);
+                x = lval_err("Stack limit exceeded.");
+                break;
+            }
             x = lval_eval_sexpr(e, v);
             break;
+        }
         case LVAL_QEXPR:
             x = v;
-            x->type = LVAL_SEXPR;
+            lval_retype(x, LVAL_SEXPR);
             break;
         default:
             x = v;
@@ -1356,6 +4383,7 @@ lval *lval_eval(lenv *e, lval *v) {
 // Returns result of the last expression.
 lval *lval_do(lenv *e, lval *body) {
     lval* result = NULL;
+    body = lval_thaw(body);
     if (body->count == 0) { result = lval_sexpr(); }
     while (body->count) {
         if (result != NULL) { lval_del(result); }
@@ -1393,8 +4421,36 @@ lval *lval_eval_sexpr(lenv *e, lval *v) {
 }
 
 lval *lval_call(lenv *e, lval *proc, lval *args) {
+    linterp *it = LINTERP;
+    if (it != NULL) {
+        it->steps++;
+        if (it->ready.head != NULL && ++it->reductions >= LCO_REDUCTIONS) {
+            lco_yield(it);
+        }
+        if (it->deadline && linterp_expired(it)) {
+            lval_del(proc);
+            lval_del(args);
+            return lval_err("Evaluation timed out.");
+        }
+        lco *co = it->current;
+        co->steps++;
+        if (co->step_limit && co->steps > co->step_limit) {
+            co->limit_hit = 1;
+            lval_del(proc);
+            lval_del(args);
+            return lval_err("Step limit exceeded.");
+        }
+        if (co->heap_limit && lheap_thread() > co->heap_limit) {
+            co->limit_hit = 1;
+            lval_del(proc);
+            lval_del(args);
+            return lval_err("Heap limit exceeded.");
+        }
+    }
     if (proc->type == LVAL_BUILTIN) {
+        long long start = ltrace_begin();
         lval *result = proc->val.builtin(e, args);
+        if (start) { ltrace_call(NULL, proc->val.builtin, start); }
         lval_del(proc);
         return result;
     }
@@ -1409,6 +4465,16 @@ lval *lval_call(lenv *e, lval *proc, lval *args) {
         lval_del(repr);
         return err;
     }
+    // Threads without an interpreter have the default cap; the C stack
+    // itself is guarded by lval_eval
+    lprof_stack *prof = it != NULL ? &it->current->prof : &LPROF_THREAD;
+    long depth_limit = it != NULL ? it->current->depth_limit : LLIMIT_DEPTH;
+    if (depth_limit && prof->depth >= depth_limit) {
+        if (it != NULL) { it->current->limit_hit = 1; }
+        lval_del(proc);
+        lval_del(args);
+        return lval_err("Call depth limit exceeded.");
+    }
     // Set up closure
     lproc *p = proc->val.proc;
     lenv *closure = lenv_new(p->closure);
@@ -1428,7 +4494,7 @@ lval *lval_call(lenv *e, lval *proc, lval *args) {
             }
             par = lval_pop(p->params, 0);
             arg = args;
-            arg->type = LVAL_SEXPR;
+            lval_retype(arg, LVAL_SEXPR);
             args = lval_sexpr();
         } else {
             arg = lval_pop(args, 0);
@@ -1444,36 +4510,46 @@ lval *lval_call(lenv *e, lval *proc, lval *args) {
         return lval_err("Wrong number of arguments to lambda.");
     }
     // Evaluate body
+    if (prof->depth < LPROF_DEPTH) { prof->sites[prof->depth] = p->site; }
+    prof->depth++;
+    LCALLS.sites[LCALLS.count++ % LCALLS_RECENT] = p->site;
+    long long start = ltrace_begin();
     lval *res = lval_do(closure, p->body);
+    if (start) {
+        ltrace_call(p->site->name != NULL ? p->site->name : "lambda", NULL,
+                    start);
+    }
+    prof->depth--;
     p->body = NULL;
     lval_del(proc);
     lval_del(args);
+#ifndef JBLISPC_DEBUG_MEM
+    // Tracked envs are all freed with the interpreter in debug mode
+    if (!atomic_load_explicit(&closure->captured, memory_order_relaxed)) {
+        lenv_del(closure);
+    }
+#endif
     return res;
 }
 
-mpc_parser_t *Comment;
-mpc_parser_t *Boolean;
-mpc_parser_t *Number;
-mpc_parser_t *Symbol;
-mpc_parser_t *Chars;
-mpc_parser_t *String;
-mpc_parser_t *Sexpr;
-mpc_parser_t *Qexpr;
-mpc_parser_t *Expr;
-mpc_parser_t *JBLisp;
-
-void build_parser() {
-    Comment   = mpc_new("comment");
-    Boolean   = mpc_new("boolean");
-    Number    = mpc_new("number");
-    Symbol    = mpc_new("symbol");
-    String    = mpc_new("string");
-    Sexpr     = mpc_new("sexpr");
-    Qexpr     = mpc_new("qexpr");
-    Expr      = mpc_new("expr");
-    JBLisp    = mpc_new("jblisp");
-
-    mpca_lang(MPCA_LANG_DEFAULT,
+// The parser is built on first use, so that a prompt can be reached
+// without paying for grammar compilation.
+void build_parser(linterp *it) {
+    if (it->JBLisp != NULL) { return; }
+    long long start = ltrace_begin();
+    it->Comment   = mpc_new("comment");
+    it->Boolean   = mpc_new("boolean");
+    it->Number    = mpc_new("number");
+    it->Symbol    = mpc_new("symbol");
+    it->String    = mpc_new("string");
+    it->Sexpr     = mpc_new("sexpr");
+    it->Qexpr     = mpc_new("qexpr");
+    it->Expr      = mpc_new("expr");
+    it->JBLisp    = mpc_new("jblisp");
+
+    // The token regexes match the same longest prefix either way, so they
+    // can run as DFAs
+    mpca_lang(MPCA_LANG_PACKRAT | MPCA_LANG_ARENA | MPCA_LANG_DFA,
         "                                                                     \
             comment  : /;[^\\r\\n]*/ ;                                        \
             boolean  : /(#t)|(#f)/ ;                                          \
@@ -1486,75 +4562,833 @@ void build_parser() {
                        <sexpr> | <qexpr> | <comment> ;                        \
             jblisp   : /^/ <expr>* /$/ ;                                      \
         ",
-        Comment, Boolean, Number, Symbol, String, Sexpr, Qexpr, Expr, JBLisp
+        it->Comment, it->Boolean, it->Number, it->Symbol, it->String,
+        it->Sexpr, it->Qexpr, it->Expr, it->JBLisp
     );
+    ltrace_end("parse", "build parser", start);
 }
 
-void cleanup_parser() {
+void cleanup_parser(linterp *it) {
+    if (it->JBLisp == NULL) { return; }
     mpc_cleanup(9,
-        Comment, Boolean, Number, Symbol, String, Sexpr, Qexpr, Expr, JBLisp
+        it->Comment, it->Boolean, it->Number, it->Symbol, it->String,
+        it->Sexpr, it->Qexpr, it->Expr, it->JBLisp
     );
+    it->JBLisp = NULL;
+}
+
+#ifdef JBLISPC_DEBUG_MEM
+void linterp_print_mem(linterp *it) {
+    printf("LVALs created: %li\n", it->count_lvalnew);
+    printf("LVALs copied: %li\n", it->count_lvalcpy);
+    printf("LVALs deleted: %li\n", it->count_lvaldel);
+    printf("LVALs left: %li\n\n",
+           it->count_lvalnew + it->count_lvalcpy - it->count_lvaldel);
+    printf("LPROCs created: %li\n", it->count_lprocnew);
+    printf("LPROCs copied: %li\n", it->count_lproccpy);
+    printf("LPROCs deleted: %li\n", it->count_lprocdel);
+    printf("LPROCs left: %li\n\n",
+           it->count_lprocnew + it->count_lproccpy - it->count_lprocdel);
+    printf("LENVs created: %li\n", it->count_lenvnew);
+    printf("LENVs copied: %li\n", it->count_lenvcpy);
+    printf("LENVs deleted: %li\n", it->count_lenvdel);
+    printf("LENVs left: %li\n\n",
+           it->count_lenvnew + it->count_lenvcpy - it->count_lenvdel);
+}
+#endif
+
+// Writing to a process that is gone is an error, not a signal
+static pthread_once_t LIO_ONCE = PTHREAD_ONCE_INIT;
+
+static void lio_init() {
+    signal(SIGPIPE, SIG_IGN);
+}
+
+linterp *linterp_new() {
+    pthread_once(&LIO_ONCE, lio_init);
+    linterp *it = calloc(1, sizeof(linterp));
+    linterp *prev = LINTERP;
+    LINTERP = it;
+    it->current = &it->main;
+    it->epfd = -1;
+    it->mail.fd = -1;
+    it->env = lenv_new(NULL);
+    it->limits.depth = LLIMIT_DEPTH;
+    it->main.depth_limit = LLIMIT_DEPTH;
+    it->site = &LSITE_NONE;
+    add_builtins(it->env);
+    LINTERP = prev;
+    return it;
+}
+
+void linterp_del(linterp *it) {
+    long long start = ltrace_begin();
+    linterp *prev = LINTERP;
+    LINTERP = it;
+#ifdef JBLISPC_DEBUG_MEM
+    // Envs are not refcounted, closures keep theirs alive until here
+    for (long i=0; i < it->count_lenvnew + it->count_lenvcpy; i++) {
+        lenv_del(it->lenvs[i]);
+    }
+    free(it->lenvs);
+    linterp_print_mem(it);
+#else
+    lenv_del(it->env);
+#endif
+    if (it->snapshot != NULL) { lsnapshot_release(it->snapshot); }
+    cleanup_parser(it);
+    lco_cleanup(it);
+    if (it->mailbox != NULL) { lmailbox_release(it->mailbox); }
+    if (it->epfd >= 0) { close(it->epfd); }
+    LINTERP = prev;
+    free(it);
+    ltrace_end("cleanup", "interpreter", start);
+}
+
+long long lclock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Sampling profiler. On every SIGPROF, the procedure stack of the running
+// coroutine or thread is counted in a fixed table of distinct stacks, which
+// the handler fills without allocating. A sample that finds the table in
+// use by another thread, or full, is dropped.
+#define LPROF_STACKS 4096
+
+typedef struct {
+    unsigned long hash;
+    long count;
+    int depth; // of the stack, may be more than the sites kept
+    const lsite *sites[LPROF_DEPTH];
+} lprof_entry;
+
+static lprof_entry *LPROF_TABLE;
+static atomic_flag LPROF_BUSY = ATOMIC_FLAG_INIT;
+static atomic_long LPROF_SAMPLES;
+static atomic_long LPROF_DROPPED;
+
+void lprof_sample(int sig) {
+    if (atomic_flag_test_and_set(&LPROF_BUSY)) {
+        atomic_fetch_add(&LPROF_DROPPED, 1);
+        return;
+    }
+    linterp *it = LINTERP;
+    lprof_stack *st = it != NULL ? &it->current->prof : &LPROF_THREAD;
+    int depth = st->depth;
+    int kept = depth < LPROF_DEPTH ? depth : LPROF_DEPTH;
+    unsigned long h = 14695981039346656037UL ^ depth;
+    for (int i=0; i < kept; i++) {
+        h = (h ^ (unsigned long) st->sites[i]) * 1099511628211UL;
+    }
+    for (int i=0; i < LPROF_STACKS; i++) {
+        lprof_entry *e = &LPROF_TABLE[(h + i) % LPROF_STACKS];
+        if (e->count == 0) {
+            e->hash = h;
+            e->depth = depth;
+            memcpy(e->sites, st->sites, kept * sizeof(lsite*));
+        } else if (e->hash != h || e->depth != depth ||
+                   memcmp(e->sites, st->sites, kept * sizeof(lsite*))) {
+            continue;
+        }
+        e->count++;
+        atomic_fetch_add(&LPROF_SAMPLES, 1);
+        atomic_flag_clear(&LPROF_BUSY);
+        return;
+    }
+    atomic_fetch_add(&LPROF_DROPPED, 1);
+    atomic_flag_clear(&LPROF_BUSY);
+}
+
+// Start sampling hz times per second of CPU time used by the process
+int lprof_start(int hz) {
+    if (hz <= 0 || hz > 1000000) { return -1; }
+    if (LPROF_TABLE == NULL) {
+        LPROF_TABLE = calloc(LPROF_STACKS, sizeof(lprof_entry));
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = lprof_sample;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGPROF, &sa, NULL);
+    struct itimerval tv = {{0, 1000000 / hz}, {0, 1000000 / hz}};
+    return setitimer(ITIMER_PROF, &tv, NULL);
+}
+
+// Stop sampling and write the samples to filename as folded stacks, one
+// line per distinct stack: names from the outermost call, separated by
+// semicolons, then the count. Returns -1 if the file cannot be written.
+int lprof_stop(const char *filename) {
+    struct itimerval tv = {{0, 0}, {0, 0}};
+    setitimer(ITIMER_PROF, &tv, NULL);
+    if (LPROF_TABLE == NULL) { return -1; }
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) { return -1; }
+    for (int i=0; i < LPROF_STACKS; i++) {
+        lprof_entry *e = &LPROF_TABLE[i];
+        if (e->count == 0) { continue; }
+        fputs("(toplevel)", f);
+        for (int j=0; j < e->depth && j < LPROF_DEPTH; j++) {
+            const char *name = e->sites[j]->name;
+            fprintf(f, ";%s", name != NULL ? name : "lambda");
+        }
+        if (e->depth > LPROF_DEPTH) { fputs(";...", f); }
+        fprintf(f, " %li\n", e->count);
+    }
+    printf("Profile: %li samples, %li dropped, written to '%s'.\n",
+           atomic_load(&LPROF_SAMPLES), atomic_load(&LPROF_DROPPED), filename);
+    return fclose(f);
+}
+
+// Event trace in the Chrome trace format, see ltrace_start. Events are
+// complete events, written when they end, so that calls shorter than the
+// threshold cost two clock reads and nothing more.
+static int LTRACE_ON;
+static long long LTRACE_START;
+static long long LTRACE_MIN_NS;
+static FILE *LTRACE_FILE;
+static int LTRACE_FIRST;
+static pthread_mutex_t LTRACE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int LTRACE_TIDS;
+static _Thread_local int LTRACE_TID;
+
+// Trace to filename until ltrace_stop: file loads, parsing, interpreter
+// cleanup and the calls that took at least min_us microseconds.
+int ltrace_start(const char *filename, long min_us) {
+    LTRACE_FILE = fopen(filename, "w");
+    if (LTRACE_FILE == NULL) { return -1; }
+    fputs("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [", LTRACE_FILE);
+    LTRACE_FIRST = 1;
+    LTRACE_MIN_NS = min_us * 1000LL;
+    LTRACE_START = lclock_ns();
+    LTRACE_ON = 1;
+    return 0;
+}
+
+int ltrace_stop() {
+    if (!LTRACE_ON) { return -1; }
+    pthread_mutex_lock(&LTRACE_LOCK);
+    LTRACE_ON = 0;
+    fputs("\n]}\n", LTRACE_FILE);
+    int rc = fclose(LTRACE_FILE);
+    pthread_mutex_unlock(&LTRACE_LOCK);
+    return rc;
+}
+
+// Start of an event, 0 when not tracing
+long long ltrace_begin() {
+    return LTRACE_ON ? lclock_ns() : 0;
+}
+
+// Record an event of category cat from start to now
+void ltrace_end(const char *cat, const char *name, long long start) {
+    if (start == 0) { return; }
+    ltrace_event(cat, name, start, lclock_ns());
+}
+
+// Record a call from start to now if it took at least the threshold. A
+// builtin, named NULL, is only looked up by fn then.
+void ltrace_call(const char *name, lbuiltin fn, long long start) {
+    long long end = lclock_ns();
+    if (end - start < LTRACE_MIN_NS) { return; }
+    ltrace_event("call", name != NULL ? name : lbuiltin_name(fn), start, end);
+}
+
+void ltrace_event(const char *cat, const char *name, long long start,
+                  long long end) {
+    if (LTRACE_TID == 0) { LTRACE_TID = atomic_fetch_add(&LTRACE_TIDS, 1) + 1; }
+    pthread_mutex_lock(&LTRACE_LOCK);
+    if (LTRACE_ON) {
+        fprintf(LTRACE_FILE, "%s\n{\"name\": \"", LTRACE_FIRST ? "" : ",");
+        for (const char *c = name; *c; c++) {
+            if (*c == '"' || *c == '\\') { fputc('\\', LTRACE_FILE); }
+            if ((unsigned char) *c >= ' ') { fputc(*c, LTRACE_FILE); }
+        }
+        fprintf(LTRACE_FILE, "\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, "
+                "\"dur\": %.3f, \"pid\": %d, \"tid\": %d}",
+                cat, (start - LTRACE_START) / 1e3, (end - start) / 1e3,
+                (int) getpid(), LTRACE_TID);
+        LTRACE_FIRST = 0;
+    }
+    pthread_mutex_unlock(&LTRACE_LOCK);
+}
+
+void lheap_read(lheapstats *out) {
+    // Count the bytes of the calling thread exactly
+    if (LSTATS != NULL) { lheap_flush(LSTATS); }
+    out->live_bytes = atomic_load_explicit(&LHEAP_LIVE, memory_order_relaxed);
+    out->peak_bytes = atomic_load_explicit(&LHEAP_PEAK, memory_order_relaxed);
+    out->rss_kb = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    long pages;
+    if (f != NULL) {
+        if (fscanf(f, "%*s %li", &pages) == 1) {
+            out->rss_kb = pages * (sysconf(_SC_PAGESIZE) / 1024);
+        }
+        fclose(f);
+    }
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    // The kernel only updates the high-water mark now and then
+    out->peak_rss_kb = ru.ru_maxrss > out->rss_kb ? ru.ru_maxrss : out->rss_kb;
+}
+
+// Memory sampler, see lheap_sample_start. The thread waits on LHEAP_COND
+// between samples so that lheap_sample_stop does not wait for the interval.
+static FILE *LHEAP_FILE;
+static long LHEAP_INTERVAL_MS;
+static long long LHEAP_START;
+static int LHEAP_SAMPLING;
+static pthread_t LHEAP_THREAD;
+static pthread_mutex_t LHEAP_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t LHEAP_COND = PTHREAD_COND_INITIALIZER;
+
+static void lheap_sample() {
+    lheapstats st;
+    lheap_read(&st);
+    fprintf(LHEAP_FILE, "%.3f %li %li %li %li\n",
+            (lclock_ns() - LHEAP_START) / 1e6, st.live_bytes, st.peak_bytes,
+            st.rss_kb, st.peak_rss_kb);
+    fflush(LHEAP_FILE);
+}
+
+static void *lheap_sampler(void *arg) {
+    pthread_mutex_lock(&LHEAP_LOCK);
+    long long next = LHEAP_START;
+    while (LHEAP_SAMPLING) {
+        lheap_sample();
+        next += LHEAP_INTERVAL_MS * 1000000LL;
+        // Skip the samples missed while the process was not scheduled
+        long long now = lclock_ns();
+        if (next < now) { next = now; }
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        long long at = ts.tv_sec * 1000000000LL + ts.tv_nsec + (next - now);
+        ts.tv_sec = at / 1000000000LL;
+        ts.tv_nsec = at % 1000000000LL;
+        while (LHEAP_SAMPLING &&
+               pthread_cond_timedwait(&LHEAP_COND, &LHEAP_LOCK, &ts) == 0) {}
+    }
+    pthread_mutex_unlock(&LHEAP_LOCK);
+    return NULL;
+}
+
+// Write a sample of memory every interval_ms milliseconds to filename until
+// lheap_sample_stop: a line of the time since the start in ms, the live
+// heap bytes and their high-water mark, the RSS and its high-water mark in
+// KB, after a header line starting with #.
+int lheap_sample_start(const char *filename, long interval_ms) {
+    if (LHEAP_SAMPLING || interval_ms <= 0) { return -1; }
+    LHEAP_FILE = fopen(filename, "w");
+    if (LHEAP_FILE == NULL) { return -1; }
+    fputs("# ms live_bytes peak_bytes rss_kb peak_rss_kb\n", LHEAP_FILE);
+    LHEAP_INTERVAL_MS = interval_ms;
+    LHEAP_START = lclock_ns();
+    LHEAP_SAMPLING = 1;
+    if (pthread_create(&LHEAP_THREAD, NULL, lheap_sampler, NULL)) {
+        LHEAP_SAMPLING = 0;
+        fclose(LHEAP_FILE);
+        return -1;
+    }
+    return 0;
+}
+
+// Stop the sampler, after a last sample
+int lheap_sample_stop() {
+    pthread_mutex_lock(&LHEAP_LOCK);
+    if (!LHEAP_SAMPLING) {
+        pthread_mutex_unlock(&LHEAP_LOCK);
+        return -1;
+    }
+    LHEAP_SAMPLING = 0;
+    pthread_cond_signal(&LHEAP_COND);
+    pthread_mutex_unlock(&LHEAP_LOCK);
+    pthread_join(LHEAP_THREAD, NULL);
+    lheap_sample();
+    return fclose(LHEAP_FILE);
+}
+
+// Make evaluation by it fail once ms milliseconds have passed; 0 clears the
+// timeout. Only calls made on the thread of the interpreter are checked.
+void linterp_set_timeout(linterp *it, long ms) {
+    it->deadline = ms > 0 ? lclock_ns() + ms * 1000000LL : 0;
+    it->ticks = 0;
+}
+
+// Start the limits of it over, for a new evaluation by the coroutine
+// running; coroutines it spawns take what is left of them
+void linterp_start_limits(linterp *it) {
+    llimits *l = &it->limits;
+    lco *co = it->current;
+    co->step_limit = l->steps ? co->steps + l->steps : 0;
+    co->heap_limit = l->heap_bytes ? lheap_thread() + l->heap_bytes : 0;
+    co->depth_limit = l->depth ? co->prof.depth + l->depth : 0;
+}
+
+// Limit every evaluation by it, each file loaded and line evaluated, from
+// its start. The heap counted is what the thread of it allocates less what
+// it frees, so that interpreters on other threads do not count; the work of
+// futures and parallel procedures, done by the thread pool, does not count
+// either.
+void linterp_set_limits(linterp *it, llimits *limits) {
+    it->limits = *limits;
+    linterp_start_limits(it);
+}
+
+// Make the expression at line of file the one evaluated by it, where the
+// procedures it makes are from
+void linterp_locate(linterp *it, const char *file, int line) {
+    it->site = lsite_intern(NULL, lintern_name(file), line);
+}
+
+int linterp_expired(linterp *it) {
+    if (it->deadline < 0) { return 1; }
+    if (++it->ticks % LDEADLINE_TICKS) { return 0; }
+    if (lclock_ns() < it->deadline) { return 0; }
+    it->deadline = -1;
+    return 1;
+}
+
+lenv *linterp_env(linterp *it) {
+    return it->env;
+}
+
+linterp *linterp_current() {
+    return LINTERP;
 }
 
-int INDENT = 0;
 
-void load_print_indent() {
-    for (int i=0; i < INDENT; i++) {
+void load_print_indent(linterp *it) {
+    for (int i=0; i < it->indent; i++) {
         putchar(' ');
         putchar(' ');
     }
 }
 
-lval *load_file(lenv *e, char *filename) {
-    load_print_indent();
+// Evaluate a file in env e; load_file uses the global env of the
+// interpreter, the load builtin the env it is called from.
+lval *load_file_env(linterp *it, lenv *e, char *filename) {
+    load_print_indent(it);
     printf("Loading file '%s'...\n", filename);
-    INDENT++;
+    it->indent++;
     mpc_result_t res;
     lval *x = NULL;
-    if (mpc_parse_contents(filename, JBLisp, &res)) {
+    linterp *prev = LINTERP;
+    LINTERP = it;
+    if (prev != it) { linterp_start_limits(it); }
+    // A file loaded by another is evaluated in the middle of its expression
+    const lsite *site = it->site;
+    long long start = ltrace_begin();
+    build_parser(it);
+    long long parse = ltrace_begin();
+    if (mpc_parse_contents(filename, it->JBLisp, &res)) {
         lval *prog = lval_read(res.output);
+        int *lines = lval_read_lines(res.output);
         mpc_ast_delete(res.output);
-        while (prog->count) {
+        ltrace_end("parse", filename, parse);
+        for (int i=0; prog->count; i++) {
             if (x != NULL) { lval_del(x); }
+            linterp_locate(it, filename, lines[i]);
             x = lval_eval(e, lval_pop(prog, 0));
+            lco_run(it, 0);
             if (x->type == LVAL_ERR) {
                 lval_del(prog);
+                free(lines);
+                it->site = site;
+                LINTERP = prev;
+                ltrace_end("load", filename, start);
                 return x;
             }
         }
         lval_del(prog);
+        free(lines);
     } else {
         mpc_err_print(res.error);
         mpc_err_delete(res.error);
+        LINTERP = prev;
+        ltrace_end("load", filename, start);
         return lval_err("parser error");
     }
-    INDENT--;
-    load_print_indent();
+    it->site = site;
+    LINTERP = prev;
+    ltrace_end("load", filename, start);
+    it->indent--;
+    load_print_indent(it);
     puts("done");
-    return x;
+    // A file without expressions evaluates to ()
+    return x != NULL ? x : lval_sexpr();
+}
+
+lval *load_file(linterp *it, char *filename) {
+    return load_file_env(it, it->env, filename);
 }
 
-void exec_file(lenv *e, char *filename) {
-    lval *x = load_file(e, filename);
+// Run a script: its coroutines waiting for I/O are run to the end too.
+// Returns -1 if it failed with an error.
+int exec_file(linterp *it, char *filename) {
+    lval *x = load_file(it, filename);
+    int rc = 0;
     if (x->type == LVAL_ERR) {
         lval_println(x);
+        rc = -1;
+    } else {
+        lval_del(x);
     }
-    lval_del(x);
+    linterp *prev = LINTERP;
+    LINTERP = it;
+    lco_run(it, 1);
+    LINTERP = prev;
+    return rc;
 }
 
-void exec_line(lenv *e, char *input) {
+// Parse input into a list of its expressions, or a parser error. Unless
+// lines is NULL, it is set to the line of each expression, see
+// lval_read_lines.
+lval *read_line(linterp *it, char *input, int **lines) {
     mpc_result_t res;
+    build_parser(it);
+    long long parse = ltrace_begin();
+    if (!mpc_parse("<stdin>", input, it->JBLisp, &res)) {
+        char *err = mpc_err_string(res.error);
+        mpc_err_delete(res.error);
+        lval *x = lval_err("%s", err);
+        free(err);
+        return x;
+    }
+    lval *line = lval_read(res.output);
+    if (lines != NULL) { *lines = lval_read_lines(res.output); }
+    mpc_ast_delete(res.output);
+    ltrace_end("parse", "<stdin>", parse);
+    return line;
+}
+
+// Evaluate input in the global env and return the value of its last
+// expression, or the first error.
+lval *eval_line(linterp *it, char *input) {
+    return eval_line_env(it, it->env, input);
+}
+
+// Same, in env e, such as a fork of the global env
 
-    if (mpc_parse("<stdin>", input, JBLisp, &res)) {
+lval *eval_line_env(linterp *it, lenv *e, char *input) {
+    lval *x = NULL;
+    linterp *prev = LINTERP;
+    LINTERP = it;
+    if (prev != it) { linterp_start_limits(it); }
+    int *lines;
+    lval *line = read_line(it, input, &lines);
+    if (line->type == LVAL_ERR) {
+        LINTERP = prev;
+        return line;
+    }
+    const lsite *site = it->site;
+    // A fork stands for the global env, def* included
+    lenv *globals = it->current->globals;
+    if (e != it->env) { it->current->globals = e; }
+    for (int i=0; line->count; i++) {
+        if (x != NULL) { lval_del(x); }
+        linterp_locate(it, "<stdin>", lines[i]);
+        x = lval_eval(e, lval_pop(line, 0));
+        lco_run(it, 0);
+        if (x->type == LVAL_ERR) { break; }
+    }
+    it->current->globals = globals;
+    it->site = site;
+    lval_del(line);
+    free(lines);
+    if (x == NULL) { x = lval_sexpr(); }
+    LINTERP = prev;
+    return x;
+}
+
+void exec_line(linterp *it, char *input) {
+    mpc_result_t res;
+    linterp *prev = LINTERP;
+    LINTERP = it;
+    if (prev != it) { linterp_start_limits(it); }
+    build_parser(it);
+    long long parse = ltrace_begin();
+    if (mpc_parse("<stdin>", input, it->JBLisp, &res)) {
         lval *line = lval_read(res.output);
+        int *lines = lval_read_lines(res.output);
         mpc_ast_delete(res.output);
-        while (line->count) {
-            lval *x = lval_eval(e, lval_pop(line, 0));
+        ltrace_end("parse", "<stdin>", parse);
+        for (int i=0; line->count; i++) {
+            linterp_locate(it, "<stdin>", lines[i]);
+            lval *x = lval_eval(it->env, lval_pop(line, 0));
+            lco_run(it, 0);
             lval_println(x);
         }
         lval_del(line);
+        free(lines);
     } else {
         mpc_err_print(res.error);
         mpc_err_delete(res.error);
     }
+    LINTERP = prev;
+}
+
+// Environment images
+//
+// An image is a compact serialization of the bindings of an env, used to
+// embed a pre-evaluated prelude in the binary so that it can be restored
+// at startup without going through the parser or the evaluator.
+//
+// Layout: the magic "JBLI", a format version byte, the number of bindings,
+// then each binding as a symbol followed by a value. Lengths and counts are
+// unsigned LEB128 varints, integers are zigzag varints, floats are raw
+// doubles. Procedures are stored as params, body, and the file and line of
+// their site; their closure must be the imaged env itself and is rebound
+// to the target env when loading.
+// Builtins are stored as their index in the BUILTINS table.
+
+#define LIMAGE_VERSION 2
+
+typedef struct {
+    unsigned char *buf;
+    size_t len;
+    size_t size;
+} limage_out;
+
+typedef struct {
+    const unsigned char *buf;
+    size_t len;
+    size_t pos;
+} limage_in;
+
+void limage_put(limage_out *o, const void *p, size_t n) {
+    if (o->len + n > o->size) {
+        while (o->len + n > o->size) {
+            o->size = o->size ? o->size * 2 : 256;
+        }
+        o->buf = realloc(o->buf, o->size);
+    }
+    memcpy(o->buf + o->len, p, n);
+    o->len += n;
+}
+
+void limage_put_uint(limage_out *o, unsigned long x) {
+    unsigned char c;
+    do {
+        c = x & 0x7f;
+        x >>= 7;
+        if (x) { c |= 0x80; }
+        limage_put(o, &c, 1);
+    } while (x);
+}
+
+void limage_put_str(limage_out *o, char *s, size_t n) {
+    limage_put_uint(o, n);
+    limage_put(o, s, n);
+}
+
+int builtin_index(lbuiltin fn) {
+    for (int i=0; BUILTINS[i].name != NULL; i++) {
+        if (BUILTINS[i].fn == fn) { return i; }
+    }
+    return -1;
+}
+
+int limage_put_lval(limage_out *o, lenv *e, lval *v) {
+    unsigned char type = v->type;
+    const char *file;
+    limage_put(o, &type, 1);
+    switch (v->type) {
+        case LVAL_BOOL:
+            type = v->val.bool;
+            limage_put(o, &type, 1);
+            break;
+        case LVAL_LNG:
+            limage_put_uint(o,
+                ((unsigned long) v->val.lng << 1) ^ (v->val.lng < 0 ? ~0UL : 0));
+            break;
+        case LVAL_DBL:
+            limage_put(o, &v->val.dbl, sizeof(double));
+            break;
+        case LVAL_ERR:
+            limage_put_str(o, v->val.str, strlen(v->val.str));
+            break;
+        case LVAL_SYM:
+        case LVAL_STR:
+            limage_put_str(o, v->val.str, v->count);
+            break;
+        case LVAL_BUILTIN:
+            if (builtin_index(v->val.builtin) < 0) { return -1; }
+            limage_put_uint(o, builtin_index(v->val.builtin));
+            break;
+        case LVAL_PROC:
+            if (v->val.proc->closure != e) { return -1; }
+            if (limage_put_lval(o, e, v->val.proc->params)) { return -1; }
+            if (limage_put_lval(o, e, v->val.proc->body)) { return -1; }
+            file = v->val.proc->site->file != NULL ?
+                v->val.proc->site->file : "";
+            limage_put_str(o, (char*) file, strlen(file));
+            limage_put_uint(o, v->val.proc->site->line);
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            limage_put_uint(o, v->count);
+            for (int i=0; i < v->count; i++) {
+                if (limage_put_lval(o, e, v->val.cell[i])) { return -1; }
+            }
+            break;
+        case LVAL_FUTURE:
+        case LVAL_CHAN:
+        case LVAL_ACTOR:
+        case LVAL_PROMISE:
+        case LVAL_PORT:
+            return -1;
+    }
+    return 0;
+}
+
+// Serialize the bindings of e, leaving out builtins bound under their own
+// name since add_builtins already provides them.
+// Returns a malloc'd buffer, or NULL if a value cannot be imaged.
+unsigned char *lenv_dump(lenv *e, size_t *len) {
+    limage_out o = {NULL, 0, 0};
+    unsigned char version = LIMAGE_VERSION;
+    int count = 0;
+    for (int i=0; i < e->count; i++) {
+        lval *v = e->vals[i];
+        if (v->type == LVAL_BUILTIN && builtin_index(v->val.builtin) >= 0 &&
+            strcmp(BUILTINS[builtin_index(v->val.builtin)].name, e->syms[i]) == 0)
+            continue;
+        count++;
+    }
+    limage_put(&o, "JBLI", 4);
+    limage_put(&o, &version, 1);
+    limage_put_uint(&o, count);
+    for (int i=0; i < e->count; i++) {
+        lval *v = e->vals[i];
+        if (v->type == LVAL_BUILTIN && builtin_index(v->val.builtin) >= 0 &&
+            strcmp(BUILTINS[builtin_index(v->val.builtin)].name, e->syms[i]) == 0)
+            continue;
+        limage_put_str(&o, e->syms[i], strlen(e->syms[i]));
+        if (limage_put_lval(&o, e, v)) {
+            free(o.buf);
+            return NULL;
+        }
+    }
+    *len = o.len;
+    return o.buf;
+}
+
+int limage_get_uint(limage_in *in, unsigned long *x) {
+    int shift = 0;
+    *x = 0;
+    while (in->pos < in->len) {
+        unsigned char c = in->buf[in->pos++];
+        *x |= (unsigned long) (c & 0x7f) << shift;
+        if (!(c & 0x80)) { return 0; }
+        shift += 7;
+    }
+    return -1;
+}
+
+char *limage_get_str(limage_in *in, size_t *n) {
+    unsigned long l;
+    if (limage_get_uint(in, &l) || l > in->len - in->pos) { return NULL; }
+    char *s = malloc(l + 1);
+    memcpy(s, in->buf + in->pos, l);
+    s[l] = '\0';
+    in->pos += l;
+    *n = l;
+    return s;
+}
+
+lval *limage_get_lval(limage_in *in, lenv *e) {
+    if (in->pos >= in->len) { return NULL; }
+    int type = in->buf[in->pos++];
+    unsigned long x;
+    size_t n;
+    char *s;
+    lval *v = NULL;
+    switch (type) {
+        case LVAL_BOOL:
+            if (in->pos >= in->len) { return NULL; }
+            return lval_bool(in->buf[in->pos++]);
+        case LVAL_LNG:
+            if (limage_get_uint(in, &x)) { return NULL; }
+            return lval_lng((long) ((x >> 1) ^ -(x & 1)));
+        case LVAL_DBL: {
+            double d;
+            if (in->len - in->pos < sizeof(double)) { return NULL; }
+            memcpy(&d, in->buf + in->pos, sizeof(double));
+            in->pos += sizeof(double);
+            return lval_dbl(d);
+        }
+        case LVAL_ERR:
+        case LVAL_SYM:
+        case LVAL_STR:
+            if ((s = limage_get_str(in, &n)) == NULL) { return NULL; }
+            if (type == LVAL_ERR) { v = lval_err("%s", s); }
+            else if (type == LVAL_SYM) { v = lval_sym(s); }
+            else { v = lval_str(s, n); }
+            free(s);
+            return v;
+        case LVAL_BUILTIN:
+            if (limage_get_uint(in, &x) ||
+                x >= sizeof(BUILTINS) / sizeof(BUILTINS[0]) - 1)
+                return NULL;
+            return lval_builtin(BUILTINS[x].fn);
+        case LVAL_PROC: {
+            lval *params = limage_get_lval(in, e);
+            if (params == NULL) { return NULL; }
+            lval *body = limage_get_lval(in, e);
+            if (body == NULL) { lval_del(params); return NULL; }
+            if ((s = limage_get_str(in, &n)) == NULL ||
+                limage_get_uint(in, &x)) {
+                free(s);
+                lval_del(params);
+                lval_del(body);
+                return NULL;
+            }
+            v = lval_proc();
+            v->val.proc->site = lsite_intern(
+                NULL, n > 0 ? lintern_name(s) : NULL, x);
+            free(s);
+            v->val.proc->closure = e;
+            lenv_capture(e);
+            v->val.proc->params = params;
+            v->val.proc->body = body;
+            return v;
+        }
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            if (limage_get_uint(in, &x)) { return NULL; }
+            v = type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+            for (unsigned long i=0; i < x; i++) {
+                lval *c = limage_get_lval(in, e);
+                if (c == NULL) { lval_del(v); return NULL; }
+                lval_add(v, c);
+            }
+            return v;
+    }
+    return NULL;
+}
+
+// Restore the bindings of an image into e.
+// Returns 0 on success, -1 if the image is malformed.
+int lenv_load(lenv *e, const unsigned char *buf, size_t len) {
+    limage_in in = {buf, len, 0};
+    unsigned long count;
+    if (len < 5 || memcmp(buf, "JBLI", 4) != 0 || buf[4] != LIMAGE_VERSION) {
+        return -1;
+    }
+    in.pos = 5;
+    if (limage_get_uint(&in, &count)) { return -1; }
+    for (unsigned long i=0; i < count; i++) {
+        size_t n;
+        char *sym = limage_get_str(&in, &n);
+        if (sym == NULL) { return -1; }
+        lval *v = limage_get_lval(&in, e);
+        if (v == NULL) { free(sym); return -1; }
+        lval_name_proc(v, sym);
+        lenv_put(e, sym, v);
+        lval_del(v);
+        free(sym);
+    }
+    return 0;
 }
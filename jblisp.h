@@ -4,30 +4,120 @@
 #include "mpc.h"
 
 #define VERSION "0.6.0"
+// Samples per second of CPU time taken by --profile
+#define LPROF_HZ 997
+// Calls shorter than this, in microseconds, are left out of --trace
+#define LTRACE_MIN_US 100
+// Milliseconds between the samples of --mem-sample
+#define LHEAP_SAMPLE_MS 10
+// Default cap on the depth of Lisp calls, which the C stack of a thread
+// or coroutine can hold
+#define LLIMIT_DEPTH 5000
 
 // #define JBLISPC_DEBUG_ENV
 // #define JBLISPC_DEBUG_MEM
 
-#ifdef JBLISPC_DEBUG_MEM
-extern long COUNT_LVALCPY;
-extern long COUNT_LVALNEW;
-extern long COUNT_LVALDEL;
-extern long COUNT_LPROCCPY;
-extern long COUNT_LPROCNEW;
-extern long COUNT_LPROCDEL;
-extern long COUNT_LENVCPY;
-extern long COUNT_LENVNEW;
-extern long COUNT_LENVDEL;
-#endif
+// JBLisp builtin types
+enum { LVAL_BOOL, LVAL_LNG, LVAL_DBL, LVAL_ERR, LVAL_SYM, LVAL_STR,
+       LVAL_BUILTIN, LVAL_PROC, LVAL_SEXPR, LVAL_QEXPR, LVAL_FUTURE,
+       LVAL_CHAN, LVAL_ACTOR, LVAL_PROMISE, LVAL_PORT };
+#define LVAL_TYPES (LVAL_PORT + 1)
+extern char *TYPE_NAMES[];
 
 typedef struct _lval lval;
 typedef struct _lenv lenv;
 typedef struct _lproc lproc;
+typedef struct _lfuture lfuture;
+typedef struct _lsnapshot lsnapshot;
+typedef struct _lchan lchan;
+typedef struct _lmailbox lmailbox;
+typedef struct _lpromise lpromise;
+typedef struct _lport lport;
+typedef struct _linterp linterp;
+typedef struct _lstats lstats;
 typedef lval *(*lbuiltin)(lenv*, lval*);
 
-extern lenv *LENVS[];
+// Limits on an evaluation, see linterp_set_limits; 0 for none
+typedef struct {
+    // Procedure calls
+    long long steps;
+    // Bytes added to the heap by the thread of the interpreter
+    long heap_bytes;
+    // Depth of Lisp calls
+    long depth;
+} llimits;
+
+linterp *linterp_new(void);
+void linterp_del(linterp*);
+lenv *linterp_env(linterp*);
+linterp *linterp_current(void);
+void linterp_set_prelude(const unsigned char*, size_t);
+int linterp_load_prelude(linterp*);
+void linterp_set_timeout(linterp*, long);
+void linterp_set_limits(linterp*, llimits*);
+void linterp_locate(linterp*, const char*, int);
+int linterp_expired(linterp*);
+long long lclock_ns(void);
+long long lclock_cpu_ns(void);
+int lprof_start(int);
+int lprof_stop(const char*);
+void lprof_sample(int);
+const char *lintern_name(const char*);
+void lcalls_dump(int);
+void lcalls_on_crash(void);
+int ltrace_start(const char*, long);
+int ltrace_stop(void);
+long long ltrace_begin(void);
+void ltrace_end(const char*, const char*, long long);
+void ltrace_call(const char*, lbuiltin, long long);
+void ltrace_event(const char*, const char*, long long, long long);
+int lio_poll(linterp*, int);
+void lport_close(linterp*, lport*);
+
+// Allocation counts of all threads, see lmemstats_read
+typedef struct {
+    long lval_allocs[LVAL_TYPES];
+    long lval_frees[LVAL_TYPES];
+    long lproc_allocs;
+    long lproc_frees;
+    long lenv_allocs;
+    long lenv_frees;
+} lmemstats;
+
+lstats *lstats_thread(void);
+void lstats_init(void);
+void lstats_release(void*);
+void lmemstats_read(lmemstats*);
+long lmemstats_allocs(lmemstats*);
+void lmemstats_print_count(FILE*, char*, long, long, size_t);
+void lmemstats_print_json(FILE*);
+
+// Heap bytes of the interpreter and memory of the process, see lheap_read
+typedef struct {
+    long live_bytes;
+    long peak_bytes;
+    long rss_kb;
+    long peak_rss_kb;
+} lheapstats;
+
+void *lheap_malloc(size_t);
+void *lheap_calloc(size_t, size_t);
+void *lheap_realloc(void*, size_t);
+void lheap_free(void*);
+void lheap_read(lheapstats*);
+long lheap_thread(void);
+int lheap_sample_start(const char*, long);
+int lheap_sample_stop(void);
+int lheap_dump(lenv*, const char*, long*, long*);
 
 lenv *lenv_new(lenv*);
+lenv *lenv_snapshot(lenv*, lsnapshot**);
+void lsnapshot_release(lsnapshot*);
+lsnapshot *linterp_snapshot(linterp*);
+lenv *lenv_parent(lenv*);
+lenv *lenv_fork(lenv*);
+void lenv_fork_del(linterp*, lenv*, lval*);
+lenv **lenv_globals(void);
 lval *lenv_get(lenv*, char*);
 lval *lenv_pop(lenv*, char*);
 void lenv_del(lenv*);
@@ -36,11 +126,13 @@ void lenv_put(lenv*, char*, lval*);
 lproc *lproc_new(void);
 lproc *lproc_copy(lproc*);
 void lproc_del(lproc*);
+void lval_name_proc(lval*, const char*);
 
 lval *lval_bool(int);
 lval *lval_dbl(double);
 lval *lval_lng(long);
 lval *lval_err(char*, ...);
+const char *lval_err_backtrace(lval*);
 lval *lval_sexpr(void);
 lval *lval_qexpr(void);
 lval *lval_sym(char*);
@@ -48,12 +140,21 @@ lval *lval_str(char*, int);
 lval *lval_builtin(lbuiltin);
 lval *lval_proc(void);
 
+int lval_type(lval*);
+int lval_is_lazy(lval*);
+int lval_has_proc(lval*);
+char *lval_str_value(lval*);
+
 lval *lval_add(lval*, lval*);
 lval *lval_pop(lval*, int);
 lval *lval_insert(lval*, lval*, int);
 lval *lval_take(lval*, int);
 lval *lval_copy(lval*);
+int lval_freeze(lval*);
+lval *lval_thaw(lval*);
+int lval_is_frozen(lval*);
 void lval_del(lval*);
+void lval_retype(lval*, int);
 
 int lval_equal(lval*, lval*);
 int lval_is(lval*, lval*);
@@ -82,6 +183,8 @@ lval *builtin_not(lenv*, lval*);
 
 lval *builtin_def(lenv*, lval*);
 lval *builtin_def_global(lenv*, lval*);
+lval *builtin_with_fresh_env(lenv*, lval*);
+lval *builtin_with_limits(lenv*, lval*);
 lval *builtin_lambda(lenv*, lval*);
 lval *builtin_apply(lenv*, lval*);
 lval *builtin_error(lenv*, lval*);
@@ -99,10 +202,63 @@ lval *builtin_tail(lenv*, lval*);
 lval *builtin_init(lenv*, lval*);
 lval *builtin_last(lenv*, lval*);
 lval *builtin_nth(lenv*, lval*);
+lval *builtin_pmap(lenv*, lval*);
+lval *builtin_pfilter(lenv*, lval*);
+lval *builtin_preduce(lenv*, lval*);
+
+lval *builtin_future(lenv*, lval*);
+lval *builtin_touch(lenv*, lval*);
+
+lval *builtin_spawn(lenv*, lval*);
+lval *builtin_yield(lenv*, lval*);
+lval *builtin_chan(lenv*, lval*);
+lval *builtin_send(lenv*, lval*);
+lval *builtin_recv(lenv*, lval*);
+
+lval *builtin_delay(lenv*, lval*);
+lval *builtin_force(lenv*, lval*);
+lval *builtin_is_promise(lenv*, lval*);
+lval *builtin_lazy_cons(lenv*, lval*);
+lval *builtin_lazy_rest(lenv*, lval*);
+lval *builtin_lazy_seq(lenv*, lval*);
+lval *builtin_lazy_range(lenv*, lval*);
+lval *builtin_lazy_iterate(lenv*, lval*);
+lval *builtin_lazy_map(lenv*, lval*);
+lval *builtin_lazy_filter(lenv*, lval*);
+lval *builtin_lazy_take(lenv*, lval*);
+lval *builtin_take(lenv*, lval*);
+lval *builtin_lazy_fold(lenv*, lval*);
+lval *builtin_lazy_each(lenv*, lval*);
+
+lval *builtin_open_file(lenv*, lval*);
+lval *builtin_process(lenv*, lval*);
+lval *builtin_read_line(lenv*, lval*);
+lval *builtin_read(lenv*, lval*);
+lval *builtin_write(lenv*, lval*);
+lval *builtin_close(lenv*, lval*);
+lval *builtin_close_output(lenv*, lval*);
+lval *builtin_is_port(lenv*, lval*);
+
+lval *builtin_freeze(lenv*, lval*);
+lval *builtin_is_frozen(lenv*, lval*);
+lval *builtin_mem_stats(lenv*, lval*);
+lval *builtin_heap_stats(lenv*, lval*);
+lval *builtin_heap_dump(lenv*, lval*);
+lval *builtin_backtrace(lenv*, lval*);
+lval *builtin_recent_calls(lenv*, lval*);
+lval *builtin_time(lenv*, lval*);
+lval *builtin_bench(lenv*, lval*);
+int lbench_cmp(const void*, const void*);
+lval *builtin_actor(lenv*, lval*);
+lval *builtin_self(lenv*, lval*);
+lval *builtin_post(lenv*, lval*);
+lval *builtin_receive(lenv*, lval*);
 
 lval *builtin_concat(lenv*, lval*);
 
+int lval_read_skip(mpc_ast_t*);
 lval *lval_read(mpc_ast_t*);
+int *lval_read_lines(mpc_ast_t*);
 lval *lval_read_num(mpc_ast_t*);
 
 lval *lval_eval(lenv*, lval*);
@@ -110,11 +266,19 @@ lval *lval_do(lenv*, lval*);
 lval *lval_eval_sexpr(lenv*, lval*);
 lval *lval_call(lenv*, lval*, lval*);
 
-lval *load_file(lenv*, char*);
-void exec_line(lenv*, char*);
-void exec_file(lenv*, char*);
-void build_parser(void);
-void cleanup_parser(void);
+lval *load_file(linterp*, char*);
+lval *load_file_env(linterp*, lenv*, char*);
+lval *read_line(linterp*, char*, int**);
+lval *eval_line(linterp*, char*);
+lval *eval_line_env(linterp*, lenv*, char*);
+void exec_line(linterp*, char*);
+int exec_file(linterp*, char*);
+void build_parser(linterp*);
+void cleanup_parser(linterp*);
+const char *lbuiltin_name(lbuiltin);
 void add_builtins(lenv*);
 
+unsigned char *lenv_dump(lenv*, size_t*);
+int lenv_load(lenv*, const unsigned char*, size_t);
+
 #endif
@@ -20,6 +20,111 @@ static mpc_state_t mpc_state_new(void) {
   return s;
 }
 
+/*
+** Arena Type
+*/
+
+/*
+** ASTs built by parsers marked for it (the
+** rules of a language built with MPCA_LANG_ARENA)
+** are allocated from a per-parse arena: nodes,
+** tags, contents and child arrays are carved out
+** of large chunks by bumping a pointer.
+**
+** Every node records its arena. The arena is
+** owned by the root of the resulting AST, so
+** deleting the root releases the whole tree at
+** once while deleting any other arena node does
+** nothing. Arena nodes can still be modified by
+** the `mpc_ast_*` functions, which allocate any
+** new memory from the same arena.
+*/
+
+enum {
+  MPC_ARENA_CHUNK_MIN = 4096,
+  MPC_ARENA_CHUNK_MAX = 1048576
+};
+
+typedef struct mpc_arena_chunk_t {
+  struct mpc_arena_chunk_t *next;
+  size_t size;
+  size_t used;
+} mpc_arena_chunk_t;
+
+struct mpc_arena_t {
+  mpc_arena_chunk_t *chunks;
+  size_t chunk_size;
+  mpc_ast_t *root;
+};
+
+static size_t mpc_arena_align(size_t n) {
+  return (n + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+}
+
+static mpc_arena_chunk_t *mpc_arena_chunk_new(size_t size) {
+  mpc_arena_chunk_t *c = malloc(mpc_arena_align(sizeof(mpc_arena_chunk_t)) + size);
+  c->next = NULL;
+  c->size = size;
+  c->used = 0;
+  return c;
+}
+
+static void *mpc_arena_chunk_alloc(mpc_arena_chunk_t *c, size_t n) {
+  char *p = (char*)c + mpc_arena_align(sizeof(mpc_arena_chunk_t)) + c->used;
+  c->used += n;
+  return p;
+}
+
+static void *mpc_arena_alloc(mpc_arena_t *a, size_t n) {
+  
+  mpc_arena_chunk_t *c;
+  
+  n = mpc_arena_align(n);
+  
+  if (a->chunks->size - a->chunks->used >= n) {
+    return mpc_arena_chunk_alloc(a->chunks, n);
+  }
+  
+  /* Oversized requests get a chunk of their own behind the current one */
+  if (n > a->chunk_size / 4) {
+    c = mpc_arena_chunk_new(n);
+    c->next = a->chunks->next;
+    a->chunks->next = c;
+    return mpc_arena_chunk_alloc(c, n);
+  }
+  
+  if (a->chunk_size < MPC_ARENA_CHUNK_MAX) { a->chunk_size *= 2; }
+  c = mpc_arena_chunk_new(a->chunk_size);
+  c->next = a->chunks;
+  a->chunks = c;
+  return mpc_arena_chunk_alloc(c, n);
+}
+
+static char *mpc_arena_strdup(mpc_arena_t *a, const char *s) {
+  char *r = mpc_arena_alloc(a, strlen(s) + 1);
+  strcpy(r, s);
+  return r;
+}
+
+static mpc_arena_t *mpc_arena_new(void) {
+  mpc_arena_chunk_t *c = mpc_arena_chunk_new(MPC_ARENA_CHUNK_MIN);
+  mpc_arena_t *a = mpc_arena_chunk_alloc(c, mpc_arena_align(sizeof(mpc_arena_t)));
+  a->chunks = c;
+  a->chunk_size = MPC_ARENA_CHUNK_MIN;
+  a->root = NULL;
+  return a;
+}
+
+static void mpc_arena_delete(mpc_arena_t *a) {
+  mpc_arena_chunk_t *c = a->chunks;
+  mpc_arena_chunk_t *n;
+  while (c) {
+    n = c->next;
+    free(c);
+    c = n;
+  }
+}
+
 /*
 ** Input Type
 */
@@ -69,10 +174,29 @@ enum {
   MPC_INPUT_MEM_NUM = 512
 };
 
+enum {
+  MPC_INPUT_MEMO_NUM = 4096
+};
+
+enum {
+  MPC_INPUT_EXPECTED_MIN = 16
+};
+
 typedef struct {
   char mem[64];
 } mpc_mem_t;
 
+typedef struct {
+  mpc_parser_t *parser;
+  long pos;
+  char suppress;
+  char stored;
+  char success;
+  char last;
+  mpc_state_t state;
+  mpc_ast_t *output;
+} mpc_memo_t;
+
 typedef struct {
 
   int type;
@@ -96,6 +220,17 @@ typedef struct {
   char mem_full[MPC_INPUT_MEM_NUM];
   mpc_mem_t mem[MPC_INPUT_MEM_NUM];
   
+  mpc_memo_t *memo;
+  mpc_arena_t *arena;
+  
+  mpc_state_t err_state;
+  char err_recieved;
+  const char *err_failure;
+  int err_expected_num;
+  int err_expected_slots;
+  const char **err_expected;
+  const char *err_expected_stk[MPC_INPUT_EXPECTED_MIN];
+  
 } mpc_input_t;
 
 static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
@@ -124,6 +259,16 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
   
+  i->memo = NULL;
+  i->arena = NULL;
+  
+  i->err_state = mpc_state_invalid();
+  i->err_recieved = '\0';
+  i->err_failure = NULL;
+  i->err_expected_num = 0;
+  i->err_expected_slots = MPC_INPUT_EXPECTED_MIN;
+  i->err_expected = i->err_expected_stk;
+  
   return i;
 }
 
@@ -154,6 +299,16 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
   
+  i->memo = NULL;
+  i->arena = NULL;
+  
+  i->err_state = mpc_state_invalid();
+  i->err_recieved = '\0';
+  i->err_failure = NULL;
+  i->err_expected_num = 0;
+  i->err_expected_slots = MPC_INPUT_EXPECTED_MIN;
+  i->err_expected = i->err_expected_stk;
+  
   return i;
 
 }
@@ -183,6 +338,16 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
   
+  i->memo = NULL;
+  i->arena = NULL;
+  
+  i->err_state = mpc_state_invalid();
+  i->err_recieved = '\0';
+  i->err_failure = NULL;
+  i->err_expected_num = 0;
+  i->err_expected_slots = MPC_INPUT_EXPECTED_MIN;
+  i->err_expected = i->err_expected_stk;
+  
   return i;
   
 }
@@ -211,16 +376,38 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
   
+  i->memo = NULL;
+  i->arena = NULL;
+  
+  i->err_state = mpc_state_invalid();
+  i->err_recieved = '\0';
+  i->err_failure = NULL;
+  i->err_expected_num = 0;
+  i->err_expected_slots = MPC_INPUT_EXPECTED_MIN;
+  i->err_expected = i->err_expected_stk;
+  
   return i;
 }
 
+static void mpc_memo_clear(mpc_memo_t *m);
+
 static void mpc_input_delete(mpc_input_t *i) {
   
+  int j;
+  
   free(i->filename);
   
   if (i->type == MPC_INPUT_STRING) { free(i->string); }
   if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
   
+  if (i->memo) {
+    for (j = 0; j < MPC_INPUT_MEMO_NUM; j++) { mpc_memo_clear(&i->memo[j]); }
+    free(i->memo);
+  }
+  
+  if (i->arena) { mpc_arena_delete(i->arena); }
+  if (i->err_expected != i->err_expected_stk) { free(i->err_expected); }
+  
   free(i->marks);
   free(i->lasts);
   free(i);
@@ -362,7 +549,7 @@ static char mpc_input_buffer_get(mpc_input_t *i) {
 }
 
 static int mpc_input_terminated(mpc_input_t *i) {
-  if (i->type == MPC_INPUT_STRING && i->state.pos == (long)strlen(i->string)) { return 1; }
+  if (i->type == MPC_INPUT_STRING && i->string[i->state.pos] == '\0') { return 1; }
   if (i->type == MPC_INPUT_FILE && feof(i->file)) { return 1; }
   if (i->type == MPC_INPUT_PIPE && feof(i->file)) { return 1; }
   return 0;
@@ -575,14 +762,12 @@ static void mpc_err_string_cat(char *buffer, int *pos, int *max, char const *fmt
   va_end(va);
 }
 
-static char char_unescape_buffer[4];
-
-static const char *mpc_err_char_unescape(char c) {
+static const char *mpc_err_char_unescape(char c, char *buffer) {
   
-  char_unescape_buffer[0] = '\'';
-  char_unescape_buffer[1] = ' ';
-  char_unescape_buffer[2] = '\'';
-  char_unescape_buffer[3] = '\0';
+  buffer[0] = '\'';
+  buffer[1] = ' ';
+  buffer[2] = '\'';
+  buffer[3] = '\0';
   
   switch (c) {
     case '\a': return "bell";
@@ -595,8 +780,8 @@ static const char *mpc_err_char_unescape(char c) {
     case '\t': return "tab";
     case ' ' : return "space";
     default:
-      char_unescape_buffer[1] = c;
-      return char_unescape_buffer;
+      buffer[1] = c;
+      return buffer;
   }
   
 }
@@ -604,6 +789,7 @@ static const char *mpc_err_char_unescape(char c) {
 char *mpc_err_string(mpc_err_t *x) {
 
   int i;  
+  char unescaped[4];
   int pos = 0; 
   int max = 1023;
   char *buffer = calloc(1, 1024);
@@ -631,223 +817,237 @@ char *mpc_err_string(mpc_err_t *x) {
   }
   
   mpc_err_string_cat(buffer, &pos, &max, " at ");
-  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->recieved));
+  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->recieved, unescaped));
   mpc_err_string_cat(buffer, &pos, &max, "\n");
   
   return realloc(buffer, strlen(buffer) + 1);
 }
 
-static mpc_err_t *mpc_err_new(mpc_input_t *i, const char *expected) {
-  mpc_err_t *x;
-  if (i->suppress) { return NULL; }
-  x = mpc_malloc(i, sizeof(mpc_err_t));
-  x->filename = mpc_malloc(i, strlen(i->filename) + 1);
-  strcpy(x->filename, i->filename);
-  x->state = i->state;
-  x->expected_num = 1;
-  x->expected = mpc_malloc(i, sizeof(char*));
-  x->expected[0] = mpc_malloc(i, strlen(expected) + 1);
-  strcpy(x->expected[0], expected);
-  x->failure = NULL;
-  x->recieved = mpc_input_peekc(i);
-  return x;
+/*
+** Errors are not built while parsing, as almost
+** all failures are backtracked over and then
+** discarded. Instead the input tracks only the
+** furthest position at which a failure was seen,
+** along with what was expected there. These are
+** pointers to strings owned by the parsers, so
+** recording them does not allocate. The error is
+** constructed from this once the parse has failed.
+*/
+
+static void mpc_input_failed(mpc_input_t *i, const char *expected, const char *failure) {
+  
+  int j;
+  
+  if (i->suppress) { return; }
+  if (i->state.pos < i->err_state.pos) { return; }
+  
+  if (i->state.pos > i->err_state.pos) {
+    i->err_state = i->state;
+    i->err_recieved = mpc_input_peekc(i);
+    i->err_failure = NULL;
+    i->err_expected_num = 0;
+  }
+  
+  if (failure) {
+    if (i->err_failure == NULL) { i->err_failure = failure; }
+    return;
+  }
+  
+  for (j = 0; j < i->err_expected_num; j++) {
+    if (i->err_expected[j] == expected || strcmp(i->err_expected[j], expected) == 0) { return; }
+  }
+  
+  if (i->err_expected_num == i->err_expected_slots) {
+    i->err_expected_slots *= 2;
+    if (i->err_expected == i->err_expected_stk) {
+      i->err_expected = malloc(sizeof(char*) * i->err_expected_slots);
+      memcpy(i->err_expected, i->err_expected_stk, sizeof(char*) * i->err_expected_num);
+    } else {
+      i->err_expected = realloc(i->err_expected, sizeof(char*) * i->err_expected_slots);
+    }
+  }
+  
+  i->err_expected[i->err_expected_num++] = expected;
 }
 
-static mpc_err_t *mpc_err_fail(mpc_input_t *i, const char *failure) {
-  mpc_err_t *x;
-  if (i->suppress) { return NULL; }
-  x = mpc_malloc(i, sizeof(mpc_err_t));
-  x->filename = mpc_malloc(i, strlen(i->filename) + 1);
+static mpc_err_t *mpc_input_error(mpc_input_t *i) {
+  
+  int j;
+  mpc_err_t *x = malloc(sizeof(mpc_err_t));
+  x->filename = malloc(strlen(i->filename) + 1);
   strcpy(x->filename, i->filename);
-  x->state = i->state;
+  x->state = i->err_state;
+  x->recieved = i->err_recieved;
   x->expected_num = 0;
   x->expected = NULL;
-  x->failure = mpc_malloc(i, strlen(failure) + 1);
-  strcpy(x->failure, failure);
-  x->recieved = ' ';
+  x->failure = NULL;
+  
+  if (i->err_failure || i->err_expected_num == 0) {
+    x->failure = malloc(strlen(i->err_failure ? i->err_failure : "Unknown Error") + 1);
+    strcpy(x->failure, i->err_failure ? i->err_failure : "Unknown Error");
+    return x;
+  }
+  
+  x->expected_num = i->err_expected_num;
+  x->expected = malloc(sizeof(char*) * x->expected_num);
+  for (j = 0; j < x->expected_num; j++) {
+    x->expected[j] = malloc(strlen(i->err_expected[j]) + 1);
+    strcpy(x->expected[j], i->err_expected[j]);
+  }
+  
   return x;
 }
 
-static mpc_err_t *mpc_err_file(const char *filename, const char *failure) {
-  mpc_err_t *x;
-  x = malloc(sizeof(mpc_err_t));
-  x->filename = malloc(strlen(filename) + 1);
-  strcpy(x->filename, filename);
-  x->state = mpc_state_new();
-  x->expected_num = 0;
-  x->expected = NULL;
-  x->failure = malloc(strlen(failure) + 1);
-  strcpy(x->failure, failure);
-  x->recieved = ' ';
-  return x;
-}
+/*
+** Regular expressions without anchors or
+** lookahead can be compiled to a DFA (see
+** `mpc_re_dfa`) which is run here directly over
+** the input.
+** Each state has a transition per byte, -1 when
+** there is none, and a description of the bytes
+** it expects, used for error reporting.
+*/
 
-static void mpc_err_delete_internal(mpc_input_t *i, mpc_err_t *x) {
+typedef struct {
+  int states_num;
+  short *trans;
+  char *accept;
+  char **expected;
+  char *re;
+} mpc_dfa_t;
+
+static void mpc_dfa_delete(mpc_dfa_t *d) {
   int j;
-  if (x == NULL) { return; }
-  for (j = 0; j < x->expected_num; j++) { mpc_free(i, x->expected[j]); }
-  mpc_free(i, x->expected);
-  mpc_free(i, x->filename);
-  mpc_free(i, x->failure);
-  mpc_free(i, x);
+  for (j = 0; j < d->states_num; j++) { free(d->expected[j]); }
+  free(d->expected);
+  free(d->accept);
+  free(d->trans);
+  free(d->re);
+  free(d);
 }
 
-static mpc_err_t *mpc_err_export(mpc_input_t *i, mpc_err_t *x) {
+static mpc_dfa_t *mpc_dfa_copy(mpc_dfa_t *a) {
   int j;
-  for (j = 0; j < x->expected_num; j++) {
-    x->expected[j] = mpc_export(i, x->expected[j]);
+  mpc_dfa_t *d = malloc(sizeof(mpc_dfa_t));
+  d->states_num = a->states_num;
+  d->trans = malloc(sizeof(short) * 256 * a->states_num);
+  memcpy(d->trans, a->trans, sizeof(short) * 256 * a->states_num);
+  d->accept = malloc(a->states_num);
+  memcpy(d->accept, a->accept, a->states_num);
+  d->expected = malloc(sizeof(char*) * a->states_num);
+  for (j = 0; j < a->states_num; j++) {
+    d->expected[j] = NULL;
+    if (a->expected[j]) {
+      d->expected[j] = malloc(strlen(a->expected[j]) + 1);
+      strcpy(d->expected[j], a->expected[j]);
+    }
   }
-  x->expected = mpc_export(i, x->expected);
-  x->filename = mpc_export(i, x->filename);
-  x->failure = mpc_export(i, x->failure);
-  return mpc_export(i, x);
+  d->re = malloc(strlen(a->re) + 1);
+  strcpy(d->re, a->re);
+  return d;
 }
 
-static int mpc_err_contains_expected(mpc_input_t *i, mpc_err_t *x, char *expected) {
-  int j;
-  (void)i;
-  for (j = 0; j < x->expected_num; j++) {
-    if (strcmp(x->expected[j], expected) == 0) { return 1; }
+static void mpc_input_advance(mpc_input_t *i, char c) {
+  i->last = c;
+  i->state.pos++;
+  i->state.col++;
+  if (c == '\n') {
+    i->state.col = 0;
+    i->state.row++;
   }
-  return 0;
 }
 
-static void mpc_err_add_expected(mpc_input_t *i, mpc_err_t *x, char *expected) {
-  (void)i;
-  x->expected_num++;
-  x->expected = mpc_realloc(i, x->expected, sizeof(char*) * x->expected_num);
-  x->expected[x->expected_num-1] = mpc_malloc(i, strlen(expected) + 1);
-  strcpy(x->expected[x->expected_num-1], expected);
-}
-
-static mpc_err_t *mpc_err_or(mpc_input_t *i, mpc_err_t** x, int n) {
-  
-  int j, k, fst;
-  mpc_err_t *e;
-  
-  fst = -1;
-  for (j = 0; j < n; j++) {
-    if (x[j] != NULL) { fst = j; }
-  }
+static int mpc_input_dfa_string(mpc_input_t *i, mpc_dfa_t *d, char **o) {
   
-  if (fst == -1) { return NULL; }
+  int s = 0, t;
+  int matched = d->accept[0];
+  char c, last = i->last;
+  mpc_state_t start = i->state;
+  mpc_state_t end = i->state;
   
-  e = mpc_malloc(i, sizeof(mpc_err_t));
-  e->state = mpc_state_invalid();
-  e->expected_num = 0;
-  e->expected = NULL;
-  e->failure = NULL;
-  e->filename = mpc_malloc(i, strlen(x[fst]->filename)+1);
-  strcpy(e->filename, x[fst]->filename);
-  
-  for (j = 0; j < n; j++) {
-    if (x[j] == NULL) { continue; }
-    if (x[j]->state.pos > e->state.pos) { e->state = x[j]->state; }
-  }
-  
-  for (j = 0; j < n; j++) {
-    if (x[j] == NULL) { continue; }
-    if (x[j]->state.pos < e->state.pos) { continue; }
-    
-    if (x[j]->failure) {
-      e->failure = mpc_malloc(i, strlen(x[j]->failure)+1);
-      strcpy(e->failure, x[j]->failure);
-      break;
-    }
-    
-    e->recieved = x[j]->recieved;
-    
-    for (k = 0; k < x[j]->expected_num; k++) {
-      if (!mpc_err_contains_expected(i, e, x[j]->expected[k])) {
-        mpc_err_add_expected(i, e, x[j]->expected[k]);
-      }
+  while ((c = i->string[i->state.pos]) != '\0') {
+    t = d->trans[s * 256 + (unsigned char)c];
+    if (t < 0) { break; }
+    s = t;
+    mpc_input_advance(i, c);
+    if (d->accept[s]) {
+      matched = 1;
+      end = i->state;
+      last = c;
     }
   }
   
-  for (j = 0; j < n; j++) {
-    if (x[j] == NULL) { continue; }
-    mpc_err_delete_internal(i, x[j]);
-  }
+  /* Record what would have been needed to go further */
+  if (d->expected[s]) { mpc_input_failed(i, d->expected[s], NULL); }
   
-  return e;
+  i->state = end;
+  i->last = last;
+  if (!matched) { return 0; }
+  
+  *o = mpc_malloc(i, end.pos - start.pos + 1);
+  memcpy(*o, i->string + start.pos, end.pos - start.pos);
+  (*o)[end.pos - start.pos] = '\0';
+  return 1;
 }
 
-static mpc_err_t *mpc_err_repeat(mpc_input_t *i, mpc_err_t *x, const char *prefix) {
-
-  int j = 0;
-  size_t l = 0;
-  char *expect = NULL;
+static int mpc_input_dfa(mpc_input_t *i, mpc_dfa_t *d, char **o) {
   
-  if (x == NULL) { return NULL; }
+  int s = 0, t;
+  int backtrack = i->backtrack;
+  long j, n = 0, len = d->accept[0] ? 0 : -1;
+  char c;
+  char *buffer;
   
-  if (x->expected_num == 0) {
-    expect = mpc_calloc(i, 1, 1);
-    x->expected_num = 1;
-    x->expected = mpc_realloc(i, x->expected, sizeof(char*) * x->expected_num);
-    x->expected[0] = expect;
-    return x;
+  if (i->type == MPC_INPUT_STRING) { return mpc_input_dfa_string(i, d, o); }
+  
+  /* Files and pipes are read ahead, then rewound to the longest match */
+  buffer = mpc_malloc(i, 64);
+  i->backtrack = 1;
+  mpc_input_mark(i);
+  
+  while (1) {
+    c = mpc_input_getc(i);
+    if (mpc_input_terminated(i)) { break; }
+    t = d->trans[s * 256 + (unsigned char)c];
+    if (t < 0) { mpc_input_failure(i, c); break; }
+    mpc_input_success(i, c, NULL);
+    buffer = mpc_realloc(i, buffer, n + 2);
+    buffer[n++] = c;
+    s = t;
+    if (d->accept[s]) { len = n; }
   }
   
-  else if (x->expected_num == 1) {
-    expect = mpc_malloc(i, strlen(prefix) + strlen(x->expected[0]) + 1);
-    strcpy(expect, prefix);
-    strcat(expect, x->expected[0]);
-    mpc_free(i, x->expected[0]);
-    x->expected[0] = expect;
-    return x;
+  if (d->expected[s]) { mpc_input_failed(i, d->expected[s], NULL); }
+  
+  mpc_input_rewind(i);
+  for (j = 0; j < len; j++) {
+    c = mpc_input_getc(i);
+    mpc_input_success(i, c, NULL);
   }
+  i->backtrack = backtrack;
   
-  else if (x->expected_num > 1) {
-    
-    l += strlen(prefix);
-    for (j = 0; j < x->expected_num-2; j++) {
-      l += strlen(x->expected[j]) + strlen(", ");
-    }
-    l += strlen(x->expected[x->expected_num-2]);
-    l += strlen(" or ");
-    l += strlen(x->expected[x->expected_num-1]);
-    
-    expect = mpc_malloc(i, l + 1);
-    
-    strcpy(expect, prefix);
-    for (j = 0; j < x->expected_num-2; j++) {
-      strcat(expect, x->expected[j]); strcat(expect, ", ");
-    }
-    strcat(expect, x->expected[x->expected_num-2]);
-    strcat(expect, " or ");
-    strcat(expect, x->expected[x->expected_num-1]);
-
-    for (j = 0; j < x->expected_num; j++) { mpc_free(i, x->expected[j]); }
-    
-    x->expected_num = 1;
-    x->expected = mpc_realloc(i, x->expected, sizeof(char*) * x->expected_num);
-    x->expected[0] = expect;
-    return x;
+  if (len < 0) {
+    mpc_free(i, buffer);
+    return 0;
   }
   
-  return NULL;
-}
-
-static mpc_err_t *mpc_err_many1(mpc_input_t *i, mpc_err_t *x) {
-  return mpc_err_repeat(i, x, "one or more of ");
-}
-
-static mpc_err_t *mpc_err_count(mpc_input_t *i, mpc_err_t *x, int n) {
-  mpc_err_t *y;
-  int digits = n/10 + 1;
-  char *prefix;
-  prefix = mpc_malloc(i, digits + strlen(" of ") + 1);
-  sprintf(prefix, "%i of ", n);
-  y = mpc_err_repeat(i, x, prefix);
-  mpc_free(i, prefix);
-  return y;
+  buffer[len] = '\0';
+  *o = buffer;
+  return 1;
 }
 
-static mpc_err_t *mpc_err_merge(mpc_input_t *i, mpc_err_t *x, mpc_err_t *y) {
-  mpc_err_t *errs[2];
-  errs[0] = x;
-  errs[1] = y;
-  return mpc_err_or(i, errs, 2);
+static mpc_err_t *mpc_err_file(const char *filename, const char *failure) {
+  mpc_err_t *x;
+  x = malloc(sizeof(mpc_err_t));
+  x->filename = malloc(strlen(filename) + 1);
+  strcpy(x->filename, filename);
+  x->state = mpc_state_new();
+  x->expected_num = 0;
+  x->expected = NULL;
+  x->failure = malloc(strlen(failure) + 1);
+  strcpy(x->failure, failure);
+  x->recieved = ' ';
+  return x;
 }
 
 /*
@@ -882,7 +1082,9 @@ enum {
   MPC_TYPE_COUNT     = 22,
   
   MPC_TYPE_OR        = 23,
-  MPC_TYPE_AND       = 24
+  MPC_TYPE_AND       = 24,
+  
+  MPC_TYPE_DFA       = 25
 };
 
 typedef struct { char *m; } mpc_pdata_fail_t;
@@ -900,6 +1102,7 @@ typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
 typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
+typedef struct { mpc_dfa_t *d; } mpc_pdata_dfa_t;
 
 typedef union {
   mpc_pdata_fail_t fail;
@@ -917,10 +1120,13 @@ typedef union {
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
+  mpc_pdata_dfa_t dfa;
 } mpc_pdata_t;
 
 struct mpc_parser_t {
   char retained;
+  char packrat;
+  char arena;
   char *name;
   char type;
   mpc_pdata_t data;
@@ -955,6 +1161,12 @@ static mpc_val_t *mpcf_input_state_ast(mpc_input_t *i, int n, mpc_val_t **xs) {
   return a;
 }
 
+static mpc_ast_t *mpc_ast_fold(mpc_arena_t *arena, int n, mpc_ast_t **as);
+
+static mpc_val_t *mpcf_input_fold_ast(mpc_input_t *i, int n, mpc_val_t **xs) {
+  return mpc_ast_fold(i->arena, n, (mpc_ast_t**)xs);
+}
+
 static mpc_val_t *mpc_parse_fold(mpc_input_t *i, mpc_fold_t f, int n, mpc_val_t **xs) {
   int j;
   if (f == mpcf_null)      { return mpcf_null(n, xs); }
@@ -966,6 +1178,7 @@ static mpc_val_t *mpc_parse_fold(mpc_input_t *i, mpc_fold_t f, int n, mpc_val_t
   if (f == mpcf_trd_free)  { return mpcf_input_trd_free(i, n, xs); }
   if (f == mpcf_strfold)   { return mpcf_input_strfold(i, n, xs); }
   if (f == mpcf_state_ast) { return mpcf_input_state_ast(i, n, xs); }
+  if (f == mpcf_fold_ast)  { return mpcf_input_fold_ast(i, n, xs); }
   for (j = 0; j < n; j++) { xs[j] = mpc_export(i, xs[j]); }
   return f(j, xs);
 }
@@ -975,8 +1188,10 @@ static mpc_val_t *mpcf_input_free(mpc_input_t *i, mpc_val_t *x) {
   return NULL;
 }
 
+static mpc_ast_t *mpc_ast_arena_new(mpc_arena_t *arena, const char *tag, const char *contents);
+
 static mpc_val_t *mpcf_input_str_ast(mpc_input_t *i, mpc_val_t *c) {
-  mpc_ast_t *a = mpc_ast_new("", c);
+  mpc_ast_t *a = mpc_ast_arena_new(i->arena, "", c);
   mpc_free(i, c);
   return a;
 }
@@ -1001,12 +1216,14 @@ enum {
 };
 
 #define MPC_SUCCESS(x) r->output = x; return 1
-#define MPC_FAILURE(x) r->error = x; return 0
+#define MPC_FAILURE(x) x; return 0
 #define MPC_PRIMITIVE(x) \
   if (x) { MPC_SUCCESS(r->output); } \
-  else { MPC_FAILURE(NULL); }
+  else { return 0; }
+
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r);
 
-static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
+static int mpc_parse_node(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
   
   int j = 0, k = 0;
   mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
@@ -1025,12 +1242,13 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
     case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&r->output));
     case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&r->output));
     case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
+    case MPC_TYPE_DFA:     MPC_PRIMITIVE(mpc_input_dfa(i, p->data.dfa.d, (char**)&r->output));
     
     /* Other parsers */
     
-    case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
+    case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_input_failed(i, NULL, "Parser Undefined!"));
     case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
-    case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i, p->data.fail.m));
+    case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_input_failed(i, NULL, p->data.fail.m));
     case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
     case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
     case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i));
@@ -1038,37 +1256,37 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
     /* Application Parsers */
     
     case MPC_TYPE_APPLY:
-      if (mpc_parse_run(i, p->data.apply.x, r, e)) {
+      if (mpc_parse_run(i, p->data.apply.x, r)) {
         MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, r->output));
       } else {
-        MPC_FAILURE(r->output);
+        return 0;
       }
     
     case MPC_TYPE_APPLY_TO:
-      if (mpc_parse_run(i, p->data.apply_to.x, r, e)) {
+      if (mpc_parse_run(i, p->data.apply_to.x, r)) {
         MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, r->output, p->data.apply_to.d));
       } else {
-        MPC_FAILURE(r->error);
+        return 0;
       }
     
     case MPC_TYPE_EXPECT:
       mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.expect.x, r, e)) {
+      if (mpc_parse_run(i, p->data.expect.x, r)) {
         mpc_input_suppress_disable(i);
         MPC_SUCCESS(r->output);
       } else {
         mpc_input_suppress_disable(i);
-        MPC_FAILURE(mpc_err_new(i, p->data.expect.m));
+        MPC_FAILURE(mpc_input_failed(i, p->data.expect.m, NULL));
       }
     
     case MPC_TYPE_PREDICT:
       mpc_input_backtrack_disable(i);
-      if (mpc_parse_run(i, p->data.predict.x, r, e)) {      
+      if (mpc_parse_run(i, p->data.predict.x, r)) {      
         mpc_input_backtrack_enable(i);
         MPC_SUCCESS(r->output);
       } else {
         mpc_input_backtrack_enable(i);
-        MPC_FAILURE(r->error);
+        return 0;
       }
     
     /* Optional Parsers */
@@ -1078,11 +1296,11 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
     case MPC_TYPE_NOT:
       mpc_input_mark(i);
       mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.not.x, r, e)) {
+      if (mpc_parse_run(i, p->data.not.x, r)) {
         mpc_input_rewind(i);
         mpc_input_suppress_disable(i);
         mpc_parse_dtor(i, p->data.not.dx, r->output);
-        MPC_FAILURE(mpc_err_new(i, "opposite"));
+        MPC_FAILURE(mpc_input_failed(i, "opposite", NULL));
       } else {
         mpc_input_unmark(i);
         mpc_input_suppress_disable(i);
@@ -1090,10 +1308,9 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
       }
     
     case MPC_TYPE_MAYBE:
-      if (mpc_parse_run(i, p->data.not.x, r, e)) {
+      if (mpc_parse_run(i, p->data.not.x, r)) {
         MPC_SUCCESS(r->output);
       } else {
-        *e = mpc_err_merge(i, *e, r->error);
         MPC_SUCCESS(p->data.not.lf());
       }
     
@@ -1103,7 +1320,7 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
       
       results = results_stk;
       
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
+      while (mpc_parse_run(i, p->data.repeat.x, &results[j])) {
         j++;
         if (j == MPC_PARSE_STACK_MIN) {
           results_slots = j + j / 2;
@@ -1115,7 +1332,6 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
         }
       }
       
-      *e = mpc_err_merge(i, *e, results[j].error);
       MPC_SUCCESS(
         mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
         if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
@@ -1124,7 +1340,7 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
       
       results = results_stk;
       
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
+      while (mpc_parse_run(i, p->data.repeat.x, &results[j])) {
         j++;
         if (j == MPC_PARSE_STACK_MIN) {
           results_slots = j + j / 2;
@@ -1137,11 +1353,8 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
       }
       
       if (j == 0) {
-        MPC_FAILURE(
-          mpc_err_many1(i, results[j].error);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+        return 0;
       } else {
-        *e = mpc_err_merge(i, *e, results[j].error);
         MPC_SUCCESS(
           mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
           if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
@@ -1153,7 +1366,7 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
         ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n)
         : results_stk;
       
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
+      while (mpc_parse_run(i, p->data.repeat.x, &results[j])) {
         j++;
         if (j == p->data.repeat.n) { break; }
       }
@@ -1167,7 +1380,6 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
           mpc_parse_dtor(i, p->data.repeat.dx, results[k].output);
         }
         MPC_FAILURE(
-          mpc_err_count(i, results[j].error, p->data.repeat.n);
           if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });  
       }
       
@@ -1177,21 +1389,13 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
       
       if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
       
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
-      
       for (j = 0; j < p->data.or.n; j++) {
-        if (mpc_parse_run(i, p->data.or.xs[j], &results[j], e)) {
-          MPC_SUCCESS(results[j].output;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-        } else {
-          *e = mpc_err_merge(i, *e, results[j].error);
-        } 
+        if (mpc_parse_run(i, p->data.or.xs[j], r)) {
+          MPC_SUCCESS(r->output);
+        }
       }
       
-      MPC_FAILURE(NULL;
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      return 0;
     
     case MPC_TYPE_AND:
       
@@ -1203,12 +1407,12 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
       
       mpc_input_mark(i);
       for (j = 0; j < p->data.and.n; j++) {
-        if (!mpc_parse_run(i, p->data.and.xs[j], &results[j], e)) {
+        if (!mpc_parse_run(i, p->data.and.xs[j], &results[j])) {
           mpc_input_rewind(i);
           for (k = 0; k < j; k++) {
             mpc_parse_dtor(i, p->data.and.dxs[k], results[k].output);
           }
-          MPC_FAILURE(results[j].error;
+          MPC_FAILURE(
             if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
         }
       }
@@ -1221,7 +1425,7 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
     
     default:
       
-      MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
+      MPC_FAILURE(mpc_input_failed(i, NULL, "Unknown Parser Type Id!"));
   }
   
   return 0;
@@ -1232,16 +1436,113 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
 #undef MPC_FAILURE
 #undef MPC_PRIMITIVE
 
+/*
+** Packrat Memoization
+**
+** Parsers marked as packrat (the rules of a
+** language built with MPCA_LANG_PACKRAT) have
+** their result at each position recorded, so
+** that backtracking into the same rule at the
+** same position replays the result rather than
+** parsing the input again.
+**
+** The table is direct mapped and of a fixed
+** size, which bounds the memory used per parse:
+** on a collision the older entry is evicted.
+** Entries hold copies of the resulting AST and
+** are keyed on whether errors were suppressed.
+** Failures need not be replayed as they are
+** already accounted for in the input's furthest
+** error. Pipes are never memoized as they cannot
+** be seeked.
+**
+** Copying every result would cost more than it
+** saves for grammars which rarely backtrack, so
+** the first visit of a rule at some position
+** only marks the entry as seen. The result is
+** stored on the second visit and replayed from
+** then on, meaning each rule is run at most
+** twice per position.
+*/
+
+static mpc_ast_t *mpc_ast_arena_copy(mpc_arena_t *arena, mpc_ast_t *a);
+
+static void mpc_memo_clear(mpc_memo_t *m) {
+  if (m->parser == NULL) { return; }
+  mpc_ast_delete(m->output);
+  m->parser = NULL;
+  m->output = NULL;
+}
+
+static mpc_memo_t *mpc_memo_slot(mpc_input_t *i, mpc_parser_t *p, char suppress) {
+  size_t h = ((size_t)p >> 4) * 31 + (size_t)i->state.pos * 2 + (size_t)suppress;
+  if (i->memo == NULL) { i->memo = calloc(MPC_INPUT_MEMO_NUM, sizeof(mpc_memo_t)); }
+  return &i->memo[h % MPC_INPUT_MEMO_NUM];
+}
+
+static int mpc_parse_memo(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
+  
+  int x;
+  long pos = i->state.pos;
+  char suppress = i->suppress > 0;
+  mpc_memo_t *m = mpc_memo_slot(i, p, suppress);
+  
+  if (m->parser != p || m->pos != pos || m->suppress != suppress) {
+    x = mpc_parse_node(i, p, r);
+    mpc_memo_clear(m);
+    m->parser = p;
+    m->pos = pos;
+    m->suppress = suppress;
+    m->stored = 0;
+    return x;
+  }
+  
+  if (m->stored) {
+    i->state = m->state;
+    i->last = m->last;
+    if (i->type == MPC_INPUT_FILE) { fseek(i->file, i->state.pos, SEEK_SET); }
+    if (m->success) { r->output = mpc_ast_arena_copy(i->arena, m->output); }
+    return m->success;
+  }
+  
+  x = mpc_parse_node(i, p, r);
+  
+  mpc_memo_clear(m);
+  m->parser = p;
+  m->pos = pos;
+  m->suppress = suppress;
+  m->stored = 1;
+  m->success = x;
+  m->last = i->last;
+  m->state = i->state;
+  if (x) { m->output = mpc_ast_copy(r->output); }
+  
+  return x;
+}
+
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
+  if (p->packrat && i->type != MPC_INPUT_PIPE) {
+    return mpc_parse_memo(i, p, r);
+  }
+  return mpc_parse_node(i, p, r);
+}
+
 int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
   int x;
-  mpc_err_t *e = mpc_err_fail(i, "Unknown Error");
-  e->state = mpc_state_invalid();
-  x = mpc_parse_run(i, p, r, &e);
+  if (p->arena && i->arena == NULL) { i->arena = mpc_arena_new(); }
+  x = mpc_parse_run(i, p, r);
   if (x) {
-    mpc_err_delete_internal(i, e);
     r->output = mpc_export(i, r->output);
   } else {
-    r->error = mpc_err_export(i, mpc_err_merge(i, e, r->error));
+    r->error = mpc_input_error(i);
+  }
+  if (i->arena) {
+    if (x && r->output && ((mpc_ast_t*)r->output)->arena == i->arena) {
+      i->arena->root = r->output;
+    } else {
+      mpc_arena_delete(i->arena);
+    }
+    i->arena = NULL;
   }
   return x;
 }
@@ -1282,6 +1583,8 @@ int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
   
   FILE *f = fopen(filename, "rb");
   int res;
+  size_t n, length = 0, slots = 4096;
+  char *buffer;
   
   if (f == NULL) {
     r->output = NULL;
@@ -1289,8 +1592,20 @@ int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
     return 0;
   }
   
-  res = mpc_parse_file(filename, f, p, r);
+  buffer = malloc(slots);
+  
+  /* Read the whole file so it can be parsed as a string, without seeking */
+  while ((n = fread(buffer + length, 1, slots - length, f)) > 0) {
+    length += n;
+    if (length == slots) {
+      slots *= 2;
+      buffer = realloc(buffer, slots);
+    }
+  }
   fclose(f);
+  
+  res = mpc_nparse(filename, buffer, length, p, r);
+  free(buffer);
   return res;
 }
 
@@ -1358,6 +1673,8 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
     case MPC_TYPE_OR:  mpc_undefine_or(p);  break;
     case MPC_TYPE_AND: mpc_undefine_and(p); break;
     
+    case MPC_TYPE_DFA: mpc_dfa_delete(p->data.dfa.d); break;
+    
     default: break;
   }
   
@@ -1471,6 +1788,8 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       }
     break;
     
+    case MPC_TYPE_DFA: p->data.dfa.d = mpc_dfa_copy(a->data.dfa.d); break;
+    
     default: break;
   }
 
@@ -2093,20 +2412,14 @@ static const char *mpc_re_range_escape_char(char c) {
   }
 }
 
-static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+static char *mpc_re_range_chars(const char *s) {
   
-  mpc_parser_t *out;
   size_t i, j;
   size_t start, end;
   const char *tmp = NULL;
-  const char *s = x;
   int comp = s[0] == '^' ? 1 : 0;
   char *range = calloc(1,1);
   
-  if (s[0] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); } 
-  if (s[0] == '^' && 
-      s[1] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); }
-  
   for (i = comp; i < strlen(s); i++){
     
     /* Regex Range Escape */
@@ -2148,6 +2461,21 @@ static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
   
   }
   
+  return range;
+}
+
+static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+  
+  mpc_parser_t *out;
+  const char *s = x;
+  int comp = s[0] == '^' ? 1 : 0;
+  char *range;
+  
+  if (s[0] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); } 
+  if (s[0] == '^' && 
+      s[1] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); }
+  
+  range = mpc_re_range_chars(s);
   out = comp == 1 ? mpc_noneof(range) : mpc_oneof(range);
   
   free(x);
@@ -2156,6 +2484,415 @@ static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
   return out;
 }
 
+/*
+** DFA Compilation
+**
+** Most regular expressions are compiled to a
+** DFA rather than to combinators. The regex is
+** parsed by hand into an NFA with the same
+** grammar as above, which is then determinised
+** by subset construction.
+**
+** The DFA matches the longest prefix of the
+** input in the language of the regex. This only
+** differs from the combinator form, which never
+** backtracks into a repetition or alternative,
+** for regexes such as `a|ab` or `a*a`.
+**
+** Anchors (`^`, `$`, `\b`, `\B`, `\A`, `\Z`), the
+** lookahead escapes `\D`, `\S` and `\W`, and
+** regexes which are invalid or whose DFA would be
+** too large are left to the combinator form.
+*/
+
+enum {
+  MPC_NFA_STATES_MAX = 1024,
+  MPC_DFA_STATES_MAX = 128
+};
+
+typedef struct {
+  unsigned char set[32];
+  int has_set;
+  int out[2];
+} mpc_nfa_state_t;
+
+typedef struct {
+  int num;
+  int slots;
+  mpc_nfa_state_t *states;
+  const char *s;
+} mpc_nfa_t;
+
+typedef struct { int start; int end; } mpc_nfa_frag_t;
+
+static int mpc_nfa_state(mpc_nfa_t *n, int out0, int out1) {
+  mpc_nfa_state_t *x;
+  if (n->num == MPC_NFA_STATES_MAX) { return -1; }
+  if (n->num == n->slots) {
+    n->slots = n->slots ? n->slots * 2 : 32;
+    n->states = realloc(n->states, sizeof(mpc_nfa_state_t) * n->slots);
+  }
+  x = &n->states[n->num];
+  memset(x->set, 0, sizeof(x->set));
+  x->has_set = 0;
+  x->out[0] = out0;
+  x->out[1] = out1;
+  return n->num++;
+}
+
+static void mpc_nfa_set_add(unsigned char *set, unsigned char c) {
+  set[c / 8] |= (unsigned char)(1 << (c % 8));
+}
+
+static int mpc_nfa_set_has(const unsigned char *set, unsigned char c) {
+  return (set[c / 8] >> (c % 8)) & 1;
+}
+
+static int mpc_nfa_empty(mpc_nfa_t *n, mpc_nfa_frag_t *f) {
+  f->start = f->end = mpc_nfa_state(n, -1, -1);
+  return f->start >= 0;
+}
+
+static int mpc_nfa_chars(mpc_nfa_t *n, mpc_nfa_frag_t *f, const char *chars, int comp) {
+  int c;
+  f->end = mpc_nfa_state(n, -1, -1);
+  f->start = mpc_nfa_state(n, f->end, -1);
+  if (f->start < 0 || f->end < 0) { return 0; }
+  n->states[f->start].has_set = 1;
+  for (c = 1; c < 256; c++) {
+    if ((strchr(chars, (char)c) != NULL) != comp) {
+      mpc_nfa_set_add(n->states[f->start].set, (unsigned char)c);
+    }
+  }
+  return 1;
+}
+
+static int mpc_nfa_char(mpc_nfa_t *n, mpc_nfa_frag_t *f, char c) {
+  char chars[2];
+  chars[0] = c;
+  chars[1] = '\0';
+  return mpc_nfa_chars(n, f, chars, 0);
+}
+
+static void mpc_nfa_concat(mpc_nfa_t *n, mpc_nfa_frag_t *f, mpc_nfa_frag_t *g) {
+  n->states[f->end].out[0] = g->start;
+  f->end = g->end;
+}
+
+static int mpc_nfa_regex(mpc_nfa_t *n, mpc_nfa_frag_t *f);
+
+static int mpc_nfa_base(mpc_nfa_t *n, mpc_nfa_frag_t *f) {
+  
+  const char *start;
+  char *range, *chars;
+  int comp, ok;
+  char c = *n->s;
+  
+  if (c == '(') {
+    n->s++;
+    if (!mpc_nfa_regex(n, f) || *n->s != ')') { return 0; }
+    n->s++;
+    return 1;
+  }
+  
+  if (c == '[') {
+    start = ++n->s;
+    while (*n->s != ']') {
+      if (*n->s == '\0') { return 0; }
+      if (*n->s == '\\') {
+        n->s++;
+        if (*n->s == '\0') { return 0; }
+      }
+      n->s++;
+    }
+    range = malloc(n->s - start + 1);
+    memcpy(range, start, n->s - start);
+    range[n->s - start] = '\0';
+    n->s++;
+    comp = range[0] == '^';
+    if (range[comp] == '\0') { free(range); return 0; }
+    chars = mpc_re_range_chars(range);
+    ok = mpc_nfa_chars(n, f, chars, comp);
+    free(chars);
+    free(range);
+    return ok;
+  }
+  
+  if (c == '\\') {
+    c = *(++n->s);
+    if (c == '\0') { return 0; }
+    n->s++;
+    switch (c) {
+      case 'a': return mpc_nfa_char(n, f, '\a');
+      case 'f': return mpc_nfa_char(n, f, '\f');
+      case 'n': return mpc_nfa_char(n, f, '\n');
+      case 'r': return mpc_nfa_char(n, f, '\r');
+      case 't': return mpc_nfa_char(n, f, '\t');
+      case 'v': return mpc_nfa_char(n, f, '\v');
+      case 'd': return mpc_nfa_chars(n, f, "0123456789", 0);
+      case 's': return mpc_nfa_chars(n, f, " \f\n\r\t\v", 0);
+      case 'w': return mpc_nfa_chars(n, f, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_", 0);
+      case 'b': case 'B': case 'A': case 'Z':
+      case 'D': case 'S': case 'W':
+        return 0;
+      default: return mpc_nfa_char(n, f, c);
+    }
+  }
+  
+  if (c == '\0' || c == ')' || c == '|' || c == '^' || c == '$') { return 0; }
+  
+  n->s++;
+  if (c == '.') { return mpc_nfa_chars(n, f, "", 1); }
+  return mpc_nfa_char(n, f, c);
+}
+
+static int mpc_nfa_factor(mpc_nfa_t *n, mpc_nfa_frag_t *f) {
+  
+  const char *base = n->s;
+  mpc_nfa_frag_t g;
+  long j, num;
+  int end;
+  
+  if (!mpc_nfa_base(n, f)) { return 0; }
+  
+  switch (*n->s) {
+    
+    case '*':
+    case '?':
+      end = mpc_nfa_state(n, -1, -1);
+      if (end < 0) { return 0; }
+      n->states[f->end].out[0] = end;
+      if (*n->s == '*') {
+        n->states[f->end].out[0] = f->start;
+        n->states[f->end].out[1] = end;
+      }
+      f->start = mpc_nfa_state(n, f->start, end);
+      f->end = end;
+      n->s++;
+      return f->start >= 0;
+    
+    case '+':
+      end = mpc_nfa_state(n, -1, -1);
+      if (end < 0) { return 0; }
+      n->states[f->end].out[0] = f->start;
+      n->states[f->end].out[1] = end;
+      f->end = end;
+      n->s++;
+      return 1;
+    
+    case '{':
+      
+      /* The base is parsed again for each repetition */
+      n->s++;
+      if (!strchr("0123456789", *n->s) || *n->s == '\0') { return 0; }
+      num = strtol(n->s, (char**)&n->s, 10);
+      if (*n->s != '}' || num < 1 || num > MPC_NFA_STATES_MAX) { return 0; }
+      end = (int)(++n->s - base);
+      
+      for (j = 1; j < num; j++) {
+        n->s = base;
+        if (!mpc_nfa_base(n, &g)) { return 0; }
+        mpc_nfa_concat(n, f, &g);
+      }
+      n->s = base + end;
+      return 1;
+    
+    default: return 1;
+  }
+}
+
+static int mpc_nfa_term(mpc_nfa_t *n, mpc_nfa_frag_t *f) {
+  mpc_nfa_frag_t g;
+  if (!mpc_nfa_empty(n, f)) { return 0; }
+  while (*n->s != '\0' && *n->s != ')' && *n->s != '|') {
+    if (!mpc_nfa_factor(n, &g)) { return 0; }
+    mpc_nfa_concat(n, f, &g);
+  }
+  return 1;
+}
+
+static int mpc_nfa_regex(mpc_nfa_t *n, mpc_nfa_frag_t *f) {
+  
+  mpc_nfa_frag_t g;
+  int start, end;
+  
+  if (!mpc_nfa_term(n, f)) { return 0; }
+  if (*n->s != '|') { return 1; }
+  
+  n->s++;
+  if (!mpc_nfa_regex(n, &g)) { return 0; }
+  
+  start = mpc_nfa_state(n, f->start, g.start);
+  end = mpc_nfa_state(n, -1, -1);
+  if (start < 0 || end < 0) { return 0; }
+  n->states[f->end].out[0] = end;
+  n->states[g.end].out[0] = end;
+  f->start = start;
+  f->end = end;
+  return 1;
+}
+
+static void mpc_nfa_closure(mpc_nfa_t *n, unsigned char *set, int *stack) {
+  
+  int j, k, x, top = 0;
+  
+  for (j = 0; j < n->num; j++) {
+    if (set[j]) { stack[top++] = j; }
+  }
+  
+  while (top) {
+    x = stack[--top];
+    if (n->states[x].has_set) { continue; }
+    for (k = 0; k < 2; k++) {
+      if (n->states[x].out[k] >= 0 && !set[n->states[x].out[k]]) {
+        set[n->states[x].out[k]] = 1;
+        stack[top++] = n->states[x].out[k];
+      }
+    }
+  }
+}
+
+static char *mpc_dfa_expected(const unsigned char *bytes) {
+  
+  int c, count = 0;
+  char *chars = calloc(257, 1);
+  char *out;
+  
+  for (c = 1; c < 256; c++) {
+    if (bytes[c]) { count++; }
+  }
+  
+  if (count == 0) { free(chars); return NULL; }
+  if (count == 255) { free(chars); out = malloc(strlen("any character") + 1); strcpy(out, "any character"); return out; }
+  
+  for (c = 1; c < 256; c++) {
+    if (bytes[c] == (count <= 128)) { chars[strlen(chars)] = (char)c; }
+  }
+  
+  out = malloc(strlen(chars) + strlen("none of ''") + 1);
+  if (count == 1) { sprintf(out, "'%s'", chars); }
+  else if (count <= 128) { sprintf(out, "one of '%s'", chars); }
+  else { sprintf(out, "none of '%s'", chars); }
+  free(chars);
+  return out;
+}
+
+static mpc_dfa_t *mpc_dfa_new(const char *re) {
+  
+  int j, k, c, x, found;
+  int states_num = 0;
+  unsigned char **sets = NULL;
+  unsigned char *next;
+  unsigned char bytes[256];
+  int *stack;
+  mpc_nfa_t n;
+  mpc_nfa_frag_t f;
+  mpc_dfa_t *d;
+  
+  n.num = 0;
+  n.slots = 0;
+  n.states = NULL;
+  n.s = re;
+  
+  if (!mpc_nfa_regex(&n, &f) || *n.s != '\0') {
+    free(n.states);
+    return NULL;
+  }
+  
+  d = malloc(sizeof(mpc_dfa_t));
+  d->states_num = 0;
+  d->trans = NULL;
+  d->accept = NULL;
+  d->expected = NULL;
+  d->re = malloc(strlen(re) + 1);
+  strcpy(d->re, re);
+  
+  stack = malloc(sizeof(int) * n.num);
+  next = malloc(n.num);
+  sets = malloc(sizeof(unsigned char*) * MPC_DFA_STATES_MAX);
+  sets[0] = calloc(n.num, 1);
+  sets[0][f.start] = 1;
+  mpc_nfa_closure(&n, sets[0], stack);
+  states_num = 1;
+  
+  for (j = 0; j < states_num; j++) {
+    
+    d->states_num = states_num;
+    d->trans = realloc(d->trans, sizeof(short) * 256 * states_num);
+    d->accept = realloc(d->accept, states_num);
+    d->expected = realloc(d->expected, sizeof(char*) * states_num);
+    d->accept[j] = sets[j][f.end];
+    d->trans[j * 256] = -1;
+    memset(bytes, 0, sizeof(bytes));
+    
+    for (c = 1; c < 256; c++) {
+      
+      memset(next, 0, n.num);
+      found = 0;
+      for (x = 0; x < n.num; x++) {
+        if (sets[j][x] && n.states[x].has_set
+        &&  mpc_nfa_set_has(n.states[x].set, (unsigned char)c)) {
+          next[n.states[x].out[0]] = 1;
+          found = 1;
+        }
+      }
+      
+      if (!found) { d->trans[j * 256 + c] = -1; continue; }
+      bytes[c] = 1;
+      mpc_nfa_closure(&n, next, stack);
+      
+      for (k = 0; k < states_num; k++) {
+        if (memcmp(sets[k], next, n.num) == 0) { break; }
+      }
+      
+      if (k == states_num) {
+        if (states_num == MPC_DFA_STATES_MAX) {
+          d->expected[j] = NULL;
+          d->states_num = j + 1;
+          for (k = 0; k < states_num; k++) { free(sets[k]); }
+          free(sets); free(next); free(stack); free(n.states);
+          mpc_dfa_delete(d);
+          return NULL;
+        }
+        sets[states_num] = malloc(n.num);
+        memcpy(sets[states_num], next, n.num);
+        states_num++;
+      }
+      
+      d->trans[j * 256 + c] = (short)k;
+    }
+    
+    d->expected[j] = mpc_dfa_expected(bytes);
+  }
+  
+  d->states_num = states_num;
+  for (k = 0; k < states_num; k++) { free(sets[k]); }
+  free(sets); free(next); free(stack); free(n.states);
+  return d;
+}
+
+/*
+** Unlike `mpc_re`, which takes the first
+** alternative that matches and backtracks into
+** repetitions, the DFA matches the longest prefix
+** of the input, so `a|ab` and `a*a` can match
+** differently. Patterns the DFA cannot express
+** are built with `mpc_re`.
+*/
+
+mpc_parser_t *mpc_re_dfa(const char *re) {
+  
+  mpc_parser_t *p;
+  mpc_dfa_t *dfa = mpc_dfa_new(re);
+  
+  if (!dfa) { return mpc_re(re); }
+  
+  p = mpc_undefined();
+  p->type = MPC_TYPE_DFA;
+  p->data.dfa.d = dfa;
+  return p;
+}
+
 mpc_parser_t *mpc_re(const char *re) {
   
   char *err_msg;
@@ -2557,6 +3294,8 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
     free(s);
   }
   
+  if (p->type == MPC_TYPE_DFA) { printf("/%s/", p->data.dfa.d->re); }
+  
   if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
@@ -2671,6 +3410,11 @@ void mpc_ast_delete(mpc_ast_t *a) {
   
   if (a == NULL) { return; }
   
+  if (a->arena) {
+    if (a->arena->root == a) { mpc_arena_delete(a->arena); }
+    return;
+  }
+  
   for (i = 0; i < a->children_num; i++) {
     mpc_ast_delete(a->children[i]);
   }
@@ -2682,7 +3426,29 @@ void mpc_ast_delete(mpc_ast_t *a) {
   
 }
 
+static mpc_ast_t *mpc_ast_arena_copy(mpc_arena_t *arena, mpc_ast_t *a) {
+  
+  int i;
+  mpc_ast_t *b;
+  
+  if (a == NULL) { return NULL; }
+  
+  b = mpc_ast_arena_new(arena, a->tag, a->contents);
+  b->state = a->state;
+  
+  for (i = 0; i < a->children_num; i++) {
+    mpc_ast_add_child(b, mpc_ast_arena_copy(arena, a->children[i]));
+  }
+  
+  return b;
+}
+
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a) {
+  return mpc_ast_arena_copy(NULL, a);
+}
+
 static void mpc_ast_delete_no_children(mpc_ast_t *a) {
+  if (a->arena) { return; }
   free(a->children);
   free(a->tag);
   free(a->contents);
@@ -2703,10 +3469,27 @@ mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
   
   a->children_num = 0;
   a->children = NULL;
+  a->arena = NULL;
   return a;
   
 }
 
+static mpc_ast_t *mpc_ast_arena_new(mpc_arena_t *arena, const char *tag, const char *contents) {
+  
+  mpc_ast_t *a;
+  
+  if (arena == NULL) { return mpc_ast_new(tag, contents); }
+  
+  a = mpc_arena_alloc(arena, sizeof(mpc_ast_t));
+  a->tag = mpc_arena_strdup(arena, tag);
+  a->contents = mpc_arena_strdup(arena, contents);
+  a->state = mpc_state_new();
+  a->children_num = 0;
+  a->children = NULL;
+  a->arena = arena;
+  return a;
+}
+
 mpc_ast_t *mpc_ast_build(int n, const char *tag, ...) {
   
   mpc_ast_t *a = mpc_ast_new(tag, "");
@@ -2733,7 +3516,7 @@ mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a) {
   if (a->children_num == 0) { return a; }
   if (a->children_num == 1) { return a; }
 
-  r = mpc_ast_new(">", "");
+  r = mpc_ast_arena_new(a->arena, ">", "");
   mpc_ast_add_child(r, a);
   return r;
 }
@@ -2753,16 +3536,47 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
   return 1;
 }
 
+/*
+** Arena child arrays carry no capacity, so they
+** are sized in powers of two and only grown once
+** the count reaches one.
+*/
+
+static void mpc_ast_arena_grow_children(mpc_ast_t *r) {
+  
+  int n = r->children_num;
+  mpc_ast_t **children;
+  
+  if (n != 0 && (n < 4 || (n & (n - 1)) != 0)) { return; }
+  
+  children = mpc_arena_alloc(r->arena, sizeof(mpc_ast_t*) * (n ? n * 2 : 4));
+  if (n) { memcpy(children, r->children, sizeof(mpc_ast_t*) * n); }
+  r->children = children;
+}
+
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
+  if (r->arena) {
+    mpc_ast_arena_grow_children(r);
+    r->children[r->children_num++] = a;
+    return r;
+  }
   r->children_num++;
   r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
   r->children[r->children_num-1] = a;
   return r;
 }
 
+static char *mpc_ast_resize_tag(mpc_ast_t *a, size_t n) {
+  char *tag;
+  if (a->arena == NULL) { return realloc(a->tag, n); }
+  tag = mpc_arena_alloc(a->arena, n);
+  strcpy(tag, a->tag);
+  return tag;
+}
+
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
+  a->tag = mpc_ast_resize_tag(a, strlen(t) + 1 + strlen(a->tag) + 1);
   memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
   memmove(a->tag, t, strlen(t));
   memmove(a->tag + strlen(t), "|", 1);
@@ -2771,13 +3585,17 @@ mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
 
 mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, (strlen(t)-1) + strlen(a->tag) + 1);
+  a->tag = mpc_ast_resize_tag(a, (strlen(t)-1) + strlen(a->tag) + 1);
   memmove(a->tag + (strlen(t)-1), a->tag, strlen(a->tag)+1);
   memmove(a->tag, t, (strlen(t)-1));
   return a;
 }
 
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
+  if (a->arena) {
+    a->tag = mpc_arena_strdup(a->arena, t);
+    return a;
+  }
   a->tag = realloc(a->tag, strlen(t) + 1);
   strcpy(a->tag, t);
   return a;
@@ -2991,18 +3809,17 @@ void mpc_ast_traverse_free(mpc_ast_trav_t **trav) {
   }
 }
 
-mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
+static mpc_ast_t *mpc_ast_fold(mpc_arena_t *arena, int n, mpc_ast_t **as) {
   
   int i, j;
-  mpc_ast_t** as = (mpc_ast_t**)xs;
   mpc_ast_t *r;
   
   if (n == 0) { return NULL; }
-  if (n == 1) { return xs[0]; }
-  if (n == 2 && xs[1] == NULL) { return xs[0]; }
-  if (n == 2 && xs[0] == NULL) { return xs[1]; }
+  if (n == 1) { return as[0]; }
+  if (n == 2 && as[1] == NULL) { return as[0]; }
+  if (n == 2 && as[0] == NULL) { return as[1]; }
   
-  r = mpc_ast_new(">", "");
+  r = mpc_ast_arena_new(arena, ">", "");
   
   for (i = 0; i < n; i++) {
     
@@ -3029,6 +3846,10 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
   return r;
 }
 
+mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
+  return mpc_ast_fold(NULL, n, (mpc_ast_t**)xs);
+}
+
 mpc_val_t *mpcf_str_ast(mpc_val_t *c) {
   mpc_ast_t *a = mpc_ast_new("", c);
   free(c);
@@ -3212,7 +4033,8 @@ static mpc_val_t *mpcaf_grammar_char(mpc_val_t *x, void *s) {
 static mpc_val_t *mpcaf_grammar_regex(mpc_val_t *x, void *s) {
   mpca_grammar_st_t *st = s;
   char *y = mpcf_unescape_regex(x);
-  mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_re(y) : mpc_tok(mpc_re(y));
+  mpc_parser_t *p = (st->flags & MPCA_LANG_DFA) ? mpc_re_dfa(y) : mpc_re(y);
+  if (!(st->flags & MPCA_LANG_WHITESPACE_SENSITIVE)) { p = mpc_tok(p); }
   free(y);
   return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "regex"));
 }
@@ -3428,6 +4250,8 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
     stmt = *stmts;
     left = mpca_grammar_find_parser(stmt->ident, st);
     if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
+    if (st->flags & MPCA_LANG_PACKRAT) { left->packrat = 1; }
+    if (st->flags & MPCA_LANG_ARENA) { left->arena = 1; }
     if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
     mpc_optimise(stmt->grammar);
     mpc_define(left, stmt->grammar);
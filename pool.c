@@ -0,0 +1,226 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+typedef struct {
+    lpool_fn fn;
+    void *arg;
+    int detached;
+    int remaining;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} ljob;
+
+// A range [lo, hi) of the indices of a job
+typedef struct {
+    ljob *job;
+    int lo;
+    int hi;
+} ltask;
+
+// A ring buffer of tasks; its owner works at the back, thieves at the front.
+typedef struct {
+    pthread_mutex_t lock;
+    ltask *tasks;
+    int head;
+    int count;
+    int size;
+} ldeque;
+
+static pthread_once_t LPOOL_ONCE = PTHREAD_ONCE_INIT;
+static atomic_int LPOOL_STARTED;
+static int LPOOL_WANTED = -1;
+static int LPOOL_WORKERS;
+// One deque per worker, plus a shared one for other threads
+static ldeque *LPOOL_DEQUES;
+static atomic_int LPOOL_PENDING;
+static pthread_mutex_t LPOOL_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t LPOOL_WAKE = PTHREAD_COND_INITIALIZER;
+static _Thread_local int LPOOL_SELF = -1;
+
+static int lpool_self() {
+    return LPOOL_SELF >= 0 ? LPOOL_SELF : LPOOL_WORKERS;
+}
+
+static void lpool_push(ltask t) {
+    ldeque *d = &LPOOL_DEQUES[lpool_self()];
+    pthread_mutex_lock(&d->lock);
+    if (d->count == d->size) {
+        int size = d->size ? d->size * 2 : 64;
+        ltask *tasks = malloc(size * sizeof(ltask));
+        for (int i=0; i < d->count; i++) {
+            tasks[i] = d->tasks[(d->head + i) % d->size];
+        }
+        free(d->tasks);
+        d->tasks = tasks;
+        d->head = 0;
+        d->size = size;
+    }
+    d->tasks[(d->head + d->count) % d->size] = t;
+    d->count++;
+    pthread_mutex_unlock(&d->lock);
+
+    atomic_fetch_add(&LPOOL_PENDING, 1);
+    pthread_mutex_lock(&LPOOL_LOCK);
+    pthread_cond_signal(&LPOOL_WAKE);
+    pthread_mutex_unlock(&LPOOL_LOCK);
+}
+
+static int lpool_pop(ldeque *d, int back, ltask *t) {
+    int found = 0;
+    pthread_mutex_lock(&d->lock);
+    if (d->count) {
+        if (back) {
+            *t = d->tasks[(d->head + d->count - 1) % d->size];
+        } else {
+            *t = d->tasks[d->head];
+            d->head = (d->head + 1) % d->size;
+        }
+        d->count--;
+        found = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+// Take the newest task of our own deque, or steal the oldest of another.
+static int lpool_take(ltask *t) {
+    int self = lpool_self();
+    int n = LPOOL_WORKERS + 1;
+    if (lpool_pop(&LPOOL_DEQUES[self], 1, t)) {
+        atomic_fetch_sub(&LPOOL_PENDING, 1);
+        return 1;
+    }
+    for (int i=1; i < n; i++) {
+        if (lpool_pop(&LPOOL_DEQUES[(self + i) % n], 0, t)) {
+            atomic_fetch_sub(&LPOOL_PENDING, 1);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Split a task in halves down to a single index, leaving the upper halves
+// for thieves, then run that index.
+static void lpool_run(ltask t) {
+    while (t.hi - t.lo > 1) {
+        int mid = t.lo + (t.hi - t.lo) / 2;
+        lpool_push((ltask) {t.job, mid, t.hi});
+        t.hi = mid;
+    }
+    ljob *job = t.job;
+    job->fn(job->arg, t.lo);
+    if (job->detached) {
+        free(job);
+        return;
+    }
+    pthread_mutex_lock(&job->lock);
+    if (--job->remaining == 0) {
+        pthread_cond_broadcast(&job->done);
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+static void *lpool_worker(void *arg) {
+    LPOOL_SELF = (int) (long) arg;
+    ltask t;
+    for (;;) {
+        if (lpool_take(&t)) {
+            lpool_run(t);
+            continue;
+        }
+        pthread_mutex_lock(&LPOOL_LOCK);
+        while (atomic_load(&LPOOL_PENDING) == 0) {
+            pthread_cond_wait(&LPOOL_WAKE, &LPOOL_LOCK);
+        }
+        pthread_mutex_unlock(&LPOOL_LOCK);
+    }
+    return NULL;
+}
+
+// Unless set by lpool_set_workers, start one worker per core but one,
+// since the calling thread helps.
+static void lpool_init() {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (LPOOL_WANTED >= 0) {
+        LPOOL_WORKERS = LPOOL_WANTED;
+    } else {
+        LPOOL_WORKERS = cores > 1 ? cores - 1 : 0;
+    }
+    atomic_store(&LPOOL_STARTED, 1);
+    LPOOL_DEQUES = calloc(LPOOL_WORKERS + 1, sizeof(ldeque));
+    for (int i=0; i <= LPOOL_WORKERS; i++) {
+        pthread_mutex_init(&LPOOL_DEQUES[i].lock, NULL);
+    }
+    for (long i=0; i < LPOOL_WORKERS; i++) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, lpool_worker, (void*) i);
+        pthread_detach(thread);
+    }
+}
+
+int lpool_set_workers(int n) {
+    if (atomic_load(&LPOOL_STARTED) || n < 0 || n > LPOOL_WORKERS_MAX) {
+        return -1;
+    }
+    LPOOL_WANTED = n;
+    return 0;
+}
+
+int lpool_workers() {
+    pthread_once(&LPOOL_ONCE, lpool_init);
+    return LPOOL_WORKERS;
+}
+
+void lpool_for(int n, lpool_fn fn, void *arg) {
+    if (n <= 0) { return; }
+    pthread_once(&LPOOL_ONCE, lpool_init);
+    ljob job;
+    job.fn = fn;
+    job.arg = arg;
+    job.detached = 0;
+    job.remaining = n;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.done, NULL);
+
+    lpool_push((ltask) {&job, 0, n});
+    ltask t;
+    for (;;) {
+        // Run tasks, of this job or any other, until there is none left
+        if (lpool_take(&t)) {
+            lpool_run(t);
+            continue;
+        }
+        pthread_mutex_lock(&job.lock);
+        if (job.remaining > 0) {
+            pthread_cond_wait(&job.done, &job.lock);
+        }
+        int remaining = job.remaining;
+        pthread_mutex_unlock(&job.lock);
+        if (remaining == 0) { break; }
+    }
+
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.done);
+}
+
+void lpool_spawn(lpool_fn fn, void *arg) {
+    pthread_once(&LPOOL_ONCE, lpool_init);
+    ljob *job = malloc(sizeof(ljob));
+    job->fn = fn;
+    job->arg = arg;
+    job->detached = 1;
+    job->remaining = 1;
+    lpool_push((ltask) {job, 0, 1});
+}
+
+int lpool_help() {
+    pthread_once(&LPOOL_ONCE, lpool_init);
+    ltask t;
+    if (!lpool_take(&t)) { return 0; }
+    lpool_run(t);
+    return 1;
+}
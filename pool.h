@@ -0,0 +1,33 @@
+#ifndef pool_h
+# define pool_h
+
+// A work-stealing thread pool shared by all interpreters of the process.
+//
+// Every worker owns a deque of tasks; it pushes and pops at the back and,
+// when it runs dry, steals from the front of the others. Threads that are
+// not workers push to a shared deque and help run tasks while they wait.
+
+#define LPOOL_WORKERS_MAX 256
+
+typedef void (*lpool_fn)(void*, int);
+
+// Run fn(arg, i) for every i in [0, n) and return when all calls are done.
+// Calls may run concurrently on any thread, including the caller's.
+void lpool_for(int n, lpool_fn fn, void *arg);
+
+// Run fn(arg, 0) on some thread later, without waiting for it.
+void lpool_spawn(lpool_fn fn, void *arg);
+
+// Run one pending task, if any, on the calling thread. Returns 1 if a task
+// was run. Threads waiting on a spawned task should help rather than block,
+// since the pool may have no worker to run it.
+int lpool_help(void);
+
+// Number of worker threads, not counting threads that call lpool_for.
+int lpool_workers(void);
+
+// Choose the number of workers; must be called before the pool is first
+// used. Returns -1 if it is too late or n is out of range.
+int lpool_set_workers(int n);
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef prelude_h
+# define prelude_h
+
+#include <stddef.h>
+
+// Image of lang/base.jbl, generated at build time by tools/mkprelude
+extern const unsigned char PRELUDE_IMAGE[];
+extern const size_t PRELUDE_IMAGE_LEN;
+
+#endif
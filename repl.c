@@ -2,18 +2,38 @@
 
 #include "mpc.h"
 #include "jblisp.h"
+#include "pool.h"
+#include "prelude.h"
+#include "server.h"
 
 int main(int argc, char **argv) {
-    lenv *env = lenv_new(NULL);
-    add_builtins(env);
-    build_parser();
+    // A crash reports the Lisp calls that led to it
+    lcalls_on_crash();
+    linterp *interp = linterp_new();
+    lenv *env = linterp_env(interp);
     puts("jblisp version " VERSION);
     puts("Press ^C to exit\n");
 
-    // Load language
-    exec_file(env, "lang/base.jbl");
+    // Load language from the image embedded at build time
+    if (lenv_load(env, PRELUDE_IMAGE, PRELUDE_IMAGE_LEN)) {
+        puts("Corrupt prelude image, loading lang/base.jbl instead.");
+        exec_file(interp, "lang/base.jbl");
+    } else {
+        // Actors start from the same prelude
+        linterp_set_prelude(PRELUDE_IMAGE, PRELUDE_IMAGE_LEN);
+    }
 
     int run_repl=1;
+    char *serve=NULL;
+    char *zygote=NULL;
+    char *profile=NULL;
+    int stats=0;
+    char *trace=NULL;
+    long trace_min_us=LTRACE_MIN_US;
+    char *mem_sample=NULL;
+    long mem_interval_ms=LHEAP_SAMPLE_MS;
+    llimits limits = {0, 0, LLIMIT_DEPTH};
+    lserve_opts opts = {0, 0, {0, 0, 0}, NULL, 0};
     int argp;
     // Process CLI switches
     for (argp=1; argp < argc; argp++) {
@@ -21,42 +41,123 @@ int main(int argc, char **argv) {
             if (strcmp(argv[argp], "--stop") == 0) {
                 run_repl=0;
             }
+            else if (strcmp(argv[argp], "--workers") == 0 && argp+1 < argc) {
+                // Threads running futures and parallel list procedures
+                if (lpool_set_workers(atoi(argv[++argp]))) {
+                    printf("--workers expects a number from 0 to %d.\n",
+                           LPOOL_WORKERS_MAX);
+                    return 1;
+                }
+            }
+            else if (strcmp(argv[argp], "--profile") == 0 && argp+1 < argc) {
+                // Folded stacks of Lisp procedures, written at exit
+                profile = argv[++argp];
+                lprof_start(LPROF_HZ);
+            }
+            else if (strcmp(argv[argp], "--trace") == 0 && argp+1 < argc) {
+                // Chrome trace events, see ltrace_start
+                trace = argv[++argp];
+            }
+            else if (strcmp(argv[argp], "--trace-min") == 0 && argp+1 < argc) {
+                // Microseconds a call must take to be traced
+                trace_min_us = atol(argv[++argp]);
+            }
+            else if (strcmp(argv[argp], "--mem-sample") == 0 && argp+1 < argc) {
+                // Time series of heap bytes and RSS, see lheap_sample_start
+                mem_sample = argv[++argp];
+            }
+            else if (strcmp(argv[argp], "--mem-interval") == 0 && argp+1 < argc) {
+                // Milliseconds between memory samples
+                mem_interval_ms = atol(argv[++argp]);
+            }
+            else if (strcmp(argv[argp], "--stats") == 0) {
+                // Allocation counts as JSON on stderr at exit
+                stats=1;
+            }
+            else if (strcmp(argv[argp], "--max-steps") == 0 && argp+1 < argc) {
+                // Procedure calls an evaluation may make
+                limits.steps = atoll(argv[++argp]);
+            }
+            else if (strcmp(argv[argp], "--max-heap") == 0 && argp+1 < argc) {
+                // Bytes an evaluation may add to the heap of its thread
+                limits.heap_bytes = atol(argv[++argp]);
+            }
+            else if (strcmp(argv[argp], "--max-depth") == 0 && argp+1 < argc) {
+                // Depth of Lisp calls, 0 for no cap
+                limits.depth = atol(argv[++argp]);
+            }
+            else if (strcmp(argv[argp], "--serve") == 0 && argp+1 < argc) {
+                serve = argv[++argp];
+            }
+            else if (strcmp(argv[argp], "--zygote") == 0 && argp+1 < argc) {
+                zygote = argv[++argp];
+            }
+            else if (strcmp(argv[argp], "--serve-workers") == 0 && argp+1 < argc) {
+                opts.workers = atoi(argv[++argp]);
+            }
+            else if (strcmp(argv[argp], "--timeout") == 0 && argp+1 < argc) {
+                // Milliseconds a server request may take
+                opts.timeout_ms = atol(argv[++argp]);
+            }
         }
         else { break; }
     }
+    if (trace != NULL && ltrace_start(trace, trace_min_us)) {
+        printf("Could not write trace '%s'.\n", trace);
+        return 1;
+    }
+    if (mem_sample != NULL && lheap_sample_start(mem_sample, mem_interval_ms)) {
+        printf("Could not write memory samples to '%s'.\n", mem_sample);
+        return 1;
+    }
+
+    linterp_set_limits(interp, &limits);
+
+    // Every server interpreter loads the CLI-specified files instead
+    if (serve != NULL) {
+        opts.limits = limits;
+        opts.files = argv + argp;
+        opts.files_count = argc - argp;
+        int rc = lserve(serve, &opts);
+        if (profile != NULL) { lprof_stop(profile); }
+        if (stats) { lmemstats_print_json(stderr); }
+        linterp_del(interp);
+        if (trace != NULL) { ltrace_stop(); }
+        if (mem_sample != NULL) { lheap_sample_stop(); }
+        return rc ? 1 : 0;
+    }
 
     // Load CLI-specified files
     for (int i=argp; i < argc; i++) {
-        exec_file(env, argv[i]);
+        exec_file(interp, argv[i]);
+    }
+
+    // Jobs start from a fork of the interpreter with the files loaded
+    if (zygote != NULL) {
+        int rc = lzygote(zygote, interp);
+        if (profile != NULL) { lprof_stop(profile); }
+        if (stats) { lmemstats_print_json(stderr); }
+        linterp_del(interp);
+        if (trace != NULL) { ltrace_stop(); }
+        if (mem_sample != NULL) { lheap_sample_stop(); }
+        return rc ? 1 : 0;
     }
 
     while (run_repl) {
         char *input = readline("jblisp> ");
+        if (input == NULL) { break; }
         if (strcmp(input, "(exit)")==0) { free(input); break; }
         add_history(input);
-        exec_line(env, input);
+        exec_line(interp, input);
         free(input);
     }
 
-#ifdef JBLISPC_DEBUG_MEM
-    for (int i=0; i < (COUNT_LENVNEW+COUNT_LENVCPY); i++) {
-        lenv_del(LENVS[i]);
+    if (profile != NULL && lprof_stop(profile)) {
+        printf("Could not write profile '%s'.\n", profile);
     }
-
-    printf("LVALs created: %li\n", COUNT_LVALNEW);
-    printf("LVALs copied: %li\n", COUNT_LVALCPY);
-    printf("LVALs deleted: %li\n", COUNT_LVALDEL);
-    printf("LVALs left: %li\n\n", COUNT_LVALNEW+COUNT_LVALCPY-COUNT_LVALDEL);
-    printf("LPROCs created: %li\n", COUNT_LPROCNEW);
-    printf("LPROCs copied: %li\n", COUNT_LPROCCPY);
-    printf("LPROCs deleted: %li\n", COUNT_LPROCDEL);
-    printf("LPROCs left: %li\n\n", COUNT_LPROCNEW+COUNT_LPROCCPY-COUNT_LPROCDEL);
-    printf("LENVs created: %li\n", COUNT_LENVNEW);
-    printf("LENVs copied: %li\n", COUNT_LENVCPY);
-    printf("LENVs deleted: %li\n", COUNT_LENVDEL);
-    printf("LENVs left: %li\n\n", COUNT_LENVNEW+COUNT_LENVCPY-COUNT_LENVDEL);
-#endif
-
-    cleanup_parser();
+    if (stats) { lmemstats_print_json(stderr); }
+    linterp_del(interp);
+    if (trace != NULL) { ltrace_stop(); }
+    if (mem_sample != NULL) { lheap_sample_stop(); }
     return 0;
 }
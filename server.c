@@ -0,0 +1,438 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "mpc.h"
+#include "jblisp.h"
+#include "server.h"
+
+// Connections accepted but not yet taken by a worker, and those being
+// served, which are shut down when the queue is closed
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int *fds;
+    int head;
+    int count;
+    int size;
+    int *serving; // by worker, -1 when idle
+    int workers;
+    int closed;
+} lconnq;
+
+// A worker thread of lserve, with its own copy of the options
+typedef struct {
+    pthread_t thread;
+    int id;
+    lconnq *conns;
+    lserve_opts opts;
+} lserve_wstate;
+
+static volatile sig_atomic_t LSERVE_STOP;
+static atomic_long LSERVE_LATENCY[LSERVE_BUCKETS];
+static atomic_long LSERVE_ERRORS;
+
+void lserve_stop() {
+    LSERVE_STOP = 1;
+}
+
+static void lconnq_put(lconnq *q, int fd) {
+    pthread_mutex_lock(&q->lock);
+    if (q->count == q->size) {
+        int size = q->size ? q->size * 2 : 64;
+        int *fds = malloc(size * sizeof(int));
+        for (int i=0; i < q->count; i++) {
+            fds[i] = q->fds[(q->head + i) % q->size];
+        }
+        free(q->fds);
+        q->fds = fds;
+        q->head = 0;
+        q->size = size;
+    }
+    q->fds[(q->head + q->count++) % q->size] = fd;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Take a connection for worker id to serve, after the one it served if
+// any. Returns -1 once the queue is closed.
+static int lconnq_get(lconnq *q, int id) {
+    pthread_mutex_lock(&q->lock);
+    q->serving[id] = -1;
+    while (q->count == 0 && !q->closed) {
+        pthread_cond_wait(&q->cond, &q->lock);
+    }
+    int fd = -1;
+    if (!q->closed) {
+        fd = q->fds[q->head];
+        q->head = (q->head + 1) % q->size;
+        q->count--;
+        q->serving[id] = fd;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return fd;
+}
+
+// Make the workers return: those waiting for a connection at once, those
+// serving one once its current request is answered. Connections still
+// queued are closed.
+static void lconnq_close(lconnq *q) {
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    for (int i=0; i < q->workers; i++) {
+        if (q->serving[i] >= 0) { shutdown(q->serving[i], SHUT_RD); }
+    }
+    for (; q->count > 0; q->count--) {
+        close(q->fds[q->head]);
+        q->head = (q->head + 1) % q->size;
+    }
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static int lserve_read_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n <= 0) { return -1; }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int lserve_write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n <= 0) { return -1; }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int lserve_read_frame(int fd, char **buf, unsigned *len) {
+    unsigned char hdr[4];
+    if (lserve_read_all(fd, hdr, 4)) { return -1; }
+    unsigned n = (unsigned) hdr[0] << 24 | hdr[1] << 16 | hdr[2] << 8 | hdr[3];
+    if (n > LSERVE_FRAME_MAX) { return -1; }
+    *buf = malloc(n + 1);
+    if (lserve_read_all(fd, *buf, n)) {
+        free(*buf);
+        return -1;
+    }
+    (*buf)[n] = '\0';
+    *len = n;
+    return 0;
+}
+
+int lserve_write_frame(int fd, char status, const char *buf, unsigned len) {
+    unsigned n = len + (status != 0);
+    unsigned char hdr[5] = {n >> 24, n >> 16, n >> 8, n, status};
+    if (lserve_write_all(fd, hdr, status ? 5 : 4)) { return -1; }
+    return lserve_write_all(fd, buf, len);
+}
+
+static void lserve_record(long long ns) {
+    long us = (long) (ns / 1000);
+    int i = 0;
+    while (us > 1 && i < LSERVE_BUCKETS - 1) {
+        us >>= 1;
+        i++;
+    }
+    atomic_fetch_add(&LSERVE_LATENCY[i], 1);
+}
+
+static void lserve_print_latency() {
+    long total = 0;
+    for (int i=0; i < LSERVE_BUCKETS; i++) {
+        total += atomic_load(&LSERVE_LATENCY[i]);
+    }
+    printf("Served %li requests, %li errors.\n",
+           total, atomic_load(&LSERVE_ERRORS));
+    if (total == 0) { return; }
+    puts("Latency (us)          requests");
+    long seen = 0;
+    for (int i=0; i < LSERVE_BUCKETS; i++) {
+        long n = atomic_load(&LSERVE_LATENCY[i]);
+        if (n == 0) { continue; }
+        seen += n;
+        printf("[%9li, %9li)  %9li  %5.1f%%\n",
+               i ? 1L << i : 0L, 1L << (i + 1), n, 100.0 * seen / total);
+    }
+}
+
+// Answer the requests of one connection until it is closed. They are
+// evaluated in a fork of the global env, so that a connection does not see
+// the definitions of the others.
+static void lserve_conn(linterp *it, int fd, long timeout_ms) {
+    char *src;
+    unsigned len;
+    lenv *env = lenv_fork(linterp_env(it));
+    while (lserve_read_frame(fd, &src, &len) == 0) {
+        long long start = lclock_ns();
+        linterp_set_timeout(it, timeout_ms);
+        lval *x = eval_line_env(it, env, src);
+        linterp_set_timeout(it, 0);
+        free(src);
+        char status = LSERVE_OK;
+        if (lval_type(x) == LVAL_ERR) {
+            status = LSERVE_ERROR;
+            atomic_fetch_add(&LSERVE_ERRORS, 1);
+        }
+        lval *repr = lval_repr(x);
+        char *s = lval_str_value(repr);
+        int failed = lserve_write_frame(fd, status, s, strlen(s));
+        lval_del(repr);
+        lserve_record(lclock_ns() - start);
+        if (failed) { break; }
+    }
+    lenv_fork_del(it, env, NULL);
+}
+
+static void *lserve_worker(void *arg) {
+    lserve_wstate *w = arg;
+    lserve_opts *opts = &w->opts;
+    linterp *it = linterp_new();
+    if (linterp_load_prelude(it)) {
+        exec_file(it, "lang/base.jbl");
+    }
+    for (int i=0; i < opts->files_count; i++) {
+        exec_file(it, opts->files[i]);
+    }
+    linterp_set_limits(it, &opts->limits);
+    int fd;
+    while ((fd = lconnq_get(w->conns, w->id)) >= 0) {
+        lserve_conn(it, fd, opts->timeout_ms);
+        close(fd);
+    }
+    linterp_del(it);
+    return NULL;
+}
+
+static void lserve_signal(int sig) {
+    lserve_stop();
+}
+
+// Listen on a socket bound to path, and stop on SIGINT and SIGTERM.
+static int lserve_listen(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Socket path '%s' is too long.\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    // Replace the socket left behind by a previous server, nothing else
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || bind(sock, (struct sockaddr*) &addr, sizeof(addr)) ||
+        listen(sock, 128)) {
+        printf("Could not listen on '%s': %s\n", path, strerror(errno));
+        if (sock >= 0) { close(sock); }
+        return -1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = lserve_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    LSERVE_STOP = 0;
+    return sock;
+}
+
+int lserve(const char *path, lserve_opts *opts) {
+    int sock = lserve_listen(path);
+    if (sock < 0) { return -1; }
+
+    int workers = opts->workers;
+    if (workers <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cores > 0 ? (int) cores : 1;
+    }
+    lconnq conns;
+    memset(&conns, 0, sizeof(conns));
+    pthread_mutex_init(&conns.lock, NULL);
+    pthread_cond_init(&conns.cond, NULL);
+    conns.serving = malloc(workers * sizeof(int));
+    conns.workers = workers;
+    lserve_wstate *ws = malloc(workers * sizeof(lserve_wstate));
+    for (int i=0; i < workers; i++) {
+        conns.serving[i] = -1;
+        ws[i].id = i;
+        ws[i].conns = &conns;
+        ws[i].opts = *opts;
+        pthread_create(&ws[i].thread, NULL, lserve_worker, &ws[i]);
+    }
+    printf("Serving on '%s' with %d interpreters.\n", path, workers);
+    fflush(stdout);
+
+    struct pollfd pfd = {sock, POLLIN, 0};
+    while (!LSERVE_STOP) {
+        if (poll(&pfd, 1, 100) <= 0) { continue; }
+        int fd = accept(sock, NULL, NULL);
+        if (fd >= 0) { lconnq_put(&conns, fd); }
+    }
+
+    close(sock);
+    unlink(path);
+    lconnq_close(&conns);
+    for (int i=0; i < workers; i++) {
+        pthread_join(ws[i].thread, NULL);
+    }
+    free(ws);
+    free(conns.serving);
+    free(conns.fds);
+    pthread_mutex_destroy(&conns.lock);
+    pthread_cond_destroy(&conns.cond);
+    lserve_print_latency();
+    return 0;
+}
+
+// A job of the zygote; done is the read end of a pipe whose write end only
+// the child holds, so that it hangs up when the child exits. The child reads
+// the script from the client and writes its name to the pipe first, so that a
+// silent client only holds up its own job.
+typedef struct {
+    long id;
+    pid_t pid;
+    int done;
+    long long start;
+    char *script;
+} lzjob;
+
+static void lzygote_child(linterp *it, int fd, int done) {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    char *script;
+    unsigned len;
+    if (lserve_read_frame(fd, &script, &len)) { _exit(1); }
+    if (write(done, script, len) < 0) { _exit(1); }
+    dup2(fd, 1);
+    dup2(fd, 2);
+    close(fd);
+    int rc = exec_file(it, script);
+    fflush(stdout);
+    _exit(rc ? 1 : 0);
+}
+
+// Add what the child wrote to the name of its script; 0 once it hung up
+static int lzygote_note(lzjob *job) {
+    char buf[256];
+    ssize_t n = read(job->done, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR) { return 1; }
+    if (n <= 0) { return 0; }
+    size_t len = strlen(job->script);
+    job->script = realloc(job->script, len + n + 1);
+    memcpy(job->script + len, buf, n);
+    job->script[len + n] = '\0';
+    return 1;
+}
+
+static void lzygote_reap(lzjob *job) {
+    while (lzygote_note(job)) {}
+    int status;
+    waitpid(job->pid, &status, 0);
+    double ms = (lclock_ns() - job->start) / 1e6;
+    if (WIFEXITED(status)) {
+        printf("Job %li '%s': exit %d in %.3f ms.\n",
+               job->id, job->script, WEXITSTATUS(status), ms);
+    } else {
+        printf("Job %li '%s': signal %d in %.3f ms.\n",
+               job->id, job->script, WTERMSIG(status), ms);
+    }
+    fflush(stdout);
+    close(job->done);
+    free(job->script);
+}
+
+int lzygote(const char *path, linterp *it) {
+    int sock = lserve_listen(path);
+    if (sock < 0) { return -1; }
+    printf("Zygote ready on '%s'.\n", path);
+    fflush(stdout);
+
+    lzjob *jobs = NULL;
+    int count = 0;
+    int size = 0;
+    struct pollfd *pfds = NULL;
+    long ids = 0;
+    while (!LSERVE_STOP) {
+        pfds = realloc(pfds, (count + 1) * sizeof(struct pollfd));
+        pfds[0] = (struct pollfd) {sock, POLLIN, 0};
+        for (int i=0; i < count; i++) {
+            pfds[i+1] = (struct pollfd) {jobs[i].done, POLLIN, 0};
+        }
+        if (poll(pfds, count + 1, 100) <= 0) { continue; }
+
+        for (int i=count-1; i >= 0; i--) {
+            if (pfds[i+1].revents && !lzygote_note(&jobs[i])) {
+                lzygote_reap(&jobs[i]);
+                jobs[i] = jobs[--count];
+            }
+        }
+        if (!pfds[0].revents) { continue; }
+
+        int fd = accept(sock, NULL, NULL);
+        if (fd < 0) { continue; }
+        int done[2];
+        if (pipe(done)) {
+            close(fd);
+            continue;
+        }
+        // Processes run by the job must not keep it open
+        fcntl(done[1], F_SETFD, FD_CLOEXEC);
+        long long start = lclock_ns();
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(sock);
+            close(done[0]);
+            for (int i=0; i < count; i++) { close(jobs[i].done); }
+            lzygote_child(it, fd, done[1]);
+        }
+        close(fd);
+        close(done[1]);
+        if (pid < 0) {
+            printf("Could not fork: %s\n", strerror(errno));
+            close(done[0]);
+            continue;
+        }
+        if (count == size) {
+            size = size ? size * 2 : 16;
+            jobs = realloc(jobs, size * sizeof(lzjob));
+        }
+        jobs[count++] = (lzjob) {++ids, pid, done[0], start, strdup("")};
+    }
+
+    close(sock);
+    unlink(path);
+    for (int i=0; i < count; i++) {
+        lzygote_reap(&jobs[i]);
+    }
+    free(jobs);
+    free(pfds);
+    printf("Ran %li jobs.\n", ids);
+    return 0;
+}
@@ -0,0 +1,61 @@
+#ifndef server_h
+# define server_h
+
+// An evaluation server on a Unix domain socket.
+//
+// Requests and responses are frames: a 4-byte big-endian length, then as
+// many bytes. A request is source code. Its response is a status byte,
+// LSERVE_OK or LSERVE_ERROR, then the printed value of the last expression
+// or of the first error. A client may send any number of requests on a
+// connection; they are answered in order.
+//
+// Every worker thread owns an interpreter, loaded once at startup, and
+// serves one connection at a time. Definitions are kept between the
+// requests of a connection, in a fork of the global env of the interpreter,
+// which those made with def* go to as well.
+
+#define LSERVE_OK '+'
+#define LSERVE_ERROR '-'
+#define LSERVE_FRAME_MAX (16 * 1024 * 1024)
+// Latency histogram buckets; bucket i counts requests served in
+// [2^i, 2^(i+1)) microseconds
+#define LSERVE_BUCKETS 32
+
+typedef struct {
+    // Worker interpreters; 0 for one per core
+    int workers;
+    // Time a request may take, 0 for no limit
+    long timeout_ms;
+    // Limits of every request, see linterp_set_limits
+    llimits limits;
+    // Files every interpreter loads after the prelude
+    char **files;
+    int files_count;
+} lserve_opts;
+
+// Serve requests on a socket bound to path until lserve_stop is called or
+// the process gets SIGINT or SIGTERM, then print the latency histogram.
+// Before returning, the connections left are closed, each once its current
+// request is answered, and the workers are joined and their interpreters
+// freed. opts is copied. Returns -1 if the socket cannot be set up.
+int lserve(const char *path, lserve_opts *opts);
+
+// Make lserve return; safe to call from a signal handler.
+void lserve_stop(void);
+
+// Serve jobs on a socket bound to path until lserve_stop is called, forking
+// the process for every job so that it starts with it already loaded. A
+// job is one frame holding the path of a script, which the child runs in it
+// with stdout and stderr sent to the connection, closed when it exits. The
+// zygote prints the exit status and time of every job. Returns -1 if the
+// socket cannot be set up.
+int lzygote(const char *path, linterp *it);
+
+// Read a frame into a new buffer, NUL-terminated. Returns -1 on EOF, error
+// or oversized frame.
+int lserve_read_frame(int fd, char **buf, unsigned *len);
+
+// Write a frame made of a status byte, unless it is 0, then len bytes.
+int lserve_write_frame(int fd, char status, const char *buf, unsigned len);
+
+#endif
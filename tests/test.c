@@ -1,5 +1,13 @@
+#define _DEFAULT_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 #include "../jblisp.h"
+#include "../server.h"
 #include "../minunit.h"
 
 int tests_run = 0;
@@ -46,9 +54,385 @@ static char *test_lenv() {
     return 0;
 }
 
+static char *test_image() {
+    lenv *e = lenv_new(NULL);
+    add_builtins(e);
+    lval *v = lval_qexpr();
+    lval_add(v, lval_lng(-42));
+    lval_add(v, lval_dbl(1.5));
+    lval_add(v, lval_str("foo", 3));
+    lenv_put(e, "foo", v);
+    lval *b = lenv_get(e, "head");
+    lenv_put(e, "first", b);
+
+    size_t len;
+    unsigned char *image = lenv_dump(e, &len);
+    mu_assert(image != NULL, "IMAGE: Could not dump env.");
+    lenv *f = lenv_new(NULL);
+    mu_assert(lenv_load(f, image, len) == 0, "IMAGE: Could not load env.");
+    lval *w = lenv_get(f, "foo");
+    mu_assert(lval_equal(v, w), "IMAGE: foo was not restored.");
+    lval_del(w);
+    w = lenv_get(f, "first");
+    mu_assert(lval_equal(b, w), "IMAGE: builtin alias was not restored.");
+    lval_del(w);
+    w = lenv_get(f, "head");
+    mu_assert(lval_type(w) == LVAL_ERR, "IMAGE: builtins should not be imaged.");
+    lval_del(w);
+    mu_assert(lenv_load(f, image, len - 1) != 0,
+              "IMAGE: Truncated image should not load.");
+
+    free(image);
+    lval_del(v);
+    lval_del(b);
+    lenv_del(e);
+    lenv_del(f);
+    return 0;
+}
+
+static void *interp_count(void *arg) {
+    linterp *it = arg;
+    lval *x = eval_line(it, "(def {n} 0)");
+    lval_del(x);
+    for (int i=0; i < 2000; i++) {
+        x = eval_line(it, "(def {n} (+ n 1)) n");
+        lval_del(x);
+    }
+    return NULL;
+}
+
+static char *test_interp_threads() {
+    linterp *its[4];
+    pthread_t threads[4];
+    for (int i=0; i < 4; i++) {
+        its[i] = linterp_new();
+        pthread_create(&threads[i], NULL, interp_count, its[i]);
+    }
+    for (int i=0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    lval *v = lval_lng(2000);
+    for (int i=0; i < 4; i++) {
+        lval *w = lenv_get(linterp_env(its[i]), "n");
+        mu_assert(lval_equal(v, w), "INTERP: Threads interfered with each other.");
+        lval_del(w);
+        linterp_del(its[i]);
+    }
+    lval_del(v);
+    return 0;
+}
+
+static char *test_fork() {
+    lenv *e = lenv_new(NULL);
+    lval *one = lval_lng(1);
+    lval *two = lval_lng(2);
+    lenv_put(e, "x", one);
+    lenv *f = lenv_fork(e);
+    lenv_put(f, "x", two);
+    lenv_put(f, "y", two);
+    lenv_put(e, "z", one);
+
+    lval *w = lenv_get(f, "x");
+    mu_assert(lval_equal(w, two), "FORK: Should see its own definitions.");
+    lval_del(w);
+    w = lenv_get(e, "x");
+    mu_assert(lval_equal(w, one), "FORK: Should not write to its base.");
+    lval_del(w);
+    w = lenv_get(e, "y");
+    mu_assert(lval_type(w) == LVAL_ERR, "FORK: Should not add to its base.");
+    lval_del(w);
+    w = lenv_get(f, "z");
+    mu_assert(lval_equal(w, one), "FORK: Should see later definitions of its base.");
+    lval_del(w);
+
+    lval_del(one);
+    lval_del(two);
+    lenv_del(f);
+    lenv_del(e);
+    return 0;
+}
+
+static char *test_profile() {
+    mu_assert(lintern_name("foo") == lintern_name("foo"),
+              "PROFILE: Names should be interned.");
+    linterp *it = linterp_new();
+    mu_assert(lprof_start(LPROF_HZ) == 0, "PROFILE: Could not start.");
+    lval_del(eval_line(it, "(fun {spin n} {(if (= n 0) {0} {(spin (- n 1))})})"));
+    long long start = lclock_ns();
+    while (lclock_ns() - start < 100000000LL) {
+        lval_del(eval_line(it, "(spin 100)"));
+    }
+    mu_assert(lprof_stop("build/test-profile.folded") == 0,
+              "PROFILE: Could not write the profile.");
+    linterp_del(it);
+
+    FILE *f = fopen("build/test-profile.folded", "r");
+    char line[256];
+    int found = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        found |= strncmp(line, "(toplevel);spin;spin", 20) == 0;
+    }
+    fclose(f);
+    mu_assert(found, "PROFILE: Should sample named procedures.");
+    return 0;
+}
+
+static char *test_trace() {
+    mu_assert(ltrace_start("build/test-trace.json", 0) == 0,
+              "TRACE: Could not start.");
+    linterp *it = linterp_new();
+    lval_del(eval_line(it, "(fun {sq x} {(* x x)}) (sq 3)"));
+    linterp_del(it);
+    mu_assert(ltrace_stop() == 0, "TRACE: Could not write the trace.");
+
+    FILE *f = fopen("build/test-trace.json", "r");
+    char buf[4096];
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    buf[n] = '\0';
+    fclose(f);
+    mu_assert(strncmp(buf, "{\"displayTimeUnit\"", 18) == 0 &&
+              strcmp(buf + n - 4, "\n]}\n") == 0,
+              "TRACE: Should write a trace object.");
+    mu_assert(strstr(buf, "\"name\": \"sq\", \"cat\": \"call\"") != NULL,
+              "TRACE: Should record calls.");
+    mu_assert(strstr(buf, "\"cat\": \"parse\"") != NULL,
+              "TRACE: Should record parsing.");
+    mu_assert(strstr(buf, "\"cat\": \"cleanup\"") != NULL,
+              "TRACE: Should record cleanup.");
+    return 0;
+}
+
+static char *test_backtrace() {
+    linterp *it = linterp_new();
+    lval_del(eval_line(it, "(fun {inner x} {(+ x nope)})\n"
+                           "(fun {outer x} {(inner x)})"));
+    lval *v = eval_line(it, "(outer 1)");
+    const char *trace = lval_err_backtrace(v);
+    mu_assert(trace != NULL &&
+              strcmp(trace, "  at inner (<stdin>:1)\n"
+                            "  at outer (<stdin>:2)\n"
+                            "  at (toplevel) (<stdin>:1)\n") == 0,
+              "BACKTRACE: Should list the calls from the innermost.");
+    lval *w = lval_copy(v);
+    mu_assert(strcmp(lval_err_backtrace(w), trace) == 0,
+              "BACKTRACE: Should be copied with its error.");
+    lval_del(w);
+    lval_del(v);
+    v = eval_line(it, "nope");
+    mu_assert(lval_type(v) == LVAL_ERR && lval_err_backtrace(v) == NULL,
+              "BACKTRACE: Errors outside of calls should have none.");
+    lval_del(v);
+    linterp_del(it);
+    return 0;
+}
+
+static char *test_port_close() {
+    linterp *it = linterp_new();
+    long long start = lclock_ns();
+    lval *v = eval_line(it, "(def {p} (process \"sleep 5\"))\n"
+                            "(def {r} (chan 1))\n"
+                            "(spawn {(read-line p) (send r 1)})\n"
+                            "(yield)\n"
+                            "(close p)\n"
+                            "(spawn {(send r 2)})\n"
+                            "(recv r)");
+    lval *two = lval_lng(2);
+    mu_assert(lval_equal(v, two) && lclock_ns() - start < 2000000000LL,
+              "PORT: Closing should fail the reads waiting for the port.");
+    lval_del(two);
+    lval_del(v);
+    linterp_del(it);
+    return 0;
+}
+
+static char *test_heap() {
+    mu_assert(lheap_sample_start("build/test-heap.txt", 1) == 0,
+              "HEAP: Could not start the sampler.");
+    lheapstats before;
+    lheap_read(&before);
+    linterp *it = linterp_new();
+    lval_del(eval_line(it, "(def {x} {1 2 3 4 5 6 7 8})"));
+    lheapstats during;
+    lheap_read(&during);
+    linterp_del(it);
+    mu_assert(lheap_sample_stop() == 0, "HEAP: Could not write the samples.");
+    mu_assert(during.live_bytes > before.live_bytes,
+              "HEAP: Should count the bytes of an interpreter.");
+    mu_assert(during.peak_bytes >= during.live_bytes &&
+              during.peak_rss_kb >= during.rss_kb && during.rss_kb > 0,
+              "HEAP: Peaks should not be below the current values.");
+
+    FILE *f = fopen("build/test-heap.txt", "r");
+    char line[256];
+    int lines = 0;
+    double ms;
+    long live, peak, rss, peak_rss;
+    mu_assert(fgets(line, sizeof(line), f) && line[0] == '#',
+              "HEAP: Should start the samples with a header.");
+    while (fscanf(f, "%lf %li %li %li %li", &ms, &live, &peak, &rss,
+                  &peak_rss) == 5) {
+        lines++;
+    }
+    fclose(f);
+    mu_assert(lines >= 2, "HEAP: Should sample at start and stop.");
+    return 0;
+}
+
+static char SERVE_PATH[64];
+
+static void *serve(void *arg) {
+    lserve(SERVE_PATH, arg);
+    return NULL;
+}
+
+// Send a request and compare the response with status and text
+static int serve_request(int fd, char *src, char status, char *text) {
+    char *buf;
+    unsigned len;
+    if (lserve_write_frame(fd, 0, src, strlen(src))) { return 0; }
+    if (lserve_read_frame(fd, &buf, &len)) { return 0; }
+    int ok = len >= 1 && buf[0] == status && strcmp(buf + 1, text) == 0;
+    free(buf);
+    return ok;
+}
+
+static char *test_serve() {
+    snprintf(SERVE_PATH, sizeof(SERVE_PATH), "/tmp/jblisp-test-%d.sock",
+             (int) getpid());
+    lserve_opts opts = {1, 200, {0, 0, LLIMIT_DEPTH}, NULL, 0};
+    pthread_t thread;
+    pthread_create(&thread, NULL, serve, &opts);
+
+    struct sockaddr_un addr = {AF_UNIX};
+    strcpy(addr.sun_path, SERVE_PATH);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    int tries = 0;
+    while (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) && tries++ < 500) {
+        usleep(10000);
+    }
+    mu_assert(tries < 500, "SERVE: Could not connect to the server.");
+    mu_assert(serve_request(fd, "(def {x} 20) (+ x 22)", LSERVE_OK, "42"),
+              "SERVE: Should evaluate a request.");
+    mu_assert(serve_request(fd, "(* x 2)", LSERVE_OK, "40"),
+              "SERVE: Should keep definitions between requests.");
+    mu_assert(serve_request(fd, "nope", LSERVE_ERROR,
+                            "<error: Unbound symbol 'nope'.>"),
+              "SERVE: Should report errors.");
+    mu_assert(serve_request(fd,
+                            "(fun {spin n} {(if (= n 0) {0} "
+                            "{(+ (spin (- n 1)) (spin (- n 1)))})}) (spin 40)",
+                            LSERVE_ERROR, "<error: Evaluation timed out.>"),
+              "SERVE: Should time out.");
+    mu_assert(serve_request(fd, "(+ x 1)", LSERVE_OK, "21"),
+              "SERVE: Should serve requests after a timeout.");
+    close(fd);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    mu_assert(connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0,
+              "SERVE: Could not connect again to the server.");
+    mu_assert(serve_request(fd, "x", LSERVE_ERROR,
+                            "<error: Unbound symbol 'x'.>"),
+              "SERVE: Connections should not see each other's definitions.");
+
+    // Stopping closes the connections left, rather than wait for them
+    lserve_stop();
+    pthread_join(thread, NULL);
+    char c;
+    mu_assert(read(fd, &c, 1) == 0,
+              "SERVE: Should close connections when stopped.");
+    close(fd);
+    return 0;
+}
+
+static char ZYGOTE_PATH[64];
+
+static void *zygote(void *arg) {
+    lzygote(ZYGOTE_PATH, arg);
+    return NULL;
+}
+
+// Run a script in the zygote and compare the start of its output with text
+static int zygote_job(char *script, char *text) {
+    struct sockaddr_un addr = {AF_UNIX};
+    strcpy(addr.sun_path, ZYGOTE_PATH);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    int tries = 0;
+    while (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) && tries++ < 500) {
+        usleep(10000);
+    }
+    char out[256];
+    size_t len = 0;
+    ssize_t n = 0;
+    if (lserve_write_frame(fd, 0, script, strlen(script)) == 0) {
+        while ((n = read(fd, out + len, sizeof(out) - 1 - len)) > 0) {
+            len += n;
+        }
+    }
+    close(fd);
+    out[len] = '\0';
+    return n == 0 && strncmp(out, text, strlen(text)) == 0;
+}
+
+static void write_script(char *path, char *src) {
+    FILE *f = fopen(path, "w");
+    fputs(src, f);
+    fclose(f);
+}
+
+static char *test_zygote() {
+    snprintf(ZYGOTE_PATH, sizeof(ZYGOTE_PATH), "/tmp/jblisp-zygote-%d.sock",
+             (int) getpid());
+    linterp *it = linterp_new();
+    lval_del(eval_line(it, "(def {answer} 42)"));
+    write_script("build/test-zygote-ok.jbl",
+                 "(if (= answer 42) {(def {answer} 0)} {(error 1)})");
+    write_script("build/test-zygote-err.jbl", "nope");
+    pthread_t thread;
+    pthread_create(&thread, NULL, zygote, it);
+
+    char *ok = "Loading file 'build/test-zygote-ok.jbl'...\n"
+               "done\n";
+    mu_assert(zygote_job("build/test-zygote-ok.jbl", ok),
+              "ZYGOTE: Should run a job with the definitions of the zygote.");
+    // A client that sends nothing must not hold up the others
+    struct sockaddr_un addr = {AF_UNIX};
+    strcpy(addr.sun_path, ZYGOTE_PATH);
+    int silent = socket(AF_UNIX, SOCK_STREAM, 0);
+    mu_assert(connect(silent, (struct sockaddr*) &addr, sizeof(addr)) == 0,
+              "ZYGOTE: Could not connect to the zygote.");
+    mu_assert(zygote_job("build/test-zygote-ok.jbl", ok),
+              "ZYGOTE: Jobs should not change the zygote.");
+    char *late = "build/test-zygote-ok.jbl";
+    char out[64];
+    mu_assert(lserve_write_frame(silent, 0, late, strlen(late)) == 0 &&
+              read(silent, out, sizeof(out)) > 0 &&
+              strncmp(out, "Loading", 7) == 0,
+              "ZYGOTE: Should run the job of a client that was slow to send.");
+    close(silent);
+    mu_assert(zygote_job("build/test-zygote-err.jbl",
+                         "Loading file 'build/test-zygote-err.jbl'...\n"
+                         "<error: Unbound symbol 'nope'.>"),
+              "ZYGOTE: Should send errors of a job.");
+
+    lserve_stop();
+    pthread_join(thread, NULL);
+    linterp_del(it);
+    return 0;
+}
+
 static char *all_tests() {
     mu_run_test(test_lval);
     mu_run_test(test_lenv);
+    mu_run_test(test_image);
+    mu_run_test(test_interp_threads);
+    mu_run_test(test_fork);
+    mu_run_test(test_profile);
+    mu_run_test(test_trace);
+    mu_run_test(test_backtrace);
+    mu_run_test(test_port_close);
+    mu_run_test(test_heap);
+    mu_run_test(test_serve);
+    mu_run_test(test_zygote);
     return 0;
 }
 
@@ -0,0 +1,129 @@
+#define _DEFAULT_SOURCE
+// Summarizes a heap dump written by (heap-dump "file"): the objects and
+// bytes of every kind, then the objects retaining the most bytes with the
+// path they were reached by. An object retains its own bytes and those of
+// the objects first reached through it.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    long parent;
+    char kind[32];
+    long bytes;
+    long retained;
+    long objects;
+    char *label;
+} hobj;
+
+typedef struct {
+    char kind[32];
+    long count;
+    long bytes;
+} hkind;
+
+static hobj *OBJS;
+
+static int cmp_retained(const void *a, const void *b) {
+    long x = OBJS[*(const long*) a].retained;
+    long y = OBJS[*(const long*) b].retained;
+    return (x < y) - (x > y);
+}
+
+static int cmp_bytes(const void *a, const void *b) {
+    long x = ((const hkind*) a)->bytes;
+    long y = ((const hkind*) b)->bytes;
+    return (x < y) - (x > y);
+}
+
+// Print the labels from the root to object i, like global.xs[3]
+static void print_path(long i) {
+    if (OBJS[i].parent > 0) {
+        print_path(OBJS[i].parent);
+        if (OBJS[i].label[0] != '[') { putchar('.'); }
+    }
+    fputs(OBJS[i].label, stdout);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: %s DUMP [TOP]\n", argv[0]);
+        return 1;
+    }
+    int top = argc == 3 ? atoi(argv[2]) : 20;
+    FILE *f = fopen(argv[1], "r");
+    if (f == NULL) {
+        fprintf(stderr, "%s: cannot read '%s'\n", argv[0], argv[1]);
+        return 1;
+    }
+
+    // Objects are numbered from 1, in order, after their parents
+    long count = 0;
+    long size = 1024;
+    OBJS = malloc(size * sizeof(hobj));
+    char line[4096];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (line[0] == '#') { continue; }
+        if (count + 1 == size) {
+            size *= 2;
+            OBJS = realloc(OBJS, size * sizeof(hobj));
+        }
+        hobj *o = &OBJS[count + 1];
+        long id;
+        int label;
+        if (sscanf(line, "%li\t%li\t%31[^\t]\t%li\t%n", &id, &o->parent,
+                   o->kind, &o->bytes, &label) != 4 || id != count + 1 ||
+            o->parent < 0 || o->parent > count) {
+            fprintf(stderr, "%s: malformed dump at object %li\n", argv[0],
+                    count + 1);
+            return 1;
+        }
+        line[strcspn(line, "\n")] = '\0';
+        o->label = strdup(line + label);
+        o->retained = o->bytes;
+        o->objects = 1;
+        count++;
+    }
+    fclose(f);
+
+    for (long i=count; i > 0; i--) {
+        long p = OBJS[i].parent;
+        if (p > 0) {
+            OBJS[p].retained += OBJS[i].retained;
+            OBJS[p].objects += OBJS[i].objects;
+        }
+    }
+
+    hkind *kinds = calloc(count + 1, sizeof(hkind));
+    int nkinds = 0;
+    long total = 0;
+    for (long i=1; i <= count; i++) {
+        int k = 0;
+        while (k < nkinds && strcmp(kinds[k].kind, OBJS[i].kind)) { k++; }
+        if (k == nkinds) { strcpy(kinds[nkinds++].kind, OBJS[i].kind); }
+        kinds[k].count++;
+        kinds[k].bytes += OBJS[i].bytes;
+        total += OBJS[i].bytes;
+    }
+    qsort(kinds, nkinds, sizeof(hkind), cmp_bytes);
+    printf("%li objects, %li bytes\n\n", count, total);
+    printf("%-16s %10s %12s\n", "kind", "objects", "bytes");
+    for (int k=0; k < nkinds; k++) {
+        printf("%-16s %10li %12li\n", kinds[k].kind, kinds[k].count,
+               kinds[k].bytes);
+    }
+
+    long *order = malloc((count + 1) * sizeof(long));
+    for (long i=0; i < count; i++) { order[i] = i + 1; }
+    qsort(order, count, sizeof(long), cmp_retained);
+    printf("\n%12s %10s  %-12s %s\n", "retained", "objects", "kind", "path");
+    for (long i=0; i < count && i < top; i++) {
+        hobj *o = &OBJS[order[i]];
+        printf("%12li %10li  %-12s ", o->retained, o->objects, o->kind);
+        print_path(order[i]);
+        putchar('\n');
+    }
+    free(order);
+    free(kinds);
+    return 0;
+}
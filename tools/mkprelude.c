@@ -0,0 +1,48 @@
+// Evaluates a jblisp source file and writes the resulting global env as
+// an image embedded in a C source file, see lenv_dump.
+#include <stdio.h>
+
+#include "../mpc.h"
+#include "../jblisp.h"
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s SOURCE OUTPUT\n", argv[0]);
+        return 1;
+    }
+    linterp *interp = linterp_new();
+
+    lval *x = load_file(interp, argv[1]);
+    if (x != NULL && lval_type(x) == LVAL_ERR) {
+        lval_println(x);
+        return 1;
+    }
+    if (x != NULL) { lval_del(x); }
+
+    size_t len;
+    unsigned char *image = lenv_dump(linterp_env(interp), &len);
+    if (image == NULL) {
+        fprintf(stderr, "%s: cannot image the environment of '%s'\n",
+                argv[0], argv[1]);
+        return 1;
+    }
+
+    FILE *f = fopen(argv[2], "w");
+    if (f == NULL) {
+        perror(argv[2]);
+        return 1;
+    }
+    fprintf(f, "// Generated by tools/mkprelude from %s, do not edit.\n", argv[1]);
+    fprintf(f, "#include <stddef.h>\n\n");
+    fprintf(f, "const unsigned char PRELUDE_IMAGE[] = {");
+    for (size_t i=0; i < len; i++) {
+        fprintf(f, "%s0x%02x,", i % 12 ? " " : "\n    ", image[i]);
+    }
+    fprintf(f, "\n};\n\n");
+    fprintf(f, "const size_t PRELUDE_IMAGE_LEN = sizeof(PRELUDE_IMAGE);\n");
+    fclose(f);
+
+    free(image);
+    linterp_del(interp);
+    return 0;
+}